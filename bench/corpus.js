@@ -0,0 +1,332 @@
+// Generates the benchmark corpus: files of the common formats, built from a
+// fixed seed so that every run (and every release) inspects the same bytes
+
+var fs = require('fs');
+var path = require('path');
+var zlib = require('zlib');
+
+// mulberry32
+function Random(seed) {
+  this.state = seed >>> 0;
+}
+Random.prototype.next = function() {
+  var t = (this.state = (this.state + 0x6D2B79F5) >>> 0);
+  t = Math.imul(t ^ (t >>> 15), t | 1);
+  t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+  return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+};
+Random.prototype.int = function(n) {
+  return Math.floor(this.next() * n);
+};
+Random.prototype.bytes = function(n) {
+  var buf = Buffer.alloc(n);
+  for (var i = 0; i < n; ++i)
+    buf[i] = this.int(256);
+  return buf;
+};
+
+var WORDS = ('lorem ipsum dolor sit amet consectetur adipiscing elit sed do '
+             + 'eiusmod tempor incididunt ut labore et dolore magna aliqua')
+            .split(' ');
+var ACCENTED = ['été', 'naïve', 'façade', 'über', 'smörgåsbord', 'niño',
+                'crème', 'déjà', 'Ærø', 'żółw'];
+var CJK = ['日本語', '文字', '漢字', '中文', '한국어'];
+
+function words(rnd, n, extra) {
+  var out = [];
+  for (var i = 0; i < n; ++i) {
+    if (extra && rnd.int(4) === 0)
+      out.push(extra[rnd.int(extra.length)]);
+    else
+      out.push(WORDS[rnd.int(WORDS.length)]);
+    if (i % 12 === 11)
+      out.push('\n');
+  }
+  return out.join(' ') + '\n';
+}
+
+var CRC_TABLE = (function() {
+  var table = new Array(256);
+  for (var n = 0; n < 256; ++n) {
+    var c = n;
+    for (var k = 0; k < 8; ++k)
+      c = (c & 1 ? 0xEDB88320 ^ (c >>> 1) : c >>> 1);
+    table[n] = c >>> 0;
+  }
+  return table;
+})();
+
+function crc32(buf) {
+  var c = 0xFFFFFFFF;
+  for (var i = 0; i < buf.length; ++i)
+    c = CRC_TABLE[(c ^ buf[i]) & 0xFF] ^ (c >>> 8);
+  return (c ^ 0xFFFFFFFF) >>> 0;
+}
+
+function pngChunk(type, data) {
+  var head = Buffer.alloc(8);
+  head.writeUInt32BE(data.length, 0);
+  head.write(type, 4, 'binary');
+  var crc = Buffer.alloc(4);
+  crc.writeUInt32BE(crc32(Buffer.concat([head.slice(4), data])), 0);
+  return Buffer.concat([head, data, crc]);
+}
+
+function png(rnd, size) {
+  var ihdr = Buffer.alloc(13);
+  ihdr.writeUInt32BE(16 + rnd.int(4096), 0);
+  ihdr.writeUInt32BE(16 + rnd.int(4096), 4);
+  ihdr[8] = 8;
+  ihdr[9] = 2;
+  return Buffer.concat([
+    Buffer.from([0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A]),
+    pngChunk('IHDR', ihdr),
+    pngChunk('IDAT', zlib.deflateSync(rnd.bytes(size))),
+    pngChunk('IEND', Buffer.alloc(0))
+  ]);
+}
+
+function jpeg(rnd, size) {
+  var app0 = Buffer.from([
+    0xFF, 0xD8, 0xFF, 0xE0, 0x00, 0x10, 0x4A, 0x46, 0x49, 0x46, 0x00, 0x01,
+    0x01, 0x00, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00
+  ]);
+  var sof = Buffer.from([
+    0xFF, 0xC0, 0x00, 0x11, 0x08, 0x01, 0x00, 0x01, 0x00, 0x03, 0x01, 0x22,
+    0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01
+  ]);
+  return Buffer.concat([app0, sof, rnd.bytes(size),
+                        Buffer.from([0xFF, 0xD9])]);
+}
+
+function gif(rnd, size) {
+  var head = Buffer.alloc(13);
+  head.write('GIF89a', 0, 'binary');
+  head.writeUInt16LE(1 + rnd.int(2048), 6);
+  head.writeUInt16LE(1 + rnd.int(2048), 8);
+  head[10] = 0xF7;
+  return Buffer.concat([head, rnd.bytes(size), Buffer.from([0x3B])]);
+}
+
+function zip(rnd, size) {
+  var name = Buffer.from('file' + rnd.int(1000) + '.txt');
+  var data = Buffer.from(words(rnd, size / 6));
+  var crc = crc32(data);
+  var local = Buffer.alloc(30);
+  local.writeUInt32LE(0x04034B50, 0);
+  local.writeUInt16LE(10, 4);
+  local.writeUInt32LE(crc, 14);
+  local.writeUInt32LE(data.length, 18);
+  local.writeUInt32LE(data.length, 22);
+  local.writeUInt16LE(name.length, 26);
+  var central = Buffer.alloc(46);
+  central.writeUInt32LE(0x02014B50, 0);
+  central.writeUInt16LE(20, 4);
+  central.writeUInt16LE(10, 6);
+  central.writeUInt32LE(crc, 16);
+  central.writeUInt32LE(data.length, 20);
+  central.writeUInt32LE(data.length, 24);
+  central.writeUInt16LE(name.length, 28);
+  var end = Buffer.alloc(22);
+  end.writeUInt32LE(0x06054B50, 0);
+  end.writeUInt16LE(1, 8);
+  end.writeUInt16LE(1, 10);
+  end.writeUInt32LE(central.length + name.length, 12);
+  end.writeUInt32LE(local.length + name.length + data.length, 16);
+  return Buffer.concat([local, name, data, central, name, end]);
+}
+
+function tar(rnd, size) {
+  var data = Buffer.from(words(rnd, size / 6));
+  var head = Buffer.alloc(512);
+  head.write('file' + rnd.int(1000) + '.txt', 0, 'binary');
+  head.write('0000644\0', 100, 'binary');
+  head.write('0001750\0', 108, 'binary');
+  head.write('0001750\0', 116, 'binary');
+  head.write(('00000000000' + data.length.toString(8)).slice(-11) + '\0',
+             124, 'binary');
+  head.write('14000000000\0', 136, 'binary');
+  head.write('        ', 148, 'binary');
+  head.write('0', 156, 'binary');
+  head.write('ustar\0' + '00', 257, 'binary');
+  var sum = 0;
+  for (var i = 0; i < 512; ++i)
+    sum += head[i];
+  head.write(('000000' + sum.toString(8)).slice(-6) + '\0 ', 148, 'binary');
+  var pad = Buffer.alloc((512 - data.length % 512) % 512 + 1024);
+  return Buffer.concat([head, data, pad]);
+}
+
+// The header of an OLE2 compound document (as used by legacy Office
+// formats), followed by sectors of noise
+function cdf(rnd, size) {
+  var head = Buffer.alloc(512, 0xFF);
+  Buffer.from([0xD0, 0xCF, 0x11, 0xE0, 0xA1, 0xB1, 0x1A, 0xE1]).copy(head);
+  head.fill(0, 8, 24);
+  head.writeUInt16LE(0x003E, 24);
+  head.writeUInt16LE(0x0003, 26);
+  head.writeUInt16LE(0xFFFE, 28);
+  head.writeUInt16LE(9, 30);
+  head.writeUInt16LE(6, 32);
+  head.fill(0, 34, 44);
+  head.writeUInt32LE(1, 44);
+  head.writeUInt32LE(1, 48);
+  head.writeUInt32LE(0, 52);
+  head.writeUInt32LE(4096, 56);
+  head.writeUInt32LE(0xFFFFFFFE, 60);
+  head.writeUInt32LE(0, 64);
+  head.writeUInt32LE(0xFFFFFFFE, 68);
+  head.writeUInt32LE(0, 72);
+  head.writeUInt32LE(0, 76);
+  return Buffer.concat([head, rnd.bytes(Math.ceil(size / 512) * 512)]);
+}
+
+function elf(rnd, size) {
+  var head = Buffer.alloc(64);
+  Buffer.from([0x7F, 0x45, 0x4C, 0x46, 2, 1, 1, 0]).copy(head);
+  head.writeUInt16LE(2, 16);
+  head.writeUInt16LE(62, 18);
+  head.writeUInt32LE(1, 20);
+  head.writeUInt32LE(0x401000, 24);
+  head.writeUInt16LE(64, 52);
+  head.writeUInt16LE(56, 54);
+  head.writeUInt16LE(64, 58);
+  return Buffer.concat([head, rnd.bytes(size)]);
+}
+
+function pdf(rnd, size) {
+  return Buffer.concat([
+    Buffer.from('%PDF-1.4\n%\xE2\xE3\xCF\xD3\n1 0 obj\n<< /Type /Catalog >>\n'
+                + 'endobj\n', 'binary'),
+    rnd.bytes(size),
+    Buffer.from('\n%%EOF\n')
+  ]);
+}
+
+function gzip(rnd, size) {
+  return zlib.gzipSync(Buffer.from(words(rnd, size / 6)));
+}
+
+function bzip2(rnd, size) {
+  return Buffer.concat([Buffer.from('BZh91AY&SY', 'binary'),
+                        rnd.bytes(size)]);
+}
+
+function xz(rnd, size) {
+  return Buffer.concat([
+    Buffer.from([0xFD, 0x37, 0x7A, 0x58, 0x5A, 0x00, 0x00, 0x04]),
+    rnd.bytes(size)
+  ]);
+}
+
+function ascii(rnd, size) {
+  return Buffer.from(words(rnd, size / 6));
+}
+
+function utf8(rnd, size) {
+  return Buffer.from(words(rnd, size / 7, ACCENTED.concat(CJK)), 'utf8');
+}
+
+function utf16(rnd, size) {
+  return Buffer.concat([Buffer.from([0xFF, 0xFE]),
+                        Buffer.from(words(rnd, size / 14, ACCENTED),
+                                    'utf16le')]);
+}
+
+function latin1(rnd, size) {
+  return Buffer.from(words(rnd, size / 7, ACCENTED.slice(0, 8)), 'binary');
+}
+
+function html(rnd, size) {
+  return Buffer.from('<!DOCTYPE html>\n<html>\n<head><title>'
+                     + WORDS[rnd.int(WORDS.length)] + '</title></head>\n'
+                     + '<body>\n<p>' + words(rnd, size / 6) + '</p>\n'
+                     + '</body>\n</html>\n');
+}
+
+function json(rnd, size) {
+  var list = [];
+  for (var n = 0; n * 40 < size; ++n) {
+    list.push({ id: n, name: WORDS[rnd.int(WORDS.length)],
+                value: rnd.int(100000) / 100 });
+  }
+  return Buffer.from(JSON.stringify(list, null, 2) + '\n');
+}
+
+function script(rnd, size) {
+  var lines = ['#!/bin/sh', 'set -e'];
+  for (var len = 0; len < size; len += lines[lines.length - 1].length + 1)
+    lines.push('echo "' + words(rnd, 6).trim() + '"');
+  return Buffer.from(lines.join('\n') + '\n');
+}
+
+function csource(rnd, size) {
+  var lines = ['#include <stdio.h>', '', 'int main(void) {'];
+  for (var len = 0; len < size; len += lines[lines.length - 1].length + 1) {
+    lines.push('  printf("%s\\n", "' + WORDS[rnd.int(WORDS.length)]
+               + '");');
+  }
+  lines.push('  return 0;', '}');
+  return Buffer.from(lines.join('\n') + '\n');
+}
+
+function random(rnd, size) {
+  return rnd.bytes(size);
+}
+
+var KINDS = {
+  png: png, jpeg: jpeg, gif: gif, zip: zip, tar: tar, cdf: cdf, elf: elf,
+  pdf: pdf, gzip: gzip, bzip2: bzip2, xz: xz, ascii: ascii, utf8: utf8,
+  utf16: utf16, latin1: latin1, html: html, json: json, script: script,
+  c: csource, random: random
+};
+
+// Bytes of payload of the files of each kind
+var SIZES = [512, 8192, 65536, 1048576];
+
+var DEFAULT_SEED = 0x6D6D6D;
+
+// Returns [{ kind, name, data }, ...], the same for the same `seed'
+function build(seed) {
+  var rnd = new Random(seed === undefined ? DEFAULT_SEED : seed);
+  var files = [];
+  Object.keys(KINDS).forEach(function(kind) {
+    SIZES.forEach(function(size) {
+      files.push({
+        kind: kind,
+        name: kind + '-' + size,
+        data: KINDS[kind](rnd, size)
+      });
+    });
+  });
+  return files;
+}
+
+// Writes the corpus to `dir' and adds a `path' to each file
+function write(files, dir) {
+  if (!fs.existsSync(dir))
+    fs.mkdirSync(dir);
+  files.forEach(function(file) {
+    file.path = path.join(dir, file.name);
+    fs.writeFileSync(file.path, file.data);
+  });
+  return files;
+}
+
+// `node bench/corpus.js <dir>' writes the corpus, e.g. for
+// bench/microbench.c
+if (require.main === module) {
+  if (process.argv.length !== 3) {
+    console.error('Usage: node bench/corpus.js <dir>');
+    process.exit(2);
+  }
+  write(build(), process.argv[2]);
+}
+
+module.exports = {
+  build: build,
+  write: write,
+  defaultSeed: DEFAULT_SEED,
+  kinds: Object.keys(KINDS),
+  sizes: SIZES
+};
@@ -0,0 +1,235 @@
+// Measures the throughput and latency of detect() and detectFile() over the
+// generated corpus (see corpus.js), for each combination of flags and
+// concurrency, and prints the results as JSON.
+//
+//   node bench/index.js [--magic <path>] [--methods detect,detectFile]
+//                       [--flags NONE,MIME_TYPE,...] [--concurrency 1,4,...]
+//                       [--duration <ms>] [--seed <n>] [--out <file>]
+//
+// Flags are the names of the MAGIC_* constants without the prefix, joined
+// with `+' to combine them (e.g. `MIME_TYPE+CONTINUE').
+
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+
+var mmm = require('../lib/index');
+var corpus = require('./corpus');
+
+var DEFAULTS = {
+  magic: undefined,
+  methods: 'detect,detectFile',
+  flags: 'NONE,MIME_TYPE,MIME,CONTINUE',
+  concurrency: '1,4,16',
+  duration: '2000',
+  seed: undefined,
+  out: undefined
+};
+
+function parseArgs(argv) {
+  var opts = {};
+  Object.keys(DEFAULTS).forEach(function(key) {
+    opts[key] = DEFAULTS[key];
+  });
+  for (var i = 0; i < argv.length; ++i) {
+    var m = /^--([a-z]+)$/.exec(argv[i]);
+    if (m === null || !(m[1] in DEFAULTS) || i + 1 === argv.length)
+      throw new Error('Unknown or incomplete option: ' + argv[i]);
+    opts[m[1]] = argv[++i];
+  }
+  return {
+    magic: opts.magic,
+    methods: opts.methods.split(','),
+    flags: opts.flags.split(','),
+    concurrency: opts.concurrency.split(',').map(Number),
+    duration: Number(opts.duration),
+    seed: (opts.seed === undefined ? corpus.defaultSeed : Number(opts.seed)),
+    out: opts.out
+  };
+}
+
+function flagValue(name) {
+  return name.split('+').reduce(function(flags, part) {
+    var value = mmm['MAGIC_' + part];
+    if (typeof value !== 'number')
+      throw new Error('Unknown flag: ' + part);
+    return flags | value;
+  }, 0);
+}
+
+function elapsedMs(start) {
+  var diff = process.hrtime(start);
+  return diff[0] * 1e3 + diff[1] / 1e6;
+}
+
+function percentile(sorted, p) {
+  if (sorted.length === 0)
+    return 0;
+  var i = Math.ceil(p / 100 * sorted.length) - 1;
+  return sorted[Math.max(0, Math.min(sorted.length - 1, i))];
+}
+
+function round(ms) {
+  return Math.round(ms * 1000) / 1000;
+}
+
+// Runs `method' with `concurrency' calls in flight until `duration' ms have
+// passed, going round the corpus in order
+function measure(magic, method, files, concurrency, duration, cb) {
+  var latencies = [];
+  var errors = 0;
+  var bytes = 0;
+  var next = 0;
+  var inFlight = 0;
+  var stopping = false;
+  var start = process.hrtime();
+
+  function issue() {
+    var file = files[next];
+    var arg = (method === 'detectFile' ? file.path : file.data);
+    var t = process.hrtime();
+    next = (next + 1) % files.length;
+    ++inFlight;
+    magic[method](arg, function(err) {
+      latencies.push(elapsedMs(t));
+      bytes += file.data.length;
+      if (err)
+        ++errors;
+      --inFlight;
+      if (!stopping && elapsedMs(start) >= duration)
+        stopping = true;
+      if (!stopping)
+        return issue();
+      if (inFlight === 0)
+        done();
+    });
+  }
+
+  function done() {
+    var seconds = elapsedMs(start) / 1e3;
+    var sum = 0;
+    latencies.sort(function(a, b) { return a - b; });
+    latencies.forEach(function(ms) { sum += ms; });
+    cb({
+      ops: latencies.length,
+      errors: errors,
+      seconds: round(seconds),
+      opsPerSec: round(latencies.length / seconds),
+      mbPerSec: round(bytes / 1048576 / seconds),
+      latency: {
+        mean: round(sum / latencies.length),
+        p50: round(percentile(latencies, 50)),
+        p90: round(percentile(latencies, 90)),
+        p99: round(percentile(latencies, 99)),
+        max: round(latencies[latencies.length - 1])
+      }
+    });
+  }
+
+  for (var i = 0; i < concurrency; ++i)
+    issue();
+}
+
+// One pass over the corpus, so that the database is loaded and the files
+// are in the page cache
+function warmUp(magic, method, files, cb) {
+  var i = 0;
+  (function next() {
+    if (i === files.length)
+      return cb();
+    var file = files[i++];
+    magic[method](method === 'detectFile' ? file.path : file.data, next);
+  })();
+}
+
+function main() {
+  var opts = parseArgs(process.argv.slice(2));
+  var files = corpus.build(opts.seed);
+  var dir = fs.mkdtempSync(path.join(os.tmpdir(), 'mmmagic-bench-'));
+  var runs = [];
+  var results = [];
+
+  corpus.write(files, dir);
+  opts.methods.forEach(function(method) {
+    if (method !== 'detect' && method !== 'detectFile')
+      throw new Error('Unknown method: ' + method);
+    opts.flags.forEach(function(flags) {
+      opts.concurrency.forEach(function(concurrency) {
+        runs.push({
+          method: method,
+          flags: flags,
+          concurrency: concurrency
+        });
+      });
+    });
+  });
+
+  function cleanup() {
+    files.forEach(function(file) {
+      fs.unlinkSync(file.path);
+    });
+    fs.rmdirSync(dir);
+  }
+
+  function nextRun(i) {
+    if (i === runs.length) {
+      cleanup();
+      return report(opts, files, results);
+    }
+    var run = runs[i];
+    var magic = (opts.magic === undefined
+                 ? new mmm.Magic(flagValue(run.flags))
+                 : new mmm.Magic(opts.magic, flagValue(run.flags)));
+    warmUp(magic, run.method, files, function() {
+      measure(magic, run.method, files, run.concurrency, opts.duration,
+              function(result) {
+        result.method = run.method;
+        result.flags = run.flags;
+        result.concurrency = run.concurrency;
+        results.push(result);
+        process.stderr.write(run.method + ' ' + run.flags + ' x'
+                             + run.concurrency + ': '
+                             + result.opsPerSec + ' ops/sec, p99 '
+                             + result.latency.p99 + ' ms\n');
+        nextRun(i + 1);
+      });
+    });
+  }
+
+  process.on('exit', function() {
+    if (fs.existsSync(dir))
+      cleanup();
+  });
+  nextRun(0);
+}
+
+function report(opts, files, results) {
+  var bytes = 0;
+  files.forEach(function(file) {
+    bytes += file.data.length;
+  });
+  var output = JSON.stringify({
+    version: require('../package.json').version,
+    node: process.version,
+    platform: process.platform,
+    arch: process.arch,
+    cpus: os.cpus().length,
+    threadpool: Number(process.env.UV_THREADPOOL_SIZE) || 4,
+    date: new Date().toISOString(),
+    durationMs: opts.duration,
+    corpus: {
+      seed: opts.seed,
+      files: files.length,
+      bytes: bytes,
+      kinds: corpus.kinds,
+      sizes: corpus.sizes
+    },
+    results: results
+  }, null, 2);
+  if (opts.out !== undefined)
+    fs.writeFileSync(opts.out, output + '\n');
+  else
+    console.log(output);
+}
+
+main();
@@ -0,0 +1,315 @@
+/*
+ * Times libmagic's hot paths in isolation, without the threadpool and
+ * callbacks of the binding in the way:
+ *
+ *   load       magic_open() + magic_load() + magic_close()
+ *   buffer     magic_buffer(), everything a detection does
+ *   encoding   file_encoding(), the text encoding checks
+ *   softmagic  file_softmagic(), the magic entries alone
+ *   getbuffer  file_getbuffer(), formatting the result
+ *
+ * Each test runs over every file given (see `node bench/corpus.js <dir>'
+ * for a corpus), first for the warmup passes and then for the measured
+ * ones.  The loop of each test is a function of its own, with nothing but
+ * the calls being measured in it, so that `perf record' attributes samples
+ * cleanly and `perf stat' can count a single test (-t).
+ *
+ * Build with `node-gyp configure -- -Dmagic_bench=1 && node-gyp build'.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file.h"
+
+struct input {
+	const char *path;
+	unsigned char *buf;
+	size_t len;
+	int looks_text;
+};
+
+struct options {
+	const char *magicfile;
+	int flags;
+	unsigned iterations;
+	unsigned warmup;
+};
+
+typedef void (*test_fn)(struct magic_set *, const struct options *,
+    const struct input *, size_t);
+
+/* Keeps the compiler from dropping the results */
+static volatile size_t sink;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static struct magic_set *
+open_magic(const struct options *opts)
+{
+	struct magic_set *ms = magic_open(opts->flags);
+
+	if (ms == NULL) {
+		fprintf(stderr, "magic_open: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (magic_load(ms, opts->magicfile) == -1) {
+		fprintf(stderr, "magic_load: %s\n", magic_error(ms));
+		exit(1);
+	}
+	return ms;
+}
+
+static void __attribute__((__noinline__))
+test_load(struct magic_set *ms, const struct options *opts,
+    const struct input *in, size_t nin)
+{
+	magic_close(open_magic(opts));
+}
+
+static void __attribute__((__noinline__))
+test_buffer(struct magic_set *ms, const struct options *opts,
+    const struct input *in, size_t nin)
+{
+	size_t i;
+
+	for (i = 0; i < nin; i++)
+		sink += (size_t)magic_buffer(ms, in[i].buf, in[i].len);
+}
+
+static void __attribute__((__noinline__))
+test_encoding(struct magic_set *ms, const struct options *opts,
+    const struct input *in, size_t nin)
+{
+	unichar *ubuf;
+	size_t i, ulen;
+	const char *code, *code_mime, *type;
+
+	for (i = 0; i < nin; i++) {
+		ubuf = NULL;
+		sink += file_encoding(ms, in[i].buf, in[i].len, &ubuf, &ulen,
+		    &code, &code_mime, &type);
+		free(ubuf);
+	}
+}
+
+static void __attribute__((__noinline__))
+test_softmagic(struct magic_set *ms, const struct options *opts,
+    const struct input *in, size_t nin)
+{
+	size_t i;
+
+	for (i = 0; i < nin; i++) {
+		file_reset(ms, 1);
+		sink += file_softmagic(ms, in[i].buf, in[i].len, NULL, NULL,
+		    BINTEST, in[i].looks_text);
+	}
+}
+
+/* Formats the result the last detection left, once for each file */
+static void __attribute__((__noinline__))
+test_getbuffer(struct magic_set *ms, const struct options *opts,
+    const struct input *in, size_t nin)
+{
+	size_t i;
+
+	for (i = 0; i < nin; i++)
+		sink += (size_t)file_getbuffer(ms);
+}
+
+static const struct {
+	const char *name;
+	test_fn fn;
+	int per_file;		/* runs over the files (throughput applies) */
+} tests[] = {
+	{ "load", test_load, 0 },
+	{ "buffer", test_buffer, 1 },
+	{ "encoding", test_encoding, 1 },
+	{ "softmagic", test_softmagic, 1 },
+	{ "getbuffer", test_getbuffer, 1 },
+};
+#define NTESTS	(sizeof(tests) / sizeof(tests[0]))
+
+/* Whether `name' is one of the comma-separated tests in `list' */
+static int
+selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = list; p != NULL; p = strchr(p, ',')) {
+		if (*p == ',')
+			p++;
+		if (strncmp(p, name, len) == 0 &&
+		    (p[len] == '\0' || p[len] == ','))
+			return 1;
+	}
+	return 0;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+run(size_t t, const struct options *opts, const struct input *in,
+    size_t nin, size_t bytes)
+{
+	struct magic_set *ms = open_magic(opts);
+	uint64_t *ns, total = 0, start;
+	size_t i, ops;
+
+	if ((ns = calloc(opts->iterations, sizeof(*ns))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	/* getbuffer formats whatever the last detection left */
+	if (tests[t].fn == test_getbuffer && nin > 0)
+		magic_buffer(ms, in[nin - 1].buf, in[nin - 1].len);
+
+	for (i = 0; i < opts->warmup; i++)
+		tests[t].fn(ms, opts, in, nin);
+	for (i = 0; i < opts->iterations; i++) {
+		start = now_ns();
+		tests[t].fn(ms, opts, in, nin);
+		ns[i] = now_ns() - start;
+		total += ns[i];
+	}
+	qsort(ns, opts->iterations, sizeof(*ns), cmp_u64);
+
+	ops = tests[t].per_file ? nin : 1;
+	printf("%-10s %8u %12.1f %12.1f %12.1f %10.1f\n", tests[t].name,
+	    opts->iterations,
+	    (double)total / opts->iterations / ops,
+	    (double)ns[0] / ops,
+	    (double)ns[opts->iterations / 2] / ops,
+	    tests[t].per_file ?
+	    (double)bytes * opts->iterations / 1048576 / (total / 1e9) : 0.0);
+
+	free(ns);
+	magic_close(ms);
+}
+
+static int
+read_input(struct input *in, const char *path, size_t max)
+{
+	FILE *fp;
+	size_t n;
+
+	in->path = path;
+	if ((fp = fopen(path, "rb")) == NULL ||
+	    (in->buf = malloc(max)) == NULL) {
+		perror(path);
+		return -1;
+	}
+	n = fread(in->buf, 1, max, fp);
+	if (ferror(fp)) {
+		perror(path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	in->len = n;
+	return 0;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-m magicfile] [-f flags] [-n iterations] "
+	    "[-w warmup] [-t test[,test...]] file...\n"
+	    "Tests: load, buffer, encoding, softmagic, getbuffer\n", prog);
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct options opts;
+	struct input *in;
+	struct magic_set *ms;
+	const char *only = NULL;
+	size_t i, t, nin, bytes = 0, max;
+	unichar *ubuf;
+	size_t ulen;
+	const char *code, *code_mime, *type;
+	int c;
+
+	opts.magicfile = NULL;
+	opts.flags = MAGIC_NONE;
+	opts.iterations = 20;
+	opts.warmup = 2;
+	while ((c = getopt(argc, argv, "m:f:n:w:t:")) != -1) {
+		switch (c) {
+		case 'm':
+			opts.magicfile = optarg;
+			break;
+		case 'f':
+			opts.flags = (int)strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.iterations = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			opts.warmup = (unsigned)strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.iterations == 0 || optind == argc)
+		usage(argv[0]);
+
+	/* Files are read as far as libmagic would read them */
+	ms = open_magic(&opts);
+	magic_getparam(ms, MAGIC_PARAM_BYTES_MAX, &max);
+	nin = (size_t)(argc - optind);
+	if ((in = calloc(nin + 1, sizeof(*in))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < nin; i++) {
+		if (read_input(&in[i], argv[optind + i], max) == -1)
+			return 1;
+		ubuf = NULL;
+		in[i].looks_text = file_encoding(ms, in[i].buf, in[i].len,
+		    &ubuf, &ulen, &code, &code_mime, &type);
+		free(ubuf);
+		bytes += in[i].len;
+	}
+	magic_close(ms);
+
+	printf("# %zu files, %zu bytes; times in ns per call\n", nin, bytes);
+	printf("%-10s %8s %12s %12s %12s %10s\n", "test", "iters", "mean",
+	    "min", "median", "MB/s");
+	for (t = 0; t < NTESTS; t++) {
+		if (only == NULL || selected(only, tests[t].name))
+			run(t, &opts, in, nin, bytes);
+	}
+
+	for (i = 0; i < nin; i++)
+		free(in[i].buf);
+	free(in);
+	return 0;
+}
@@ -0,0 +1,113 @@
+// Builds the addon and libmagic with profile-guided and link-time
+// optimization (GCC): builds them with profiling, trains them by running the
+// benchmark (see index.js) over the generated corpus, then rebuilds them with
+// the profile and -flto.
+//
+//   node bench/pgo.js [--magic <path>] [--duration <ms>] [-- <node-gyp args>]
+//
+// node-gyp is run from the PATH (as in `npm run'), or from $NODE_GYP.
+
+var childProcess = require('child_process');
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+
+var ROOT = path.join(__dirname, '..');
+
+var DEFAULTS = {
+  magic: undefined,
+  duration: '500'
+};
+
+function parseArgs(argv) {
+  var opts = {};
+  Object.keys(DEFAULTS).forEach(function(key) {
+    opts[key] = DEFAULTS[key];
+  });
+  for (var i = 0; i < argv.length; ++i) {
+    if (argv[i] === '--') {
+      opts.gypArgs = argv.slice(i + 1);
+      break;
+    }
+    var m = /^--([a-z]+)$/.exec(argv[i]);
+    if (m === null || !(m[1] in DEFAULTS) || i + 1 === argv.length)
+      throw new Error('Unknown or incomplete option: ' + argv[i]);
+    opts[m[1]] = argv[++i];
+  }
+  return {
+    magic: opts.magic,
+    duration: opts.duration,
+    gypArgs: opts.gypArgs || []
+  };
+}
+
+function run(file, args) {
+  process.stderr.write('> ' + [file].concat(args).join(' ') + '\n');
+  var res = childProcess.spawnSync(file, args, {
+    cwd: ROOT,
+    stdio: 'inherit'
+  });
+  if (res.error)
+    throw res.error;
+  if (res.status !== 0)
+    throw new Error(path.basename(file) + ' exited with code ' + res.status);
+}
+
+function nodeGyp(args) {
+  var cmd = process.env.NODE_GYP || 'node-gyp';
+  if (/\.js$/.test(cmd))
+    run(process.execPath, [cmd].concat(args));
+  else
+    run(cmd, args);
+}
+
+function countProfiles(dir) {
+  var count = 0;
+  fs.readdirSync(dir).forEach(function(name) {
+    var file = path.join(dir, name);
+    if (fs.statSync(file).isDirectory())
+      count += countProfiles(file);
+    else if (/\.gcda$/.test(name))
+      ++count;
+  });
+  return count;
+}
+
+function removeTree(dir) {
+  fs.readdirSync(dir).forEach(function(name) {
+    var file = path.join(dir, name);
+    if (fs.statSync(file).isDirectory())
+      removeTree(file);
+    else
+      fs.unlinkSync(file);
+  });
+  fs.rmdirSync(dir);
+}
+
+function main() {
+  var opts = parseArgs(process.argv.slice(2));
+  var dir = fs.mkdtempSync(path.join(os.tmpdir(), 'mmmagic-pgo-'));
+  var train = [
+    path.join(__dirname, 'index.js'),
+    '--duration', opts.duration,
+    '--out', path.join(dir, 'train.json')
+  ];
+  if (opts.magic !== undefined)
+    train.push('--magic', opts.magic);
+
+  try {
+    nodeGyp(['rebuild'].concat(opts.gypArgs, [
+      '--', '-Dmagic_pgo=generate', '-Dmagic_pgo_dir=' + dir
+    ]));
+    run(process.execPath, train);
+    if (countProfiles(dir) === 0)
+      throw new Error('The training run wrote no profile to ' + dir);
+    nodeGyp(['rebuild'].concat(opts.gypArgs, [
+      '--', '-Dmagic_pgo=use', '-Dmagic_pgo_dir=' + dir
+    ]));
+  } finally {
+    removeTree(dir);
+  }
+}
+
+main();
@@ -0,0 +1,241 @@
+// Measures what a cold start costs: loading the module, creating an instance
+// and its first detections, and the memory the instance then holds, for the
+// database given by path, a compiled database passed as a Buffer and (with
+// --source) a magic source file that is parsed on load.  Each run is a fresh
+// process, and the medians of the runs are printed as JSON.
+//
+//   node bench/startup.js [--magic <path>] [--source <path>] [--runs <n>]
+//                         [--instances <n>] [--out <file>]
+//
+// --magic is the compiled database for the path and Buffer sources (the
+// bundled one by default).
+
+var childProcess = require('child_process');
+var fs = require('fs');
+var path = require('path');
+
+var DEFAULTS = {
+  magic: undefined,
+  source: undefined,
+  runs: '5',
+  instances: '8',
+  out: undefined
+};
+
+var STEPS = ['map', 'check', 'byteswap', 'parse'];
+
+function parseArgs(argv) {
+  var opts = {};
+  Object.keys(DEFAULTS).forEach(function(key) {
+    opts[key] = DEFAULTS[key];
+  });
+  for (var i = 0; i < argv.length; ++i) {
+    var m = /^--([a-z]+)$/.exec(argv[i]);
+    if (m === null || !(m[1] in DEFAULTS) || i + 1 === argv.length)
+      throw new Error('Unknown or incomplete option: ' + argv[i]);
+    opts[m[1]] = argv[++i];
+  }
+  return {
+    magic: opts.magic,
+    source: opts.source,
+    runs: Number(opts.runs),
+    instances: Number(opts.instances),
+    out: opts.out
+  };
+}
+
+function elapsedMs(start) {
+  var diff = process.hrtime(start);
+  return diff[0] * 1e3 + diff[1] / 1e6;
+}
+
+function round(ms) {
+  return Math.round(ms * 1000) / 1000;
+}
+
+function rss() {
+  return process.memoryUsage().rss;
+}
+
+// libmagic appends `.mgc' to the paths of compiled databases
+function compiledPath(magic) {
+  if (magic === undefined)
+    magic = path.join(__dirname, '..', 'magic', 'magic');
+  return (fs.existsSync(magic + '.mgc') ? magic + '.mgc' : magic);
+}
+
+// Runs in the child: one cold start with the source described by `job'
+function child(job) {
+  var source;
+  if (job.kind === 'buffer')
+    source = fs.readFileSync(compiledPath(job.magic));
+  else
+    source = (job.kind === 'source' ? job.source : job.magic);
+
+  var result = {};
+  var rssStart = rss();
+  var start = process.hrtime();
+  var mmm = require('../lib/index');
+  result.requireMs = elapsedMs(start);
+  var rssModule = rss();
+
+  function create() {
+    return (source === undefined
+            ? new mmm.Magic()
+            : new mmm.Magic(source));
+  }
+
+  function timed(fn, cb) {
+    var t = process.hrtime();
+    fn(function(err) {
+      if (err)
+        throw err;
+      cb(elapsedMs(t));
+    });
+  }
+
+  start = process.hrtime();
+  var magic = create();
+  result.constructMs = elapsedMs(start);
+
+  // detect() loads the database for each call; detectFile() keeps a loaded
+  // handle, which is what an instance holds on to
+  timed(function(cb) {
+    magic.detect(Buffer.from('startup benchmark\n'), cb);
+  }, function(ms) {
+    result.firstDetectMs = ms;
+    timed(function(cb) {
+      magic.detectFile(__filename, cb);
+    }, function(ms) {
+      result.firstDetectFileMs = ms;
+      timed(function(cb) {
+        magic.detectFile(__filename, cb);
+      }, function(ms) {
+        result.warmDetectFileMs = ms;
+        var rssInstance = rss();
+        more(job.instances - 1, function() {
+          var stats = magic.stats();
+          result.loadSteps = {};
+          STEPS.forEach(function(step) {
+            var h = stats.loadSteps[step];
+            result.loadSteps[step] = (h.count > 0 ? h.sum / h.count : 0);
+          });
+          result.database = stats.database;
+          result.handles = stats.handles;
+          result.rss = {
+            module: rssModule - rssStart,
+            firstInstance: rssInstance - rssModule,
+            perInstance: (job.instances > 1
+                          ? (rss() - rssInstance) / (job.instances - 1)
+                          : 0)
+          };
+          process.send(result);
+        });
+      });
+    });
+  });
+
+  // Instances are never collected, so they are kept alive regardless
+  function more(n, cb) {
+    if (n === 0)
+      return cb();
+    create().detectFile(__filename, function(err) {
+      if (err)
+        throw err;
+      more(n - 1, cb);
+    });
+  }
+}
+
+function runChild(job, cb) {
+  var proc = childProcess.fork(__filename, ['--child', JSON.stringify(job)]);
+  var result = null;
+  proc.on('message', function(msg) {
+    result = msg;
+  });
+  proc.on('exit', function(code) {
+    if (result === null)
+      throw new Error(job.kind + ' run exited with code ' + code);
+    cb(result);
+  });
+}
+
+function median(values) {
+  values = values.slice().sort(function(a, b) { return a - b; });
+  return values[values.length >> 1];
+}
+
+// The median of each number across `results', which have the same shape
+function medians(results) {
+  var out = {};
+  Object.keys(results[0]).forEach(function(key) {
+    var values = results.map(function(r) { return r[key]; });
+    if (typeof values[0] === 'object')
+      out[key] = medians(values);
+    else
+      out[key] = round(median(values));
+  });
+  return out;
+}
+
+function main() {
+  var opts = parseArgs(process.argv.slice(2));
+  var kinds = ['path', 'buffer'];
+  var results = [];
+
+  if (opts.source !== undefined)
+    kinds.push('source');
+  if (!(opts.runs > 0) || !(opts.instances > 0))
+    throw new Error('--runs and --instances must be positive');
+
+  (function nextKind(k) {
+    if (k === kinds.length)
+      return report(opts, results);
+    var runs = [];
+    var job = {
+      kind: kinds[k],
+      magic: opts.magic,
+      source: opts.source,
+      instances: opts.instances
+    };
+    (function nextRun() {
+      if (runs.length === opts.runs) {
+        var result = medians(runs);
+        result.source = kinds[k];
+        results.push(result);
+        process.stderr.write(kinds[k] + ': new Magic() ' + result.constructMs
+                             + ' ms, first detectFile() '
+                             + result.firstDetectFileMs + ' ms, '
+                             + Math.round(result.rss.perInstance / 1024)
+                             + ' KB per instance\n');
+        return nextKind(k + 1);
+      }
+      runChild(job, function(result) {
+        runs.push(result);
+        nextRun();
+      });
+    })();
+  })(0);
+}
+
+function report(opts, results) {
+  var output = JSON.stringify({
+    version: require('../package.json').version,
+    node: process.version,
+    platform: process.platform,
+    arch: process.arch,
+    date: new Date().toISOString(),
+    runs: opts.runs,
+    instances: opts.instances,
+    results: results
+  }, null, 2);
+  if (opts.out !== undefined)
+    fs.writeFileSync(opts.out, output + '\n');
+  else
+    console.log(output);
+}
+
+if (process.argv[2] === '--child')
+  child(JSON.parse(process.argv[3]));
+else
+  main();
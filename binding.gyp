@@ -4,6 +4,11 @@
       'target_name': 'magic',
       'sources': [
         'src/binding.cc',
+        'src/limiter.cc',
+        'src/pipeline.cc',
+        'src/reader.cc',
+        'src/stats.cc',
+        'src/walker.cc',
       ],
       'include_dirs': [
         'deps/libmagic/src',
@@ -27,7 +32,71 @@
             'CLANG_CXX_LIBRARY': 'libc++',
           }
         }],
+        # Profile-guided build, see bench/pgo.js
+        ['magic_pgo=="generate"', {
+          'cflags+': [
+            '-fprofile-generate=<(magic_pgo_dir)',
+            '-fprofile-update=atomic',
+          ],
+          'ldflags+': [ '-fprofile-generate=<(magic_pgo_dir)' ],
+        }],
+        ['magic_pgo=="use"', {
+          'cflags+': [
+            '-fprofile-use=<(magic_pgo_dir)',
+            '-flto',
+          ],
+          'ldflags+': [
+            '-fprofile-use=<(magic_pgo_dir)',
+            '-flto',
+            '-O3',
+          ],
+        }],
       ],
     },
   ],
+  'variables': {
+    # Also build the libmagic microbenchmark (bench/microbench.c)
+    'magic_bench%': 0,
+    # `generate' to build with profiling, `use' to build with the profile
+    # (and link-time optimization), see bench/pgo.js
+    'magic_pgo%': '',
+    'magic_pgo_dir%': '',
+  },
+  'conditions': [
+    ['magic_bench==1 and OS!="win"', {
+      'targets': [
+        {
+          'target_name': 'magic_bench',
+          'type': 'executable',
+          'sources': [ 'bench/microbench.c' ],
+          'include_dirs': [ 'deps/libmagic/src' ],
+          'defines': [ 'HAVE_CONFIG_H' ],
+          'cflags!': [ '-O2' ],
+          'cflags+': [ '-O3', '-g', '-fno-omit-frame-pointer' ],
+          'cflags_c!': [ '-O2' ],
+          'cflags_c+': [ '-O3', '-std=gnu99' ],
+          'dependencies': [
+            'deps/libmagic/libmagic.gyp:libmagic',
+          ],
+          'conditions': [
+            [ 'OS=="linux"', {
+              'include_dirs': [ 'deps/libmagic/config/linux' ],
+            }],
+            [ 'OS=="mac"', {
+              'include_dirs': [ 'deps/libmagic/config/mac' ],
+            }],
+            [ 'OS=="freebsd"', {
+              'include_dirs': [ 'deps/libmagic/config/freebsd' ],
+            }],
+            [ 'OS=="openbsd"', {
+              'include_dirs': [ 'deps/libmagic/config/openbsd' ],
+            }],
+            [ 'OS=="solaris"', {
+              'include_dirs': [ 'deps/libmagic/config/sunos' ],
+            }],
+          ],
+        },
+      ],
+    }],
+  ],
 }
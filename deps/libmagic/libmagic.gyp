@@ -1,4 +1,9 @@
 {
+  'variables': {
+    # See ../../binding.gyp
+    'magic_pgo%': '',
+    'magic_pgo_dir%': '',
+  },
   'targets': [
     {
       'target_name': 'libmagic',
@@ -55,6 +60,18 @@
         [ 'OS=="solaris"', {
           'include_dirs': [ 'config/sunos' ],
         }],
+        [ 'magic_pgo=="generate"', {
+          'cflags+': [
+            '-fprofile-generate=<(magic_pgo_dir)',
+            '-fprofile-update=atomic',
+          ],
+        }],
+        [ 'magic_pgo=="use"', {
+          'cflags+': [
+            '-fprofile-use=<(magic_pgo_dir)',
+            '-flto',
+          ],
+        }],
       ],
       'cflags!': [ '-O2' ],
       'cflags+': [ '-O3' ],
@@ -78,6 +95,7 @@
         'src/print.c',
         'src/readcdf.c',
         'src/readelf.c',
+        'src/simd.c',
         'src/softmagic.c',
       ],
     },
@@ -93,6 +93,11 @@ FILE_RCSID("@(#)$File: apprentice.c,v 1.262 2017/08/28 13:39:18 christos Exp $")
 #define MAP_TYPE_MALLOC	1
 #define MAP_TYPE_MMAP	2
 
+// XXX: change by mscdex
+/* Bytes of struct magic_hot for each entry */
+#define HOT_ENTRY_SIZE	(2 * sizeof(uint64_t) + 4 * sizeof(uint32_t) + \
+    sizeof(uint16_t) + 4 * sizeof(uint8_t))
+
 struct magic_entry {
 	struct magic *mp;	
 	uint32_t cont_count;
@@ -133,6 +138,11 @@ private struct magic_map *apprentice_load(struct magic_set *,
     const char *, int);
 private struct mlist *mlist_alloc(void);
 private void mlist_free(struct mlist *);
+// XXX: change by mscdex
+private struct magic_hot *hot_alloc(struct magic *, uint32_t);
+private void hot_quick(struct magic_hot *, uint32_t, const struct magic *);
+private int hot_applies(const struct magic *, int);
+private size_t typesize(int);
 private void byteswap(struct magic *, uint32_t);
 private void bs1(struct magic *);
 private uint16_t swap2(uint16_t);
@@ -143,6 +153,9 @@ private struct magic_map *apprentice_buf(struct magic_set *, struct magic *,
     size_t);
 private struct magic_map *apprentice_map(struct magic_set *, const char *);
 private int check_buffer(struct magic_set *, struct magic_map *, const char *);
+// XXX: change by mscdex
+private void load_end(struct magic_set *, int, uint64_t *);
+private void load_account(struct magic_set *, const struct magic_map *);
 private void apprentice_unmap(struct magic_map *);
 private int apprentice_compile(struct magic_set *, struct magic_map *,
     const char *);
@@ -418,6 +431,12 @@ add_mlist(struct mlist *mlp, struct magic_map *map, size_t idx)
 	ml->map = idx == 0 ? map : NULL;
 	ml->magic = map->magic[idx];
 	ml->nmagic = map->nmagic[idx];
+	// XXX: change by mscdex
+	ml->first = 0;
+	if ((ml->hot = hot_alloc(ml->magic, ml->nmagic)) == NULL) {
+		free(ml);
+		return -1;
+	}
 
 	mlp->prev->next = ml;
 	ml->prev = mlp->prev;
@@ -457,19 +476,24 @@ apprentice_1(struct magic_set *ms, const char *fn, int action)
 	if (map == (struct magic_map *)-1)
 		return -1;
 	if (map == NULL) {
+		// XXX: change by mscdex
+		uint64_t t = file_now_ns();
+
 		if (ms->flags & MAGIC_CHECK)
 			file_magwarn(ms, "using regular magic file `%s'", fn);
 		map = apprentice_load(ms, fn, action);
 		if (map == NULL)
 			return -1;
+		load_end(ms, MAGIC_LOAD_PARSE, &t);
 	}
-
 	for (i = 0; i < MAGIC_SETS; i++) {
 		if (add_mlist(ms->mlist[i], map, i) == -1) {
 			file_oomem(ms, sizeof(*ml));
 			return -1;
 		}
 	}
+	// XXX: change by mscdex
+	load_account(ms, map);
 
 	if (action == FILE_LIST) {
 		for (i = 0; i < MAGIC_SETS; i++) {
@@ -497,6 +521,11 @@ file_ms_free(struct magic_set *ms)
 	free(ms->o.pbuf);
 	free(ms->o.buf);
 	free(ms->c.li);
+	// XXX: change by mscdex
+	file_rbuf_free(ms);
+	free(ms->input.segs);
+	free(ms->input.gather);
+	file_prof_free(ms);
 	free(ms);
 }
 
@@ -534,6 +563,7 @@ file_ms_alloc(int flags)
 	ms->elf_notes_max = FILE_ELF_NOTES_MAX;
 	ms->regex_max = FILE_REGEX_MAX;
 	ms->bytes_max = FILE_BYTES_MAX;
+	ms->tail_max = FILE_TAIL_MAX;
 	return ms;
 free:
 	free(ms);
@@ -596,12 +626,162 @@ mlist_free(struct mlist *mlist)
 	for (ml = mlist->next; (next = ml->next) != NULL; ml = next) {
 		if (ml->map)
 			apprentice_unmap(CAST(struct magic_map *, ml->map));
+		// XXX: change by mscdex
+		free(ml->hot);
 		free(ml);
 		if (ml == mlist)
 			break;
 	}
 }
 
+// XXX: change by mscdex
+/*
+ * Build the hot table of the `n' entries at `magic', as one allocation with
+ * the arrays in order of alignment.
+ */
+private struct magic_hot *
+hot_alloc(struct magic *magic, uint32_t n)
+{
+	struct magic_hot *hot;
+	uint32_t i, p, npass[HOT_PASSES], total = 0;
+	size_t size;
+
+	memset(npass, 0, sizeof(npass));
+	for (i = 0; i < n; i++) {
+		if (magic[i].cont_level != 0)
+			continue;
+		for (p = 0; p < HOT_PASSES; p++)
+			npass[p] += hot_applies(&magic[i], p);
+	}
+	for (p = 0; p < HOT_PASSES; p++)
+		total += npass[p];
+
+	size = sizeof(*hot) + n * HOT_ENTRY_SIZE + total * sizeof(uint32_t);
+	if ((hot = CAST(struct magic_hot *, malloc(size))) == NULL)
+		return NULL;
+	hot->size = size;
+	hot->value = RCAST(uint64_t *, hot + 1);
+	hot->mask = hot->value + n;
+	hot->offset = RCAST(uint32_t *, hot->mask + n);
+	hot->sflags = hot->offset + n;
+	hot->next = hot->sflags + n;
+	hot->top = hot->next + n;
+	hot->pass[0] = hot->top + n;
+	for (p = 1; p < HOT_PASSES; p++)
+		hot->pass[p] = hot->pass[p - 1] + npass[p - 1];
+	hot->cont_level = RCAST(uint16_t *, hot->pass[HOT_PASSES - 1] +
+	    npass[HOT_PASSES - 1]);
+	hot->type = RCAST(uint8_t *, hot->cont_level + n);
+	hot->flag = hot->type + n;
+	hot->quick = hot->flag + n;
+	hot->len = hot->quick + n;
+
+	memset(hot->npass, 0, sizeof(hot->npass));
+	for (i = 0; i < n; i++) {
+		hot->offset[i] = magic[i].offset;
+		hot->sflags[i] = magic[i].str_flags;
+		hot->cont_level[i] = magic[i].cont_level;
+		hot->type[i] = magic[i].type;
+		hot->flag[i] = magic[i].flag;
+		hot_quick(hot, i, &magic[i]);
+		if (magic[i].cont_level != 0)
+			continue;
+		for (p = 0; p < HOT_PASSES; p++)
+			if (hot_applies(&magic[i], p))
+				hot->pass[p][hot->npass[p]++] = i;
+	}
+
+	/*
+	 * Link the entries from the last one back, following the links
+	 * already made past deeper entries, which makes it linear.
+	 */
+	for (i = n; i-- > 0;) {
+		uint32_t j = i + 1;
+
+		while (j < n && hot->cont_level[j] > hot->cont_level[i])
+			j = hot->next[j];
+		hot->next[i] = j;
+		hot->top[i] = j == n || hot->cont_level[j] == 0 ?
+		    j : hot->top[j];
+	}
+	return hot;
+}
+
+/*
+ * Whether match() tries top-level entry `m' in pass `p' (see HOT_PASS()),
+ * by the test it makes of each entry when it walks them all.
+ */
+private int
+hot_applies(const struct magic *m, int p)
+{
+	int mode = (p & 2) ? TEXTTEST : BINTEST, text = p & 1;
+	uint32_t f = m->str_flags & (STRING_BINTEST | STRING_TEXTTEST);
+
+	if (m->type == FILE_NAME)
+		return 1;
+	if (IS_STRING(m->type) && ((text && f == STRING_BINTEST) ||
+	    (!text && f == STRING_TEXTTEST)))
+		return 0;
+	return (m->flag & mode) == mode;
+}
+
+/*
+ * Give entry `i' a quick test if it is a top-level equality test of an
+ * integer (masked by `&' at most) or of a plain string at a fixed offset.
+ */
+private void
+hot_quick(struct magic_hot *hot, uint32_t i, const struct magic *m)
+{
+	uint64_t width;
+
+	hot->quick[i] = HOT_NONE;
+	hot->len[i] = 0;
+	hot->value[i] = hot->mask[i] = 0;
+	if (m->cont_level != 0 || m->reln != '=' ||
+	    (m->flag & (INDIR | OFFNEGATIVE)) != 0)
+		return;
+
+	switch (m->type) {
+	case FILE_BYTE:
+	case FILE_SHORT:
+	case FILE_LONG:
+	case FILE_QUAD:
+		hot->quick[i] = HOT_HOST;
+		break;
+	case FILE_BESHORT:
+	case FILE_BELONG:
+	case FILE_BEQUAD:
+		hot->quick[i] = HOT_BE;
+		break;
+	case FILE_LESHORT:
+	case FILE_LELONG:
+	case FILE_LEQUAD:
+		hot->quick[i] = HOT_LE;
+		break;
+	case FILE_STRING:
+		if (m->vallen == 0 ||
+		    (m->str_flags & ~(STRING_BINTEST | STRING_TEXTTEST)) != 0)
+			return;
+		hot->len[i] = MIN(m->vallen, sizeof(uint64_t));
+		memcpy(&hot->value[i], m->value.s, hot->len[i]);
+		hot->mask[i] = ~(uint64_t)0;
+		hot->quick[i] = HOT_BYTES;
+		return;
+	default:
+		return;
+	}
+
+	if (m->mask_op != FILE_OPAND) {
+		hot->quick[i] = HOT_NONE;
+		return;
+	}
+	hot->len[i] = CAST(uint8_t, typesize(m->type));
+	width = hot->len[i] == sizeof(uint64_t) ? ~(uint64_t)0 :
+	    ((uint64_t)1 << (hot->len[i] * 8)) - 1;
+	hot->mask[i] = (m->num_mask != 0 ? m->num_mask : ~(uint64_t)0) & width;
+	hot->value[i] = m->value.q & width;
+}
+
 #ifndef COMPILE_ONLY
 /* void **bufs: an array of compiled magic files */
 protected int
@@ -616,6 +796,9 @@ buffer_apprentice(struct magic_set *ms, struct magic **bufs,
 		return -1;
 
 	(void)file_reset(ms, 0);
+	// XXX: change by mscdex
+	file_prof_free(ms);
+	memset(&ms->load, 0, sizeof(ms->load));
 
 	init_file_tables();
 
@@ -631,13 +814,14 @@ buffer_apprentice(struct magic_set *ms, struct magic **bufs,
 		map = apprentice_buf(ms, bufs[i], sizes[i]);
 		if (map == NULL)
 			goto fail;
-
 		for (j = 0; j < MAGIC_SETS; j++) {
 			if (add_mlist(ms->mlist[j], map, j) == -1) {
 				file_oomem(ms, sizeof(*ml));
 				goto fail;
 			}
 		}
+		// XXX: change by mscdex
+		load_account(ms, map);
 	}
 
 	return 0;
@@ -664,6 +848,9 @@ file_apprentice(struct magic_set *ms, const char *fn, int action)
 		return -1;
 
 	init_file_tables();
+	// XXX: change by mscdex
+	file_prof_free(ms);
+	memset(&ms->load, 0, sizeof(ms->load));
 
 	if ((mfn = strdup(fn)) == NULL) {
 		file_oomem(ms, strlen(fn));
@@ -834,6 +1021,13 @@ typesize(int type)
 	}
 }
 
+// XXX: change by mscdex
+protected size_t
+file_typesize(int type)
+{
+	return typesize(type);
+}
+
 /*
  * Get weight of this magic entry, for sorting purposes.
  */
@@ -1914,6 +2108,18 @@ parse(struct magic_set *ms, struct magic_entry *me, const char *line,
 		return -1;
 	}
 
+	// XXX: change by mscdex
+	if (*l == '-') {
+		++l;		/* step over */
+		m->flag |= OFFNEGATIVE;
+		/* An offset from the end cannot be relative to another. */
+		if (m->flag & (OFFADD | INDIROFFADD)) {
+			if (ms->flags & MAGIC_CHECK)
+				file_magwarn(ms, "negative relative offset");
+			return -1;
+		}
+	}
+
 	/* get offset, then skip over it */
 	m->offset = (uint32_t)strtoul(l, &t, 0);
         if (l == t) {
@@ -3019,6 +3225,8 @@ apprentice_map(struct magic_set *ms, const char *fn)
 	char *dbname = NULL;
 	struct magic_map *map;
 	struct magic_map *rv = NULL;
+	// XXX: change by mscdex
+	uint64_t t = file_now_ns();
 
 	fd = -1;
 	if ((map = CAST(struct magic_map *, calloc(1, sizeof(*map)))) == NULL) {
@@ -3066,6 +3274,8 @@ apprentice_map(struct magic_set *ms, const char *fn)
 #endif
 	(void)close(fd);
 	fd = -1;
+	// XXX: change by mscdex
+	load_end(ms, MAGIC_LOAD_MAP, &t);
 
 	if (check_buffer(ms, map, dbname) != 0) {
 		rv = (struct magic_map *)-1;
@@ -3096,6 +3306,8 @@ check_buffer(struct magic_set *ms, struct magic_map *map, const char *dbname)
 	uint32_t entries, nentries;
 	uint32_t version;
 	int i, needsbyteswap;
+	// XXX: change by mscdex
+	uint64_t t = file_now_ns();
 
 	ptr = CAST(uint32_t *, map->p);
 	if (*ptr != MAGICNO) {
@@ -3139,12 +3351,45 @@ check_buffer(struct magic_set *ms, struct magic_map *map, const char *dbname)
 		    dbname, entries, nentries + 1);
 		return -1;
 	}
-	if (needsbyteswap)
+	// XXX: change by mscdex
+	load_end(ms, MAGIC_LOAD_CHECK, &t);
+	if (needsbyteswap) {
 		for (i = 0; i < MAGIC_SETS; i++)
 			byteswap(map->magic[i], map->nmagic[i]);
+		load_end(ms, MAGIC_LOAD_BYTESWAP, &t);
+	}
 	return 0;
 }
 
+// XXX: change by mscdex
+/* Charge the time since `*t' to load step `step' and restart `*t' */
+private void
+load_end(struct magic_set *ms, int step, uint64_t *t)
+{
+	uint64_t now;
+
+	if (*t == 0)
+		return;
+	now = file_now_ns();
+	ms->load.ns[step] += now - *t;
+	ms->load.ran |= 1 << step;
+	*t = now;
+}
+
+/*
+ * Count the entries of a loaded database, and the hot tables of the sets
+ * just added for it, see magic_load_size()
+ */
+private void
+load_account(struct magic_set *ms, const struct magic_map *map)
+{
+	size_t i;
+
+	for (i = 0; i < MAGIC_SETS; i++)
+		ms->load.bytes += map->nmagic[i] * sizeof(struct magic) +
+		    ms->mlist[i]->prev->hot->size;
+}
+
 /*
  * handle an mmaped file.
  */
@@ -3417,6 +3662,9 @@ file_magicfind(struct magic_set *ms, const char *name, struct mlist *v)
 				continue;
 			if (strcmp(ma[i].value.s, name) == 0) {
 				v->magic = &ma[i];
+				// XXX: change by mscdex
+				v->hot = ml->hot;
+				v->first = ml->first + i;
 				for (j = i + 1; j < nma; j++)
 				    if (ma[j].cont_level == 0)
 					    break;
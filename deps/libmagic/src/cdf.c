@@ -342,6 +342,9 @@ cdf_read(const cdf_info_t *info, off_t off, void *buf, size_t len)
 		goto out;
 
 	if (info->i_buf != NULL && info->i_len >= siz) {
+		// XXX: change by mscdex
+		if (info->i_touched != NULL && *info->i_touched < siz)
+			*info->i_touched = siz;
 		(void)memcpy(buf, &info->i_buf[off], len);
 		return (ssize_t)len;
 	}
@@ -352,6 +355,9 @@ cdf_read(const cdf_info_t *info, off_t off, void *buf, size_t len)
 	if (pread(info->i_fd, buf, len, off) != (ssize_t)len)
 		return -1;
 
+	// XXX: change by mscdex
+	if (info->i_touched_fd != NULL && *info->i_touched_fd < (off_t)siz)
+		*info->i_touched_fd = (off_t)siz;
 	return (ssize_t)len;
 out:
 	errno = EINVAL;
@@ -1569,6 +1575,8 @@ main(int argc, char *argv[])
 
 	info.i_buf = NULL;
 	info.i_len = 0;
+	info.i_touched = NULL;
+	info.i_touched_fd = NULL;
 	for (i = 1; i < argc; i++) {
 		if ((info.i_fd = open(argv[1], O_RDONLY)) == -1)
 			err(1, "Cannot open `%s'", argv[1]);
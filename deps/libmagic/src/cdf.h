@@ -266,6 +266,9 @@ typedef struct {
 	int i_fd;
 	const unsigned char *i_buf;
 	size_t i_len;
+	// XXX: change by mscdex
+	size_t *i_touched;	/* if not NULL, the end of the data read */
+	off_t *i_touched_fd;	/* same, for i_fd, as a file offset */
 } cdf_info_t;
 
 
@@ -51,6 +51,9 @@ private int looks_utf7(const unsigned char *, size_t, unichar *, size_t *);
 private int looks_ucs16(const unsigned char *, size_t, unichar *, size_t *);
 private int looks_latin1(const unsigned char *, size_t, unichar *, size_t *);
 private int looks_extended(const unsigned char *, size_t, unichar *, size_t *);
+// XXX: change by mscdex
+private size_t text_run(const unsigned char *, size_t, size_t, unichar *,
+    size_t *);
 private void from_ebcdic(const unsigned char *, size_t, unsigned char *);
 
 #ifdef DEBUG_ENCODING
@@ -235,7 +238,8 @@ looks_ascii(const unsigned char *buf, size_t nbytes, unichar *ubuf,
 
 	*ulen = 0;
 
-	for (i = 0; i < nbytes; i++) {
+	// XXX: change by mscdex
+	for (i = 0; (i = text_run(buf, i, nbytes, ubuf, ulen)) < nbytes; i++) {
 		int t = text_chars[buf[i]];
 
 		if (t != T)
@@ -254,7 +258,8 @@ looks_latin1(const unsigned char *buf, size_t nbytes, unichar *ubuf, size_t *ule
 
 	*ulen = 0;
 
-	for (i = 0; i < nbytes; i++) {
+	// XXX: change by mscdex
+	for (i = 0; (i = text_run(buf, i, nbytes, ubuf, ulen)) < nbytes; i++) {
 		int t = text_chars[buf[i]];
 
 		if (t != T && t != I)
@@ -274,7 +279,8 @@ looks_extended(const unsigned char *buf, size_t nbytes, unichar *ubuf,
 
 	*ulen = 0;
 
-	for (i = 0; i < nbytes; i++) {
+	// XXX: change by mscdex
+	for (i = 0; (i = text_run(buf, i, nbytes, ubuf, ulen)) < nbytes; i++) {
 		int t = text_chars[buf[i]];
 
 		if (t != T && t != I && t != X)
@@ -286,6 +292,25 @@ looks_extended(const unsigned char *buf, size_t nbytes, unichar *ubuf,
 	return 1;
 }
 
+// XXX: change by mscdex
+/*
+ * Copy the run of plain ASCII text at buf[i] into ubuf (if not NULL), a
+ * vector at a time, and return where it ends
+ */
+private size_t
+text_run(const unsigned char *buf, size_t i, size_t nbytes, unichar *ubuf,
+    size_t *ulen)
+{
+	size_t n = file_simd->text_span(buf + i, nbytes - i), j;
+
+	if (ubuf) {
+		for (j = 0; j < n; j++)
+			ubuf[*ulen + j] = buf[i + j];
+		*ulen += n;
+	}
+	return i + n;
+}
+
 /*
  * Decide whether some text looks like UTF-8. Returns:
  *
@@ -309,6 +334,9 @@ file_looks_utf8(const unsigned char *buf, size_t nbytes, unichar *ubuf, size_t *
 		*ulen = 0;
 
 	for (i = 0; i < nbytes; i++) {
+		// XXX: change by mscdex
+		if ((i = text_run(buf, i, nbytes, ubuf, ulen)) == nbytes)
+			break;
 		if ((buf[i] & 0x80) == 0) {	   /* 0xxxxxxx is plain ASCII */
 			/*
 			 * Even if the whole file is valid UTF-8 sequences,
@@ -107,6 +107,8 @@ typedef unsigned int mode_t;
 /* Do this here and now, because struct stat gets re-defined on solaris */
 #include <sys/stat.h>
 #include <stdarg.h>
+// XXX: change by mscdex
+#include "magic.h"	/* MAGIC_PHASES */
 
 #define ENABLE_CONDITIONALS
 
@@ -206,6 +208,8 @@ struct magic {
 #define BINTEST		0x20	/* test is for a binary type (set only
 				   for top-level tests) */
 #define TEXTTEST	0x40	/* for passing to file_softmagic */
+// XXX: change by mscdex
+#define OFFNEGATIVE	0x80	/* relative to the end of file */
 
 	uint8_t factor;
 
@@ -390,11 +394,60 @@ struct magic {
 #define	INDIRECT_RELATIVE			BIT(0)
 #define	CHAR_INDIRECT_RELATIVE			'r'
 
+// XXX: change by mscdex
+/*
+ * The fields match() reads for every entry it walks, one array each,
+ * apart from the rest of struct magic (the descriptions in particular), so
+ * that passing over entries stays within a few cache lines.  It is built
+ * when a set of entries is loaded; the compiled format is unchanged.
+ *
+ * The links let match() jump over continuations: `next' is the index of the
+ * first entry after `i' at the level of `i' or above, and `top' that of the
+ * next top-level entry (or the number of entries, past the last).
+ *
+ * Top-level entries that compare a few bytes at a fixed offset also get a
+ * quick test: the entry cannot match if the `len' bytes there, read as
+ * `quick' says and masked with `mask', differ from `value'.
+ *
+ * Each pass file_softmagic() makes over a set, for BINTEST or TEXTTEST
+ * and for input that looks like text or not, has the list of top-level
+ * entries it tries, in order, so that it does not have to pass over the
+ * rest.
+ */
+#define HOT_NONE	0		/* no quick test */
+#define HOT_HOST	1		/* host byte order integer */
+#define HOT_BE		2		/* big endian integer */
+#define HOT_LE		3		/* little endian integer */
+#define HOT_BYTES	4		/* string prefix, as copied */
+
+#define HOT_PASSES	4
+#define HOT_PASS(mode, text)	(((mode) == TEXTTEST ? 2 : 0) | ((text) != 0))
+
+struct magic_hot {
+	uint64_t *value;
+	uint64_t *mask;
+	uint32_t *offset;
+	uint32_t *sflags;		/* str_flags, of string types */
+	uint32_t *next;			/* next sibling or ancestor sibling */
+	uint32_t *top;			/* next top-level entry */
+	uint16_t *cont_level;
+	uint8_t *type;
+	uint8_t *flag;
+	uint8_t *quick;			/* HOT_* */
+	uint8_t *len;			/* bytes the quick test reads */
+	uint32_t *pass[HOT_PASSES];	/* top-level entries of each pass */
+	uint32_t npass[HOT_PASSES];
+	size_t size;			/* bytes allocated */
+};
+
 /* list of magic entries */
 struct mlist {
 	struct magic *magic;		/* array of magic entries */
 	uint32_t nmagic;		/* number of entries in array */
 	void *map;			/* internal resources used by entry */
+	// XXX: change by mscdex
+	struct magic_hot *hot;		/* hot fields of the whole set */
+	uint32_t first;			/* index of magic[0] in hot */
 	struct mlist *next, *prev;
 };
 
@@ -419,6 +472,14 @@ struct level_info {
 
 #define MAGIC_SETS	2
 
+// XXX: change by mscdex
+/* a piece of the input, which is not held in one buffer */
+struct magic_seg {
+	const unsigned char *buf;
+	size_t off;			/* input offset of buf[0] */
+	size_t len;			/* length of buf */
+};
+
 struct magic_set {
 	struct mlist *mlist[MAGIC_SETS];	/* list of regular entries */
 	struct cont {
@@ -448,6 +509,87 @@ struct magic_set {
 	/* FIXME: Make the string dynamically allocated so that e.g.
 	   strings matched in files can be longer than MAXstring */
 	union VALUETYPE ms_value;	/* either number or string */
+
+	// XXX: change by mscdex
+	/*
+	 * the input, when the buffer being matched does not hold all of it:
+	 * a file's head and the window on its end, or a scattered input
+	 */
+	struct {
+		const struct magic_seg *seg;	/* in offset order; 0 if none */
+		size_t nseg;
+		size_t end;			/* input size */
+		struct magic_seg two[2];	/* seg for a head and tail */
+		struct magic_seg *segs;		/* seg for a scattered input */
+		size_t nsegs;			/* allocated length of segs */
+		unsigned char *gather;		/* ranges spanning segments */
+		size_t ngather;			/* allocated length of gather */
+		unsigned char spill[sizeof(union VALUETYPE)];
+	} input;
+	/* buffer files are read into, kept across calls */
+	struct {
+		unsigned char *buf;
+		size_t size;			/* allocated length */
+		int mapped;			/* from mmap(), not malloc() */
+		int huge;			/* advised as huge pages */
+	} rbuf;
+	/* time spent in the tests of file_buffer(), see magic_phases() */
+	struct {
+		uint64_t ns[MAGIC_PHASES];
+		int ran;			/* mask of the tests that ran */
+		int nested;			/* in decompressed data */
+	} phase;
+	/* MAGIC_PROFILE: counters of the entries, see magic_profile() */
+	struct {
+		struct prof_range {
+			const struct magic *base;
+			uint32_t n;
+			uint32_t first;		/* index of base[0] */
+		} *range;
+		size_t nrange;
+		struct prof_entry {
+			const struct magic *m;
+			uint64_t evals, matches, ns;
+		} *entry;
+		uint32_t *touched;		/* evaluated entries */
+		size_t ntouched;
+	} prof;
+	/* MAGIC_PROFILE: how far into the input the tests that matched
+	 * looked, see magic_touched() */
+	struct {
+		const unsigned char *buf;	/* given to file_buffer() */
+		size_t len;
+		const unsigned char *s;		/* search.offset counts from */
+		size_t cur;			/* read by the current test */
+		off_t fd;			/* same, through the descriptor,
+						 * as a file offset */
+		off_t base;			/* file offset of buf[0] */
+		size_t max;			/* read by those that matched */
+	} touch;
+	/* magic_partial(): the input is the start of longer data */
+	struct {
+		int active;
+		int missing;	/* the result depended on bytes past the input */
+		int text;	/* whether it looks like text may still change */
+	} partial;
+	/* set by another thread to stop the current call, see
+	 * magic_setcancel() */
+	const int *cancel;
+	/* the magic entries of the current call, see MAGIC_PARAM_EVAL_MAX
+	 * and MAGIC_PARAM_TIME_MAX */
+	struct {
+		size_t evals;			/* evaluated so far */
+		uint64_t deadline;		/* file_now_ns() to stop at, or 0 */
+		int truncated;			/* some were left out */
+	} budget;
+	/* time spent loading the databases and their size, see
+	 * magic_load_steps() and magic_load_size() */
+	struct {
+		uint64_t ns[MAGIC_LOAD_STEPS];
+		int ran;			/* mask of the steps that ran */
+		size_t bytes;			/* of the magic entries */
+	} load;
+
 	uint16_t indir_max;
 	uint16_t name_max;
 	uint16_t elf_shnum_max;
@@ -455,12 +597,16 @@ struct magic_set {
 	uint16_t elf_notes_max;
 	uint16_t regex_max;
 	size_t bytes_max;		/* number of bytes to read from file */
+	size_t tail_max;		/* number of bytes to read from the end */
+	size_t eval_max;		/* magic entries evaluated per call */
+	size_t time_max;		/* us spent on magic entries per call */
 #define	FILE_INDIR_MAX			50
 #define	FILE_NAME_MAX			30
 #define	FILE_ELF_SHNUM_MAX		32768
 #define	FILE_ELF_PHNUM_MAX		2048
 #define	FILE_ELF_NOTES_MAX		256
 #define	FILE_REGEX_MAX			8192
+#define	FILE_TAIL_MAX			(64 * 1024)
 };
 
 /* Type for Unicode characters */
@@ -475,6 +621,7 @@ protected void file_ms_free(struct magic_set *);
 protected int file_buffer(struct magic_set *, int, const char *, const void *,
     size_t);
 protected int file_fsmagic(struct magic_set *, const char *, struct stat *);
+protected int file_stat(struct magic_set *, const char *, struct stat *, int);
 protected int file_pipe2file(struct magic_set *, int, const void *, size_t);
 protected int file_vprintf(struct magic_set *, const char *, va_list)
     __attribute__((__format__(__printf__, 2, 0)));
@@ -483,6 +630,31 @@ protected int file_replace(struct magic_set *, const char *, const char *);
 protected int file_printf(struct magic_set *, const char *, ...)
     __attribute__((__format__(__printf__, 2, 3)));
 protected int file_reset(struct magic_set *, int);
+// XXX: change by mscdex
+protected void file_rbuf_free(struct magic_set *);
+protected int file_may_be_text(struct magic_set *, const unsigned char *,
+    size_t);
+protected uint64_t file_now_ns(void);
+protected void file_prof_free(struct magic_set *);
+protected void file_touch_at(struct magic_set *, size_t, size_t);
+protected void file_touch_fd(struct magic_set *, off_t, size_t);
+protected void file_touch_keep(struct magic_set *);
+/* the outcome of a test depends on bytes past the end of a partial input */
+#define file_partial_missing(ms) \
+	do { if ((ms)->partial.active) (ms)->partial.missing = 1; } while (0)
+// XXX: change by mscdex
+/* Byte-scanning kernels for the vector unit of the CPU, see simd.c */
+struct file_simd {
+	const char *name;
+	/* length of the plain ASCII text (see encoding.c) at the start */
+	size_t (*text_span)(const unsigned char *, size_t);
+	/* length of the printable ASCII (0x20 to 0x7e) at the start */
+	size_t (*print_span)(const unsigned char *, size_t);
+	/* offset of the first occurrence of a pattern, or (size_t)-1 */
+	size_t (*find)(const unsigned char *, size_t, const unsigned char *,
+	    size_t);
+};
+extern const struct file_simd *file_simd;
 protected int file_tryelf(struct magic_set *, int, const unsigned char *,
     size_t);
 protected int file_trycdf(struct magic_set *, int, const unsigned char *,
@@ -525,6 +697,7 @@ protected int file_check_mem(struct magic_set *, unsigned int);
 protected int file_looks_utf8(const unsigned char *, size_t, unichar *,
     size_t *);
 protected size_t file_pstring_length_size(const struct magic *);
+protected size_t file_typesize(int);
 protected size_t file_pstring_get_length(const struct magic *, const char *);
 protected char * file_printable(char *, size_t, const char *);
 #ifdef __EMX__
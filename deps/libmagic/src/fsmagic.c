@@ -50,6 +50,10 @@ FILE_RCSID("@(#)$File: fsmagic.c,v 1.77 2017/05/24 19:17:50 christos Exp $")
 # include <sys/sysmacros.h>
 # define HAVE_MAJOR
 #endif
+// XXX: change by mscdex
+#if defined(STATX_TYPE) && !defined(MAJOR_IN_SYSMACROS)
+# include <sys/sysmacros.h>	/* for makedev() */
+#endif
 #ifdef major			/* Might be defined in sys/types.h.  */
 # define HAVE_MAJOR
 #endif
@@ -86,6 +90,49 @@ bad_link(struct magic_set *ms, int err, char *buf)
 	return 1;
 }
 #endif
+// XXX: change by mscdex
+/*
+ * stat(2) (or lstat(2) if !follow) that, where statx(2) is available, only
+ * asks for the attributes file_fsmagic() and file_or_fd() look at.  This
+ * saves attribute fetches on network filesystems.
+ */
+protected int
+file_stat(struct magic_set *ms, const char *fn, struct stat *sb, int follow)
+{
+#ifdef STATX_TYPE
+	struct statx stx;
+	unsigned int mask = STATX_TYPE|STATX_MODE|STATX_SIZE;
+
+	if (ms->flags & MAGIC_PRESERVE_ATIME)
+		mask |= STATX_ATIME|STATX_MTIME;
+	if (statx(AT_FDCWD, fn, follow ? 0 : AT_SYMLINK_NOFOLLOW, mask,
+	    &stx) == 0) {
+		(void)memset(sb, 0, sizeof(*sb));
+		sb->st_mode = stx.stx_mode;
+		sb->st_size = (off_t)stx.stx_size;
+		sb->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+		sb->st_atime = stx.stx_atime.tv_sec;
+		sb->st_mtime = stx.stx_mtime.tv_sec;
+		return 0;
+	}
+	/*
+	 * Kernels before 4.11, and seccomp filters that predate statx(2)
+	 * (which fail it with EPERM or another error of their choice), as
+	 * libuv does.  A real error of these is found again by stat(2).
+	 */
+	if (errno != ENOSYS && errno != EPERM && errno != EACCES &&
+	    errno != EINVAL)
+		return -1;
+#else
+	(void)ms;
+#endif
+#ifdef	S_IFLNK
+	if (!follow)
+		return lstat(fn, sb);
+#endif
+	return stat(fn, sb);
+}
+
 private int
 handle_mime(struct magic_set *ms, int mime, const char *str)
 {
@@ -123,10 +170,10 @@ file_fsmagic(struct magic_set *ms, const char *fn, struct stat *sb)
 	 */
 #ifdef	S_IFLNK
 	if ((ms->flags & MAGIC_SYMLINK) == 0)
-		ret = lstat(fn, sb);
+		ret = file_stat(ms, fn, sb, 0);
 	else
 #endif
-	ret = stat(fn, sb);	/* don't merge into if; see "ret =" above */
+	ret = file_stat(ms, fn, sb, 1);	/* don't merge into if; see "ret =" above */
 
 #ifdef WIN32
 	{
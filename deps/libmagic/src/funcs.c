@@ -172,6 +172,59 @@ checkdone(struct magic_set *ms, int *rv)
 	return 0;
 }
 
+// XXX: change by mscdex
+/*
+ * Whether data that starts with the `nb' bytes in `buf' could look like text
+ * to file_encoding() or file_ascmagic().  If the bytes do not, no more bytes
+ * can change that, unless they end in the middle of a multibyte character or
+ * in NULs that file_ascmagic() would not have trimmed from the whole data.
+ */
+protected int
+file_may_be_text(struct magic_set *ms, const unsigned char *buf, size_t nb)
+{
+	unichar *u8buf = NULL;
+	size_t ulen;
+	const char *code, *code_mime, *ftype;
+	int rv;
+
+	while (nb > 0 && buf[nb - 1] == '\0')
+		nb--;
+	if (nb <= 4)
+		return 1;
+	rv = file_encoding(ms, buf, nb - 4, &u8buf, &ulen, &code, &code_mime,
+	    &ftype);
+	free(u8buf);
+	return rv;
+}
+
+// XXX: change by mscdex
+/* A monotonic clock in ns, or 0 where there is none */
+protected uint64_t
+file_now_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+	return 0;
+}
+
+/* Charge the time since `*t' to test `phase' and restart `*t' */
+private void
+phase_end(struct magic_set *ms, int phase, uint64_t *t)
+{
+	uint64_t now;
+
+	if (*t == 0)
+		return;
+	now = file_now_ns();
+	ms->phase.ns[phase] += now - *t;
+	ms->phase.ran |= 1 << phase;
+	*t = now;
+}
+
 /*ARGSUSED*/
 protected int
 file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__unused__)),
@@ -186,6 +239,15 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 	const char *type = "application/octet-stream";
 	const char *def = "data";
 	const char *ftype = NULL;
+	// XXX: change by mscdex
+	/* decompressed data is timed as part of the decompression */
+	uint64_t t = ms->phase.nested ? 0 : file_now_ns();
+
+	// XXX: change by mscdex
+	if (!ms->phase.nested) {
+		ms->touch.buf = ubuf;
+		ms->touch.len = nb;
+	}
 
 	if (nb == 0) {
 		def = "empty";
@@ -199,7 +261,14 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 	if ((ms->flags & MAGIC_NO_CHECK_ENCODING) == 0) {
 		looks_text = file_encoding(ms, ubuf, nb, &u8buf, &ulen,
 		    &code, &code_mime, &ftype);
+		// XXX: change by mscdex
+		phase_end(ms, MAGIC_PHASE_ENCODING, &t);
 	}
+	// XXX: change by mscdex
+	if (ms->partial.active)
+		ms->partial.text = looks_text ||
+		    ((ms->flags & MAGIC_NO_CHECK_ENCODING) == 0 &&
+		    file_may_be_text(ms, ubuf, nb));
 
 #ifdef __EMX__
 	if ((ms->flags & MAGIC_NO_CHECK_APPTYPE) == 0 && inname) {
@@ -219,7 +288,12 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 #if HAVE_FORK
 	/* try compression stuff */
 	if ((ms->flags & MAGIC_NO_CHECK_COMPRESS) == 0) {
+		// XXX: change by mscdex
+		file_partial_missing(ms);
+		ms->phase.nested++;
 		m = file_zmagic(ms, fd, inname, ubuf, nb);
+		ms->phase.nested--;
+		phase_end(ms, MAGIC_PHASE_COMPRESS, &t);
 		if ((ms->flags & MAGIC_DEBUG) != 0)
 			(void)fprintf(stderr, "[try zmagic %d]\n", m);
 		if (m) {
@@ -230,6 +304,8 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 	/* Check if we have a tar file */
 	if ((ms->flags & MAGIC_NO_CHECK_TAR) == 0) {
 		m = file_is_tar(ms, ubuf, nb);
+		// XXX: change by mscdex
+		phase_end(ms, MAGIC_PHASE_TAR, &t);
 		if ((ms->flags & MAGIC_DEBUG) != 0)
 			(void)fprintf(stderr, "[try tar %d]\n", m);
 		if (m) {
@@ -240,7 +316,14 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 
 	/* Check if we have a CDF file */
 	if ((ms->flags & MAGIC_NO_CHECK_CDF) == 0) {
+		// XXX: change by mscdex
+		ms->touch.cur = 0;
+		ms->touch.fd = 0;
 		m = file_trycdf(ms, fd, ubuf, nb);
+		// XXX: change by mscdex
+		phase_end(ms, MAGIC_PHASE_CDF, &t);
+		if (m)
+			file_touch_keep(ms);
 		if ((ms->flags & MAGIC_DEBUG) != 0)
 			(void)fprintf(stderr, "[try cdf %d]\n", m);
 		if (m) {
@@ -253,6 +336,8 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 	if ((ms->flags & MAGIC_NO_CHECK_SOFT) == 0) {
 		m = file_softmagic(ms, ubuf, nb, NULL, NULL, BINTEST,
 		    looks_text);
+		// XXX: change by mscdex
+		phase_end(ms, MAGIC_PHASE_SOFT, &t);
 		if ((ms->flags & MAGIC_DEBUG) != 0)
 			(void)fprintf(stderr, "[try softmagic %d]\n", m);
 		if (m) {
@@ -268,7 +353,13 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 				 * ELF headers that cannot easily * be
 				 * extracted with rules in the magic file.
 				 */
+				// XXX: change by mscdex
+				ms->touch.cur = 0;
+				ms->touch.fd = 0;
 				m = file_tryelf(ms, fd, ubuf, nb);
+				// XXX: change by mscdex
+				phase_end(ms, MAGIC_PHASE_ELF, &t);
+				file_touch_keep(ms);
 				if ((ms->flags & MAGIC_DEBUG) != 0)
 					(void)fprintf(stderr, "[try elf %d]\n",
 					    m);
@@ -281,8 +372,13 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 
 	/* try text properties */
 	if ((ms->flags & MAGIC_NO_CHECK_TEXT) == 0) {
+		// XXX: change by mscdex
+		/* these look at all of the input */
+		file_partial_missing(ms);
 
 		m = file_ascmagic(ms, ubuf, nb, looks_text);
+		// XXX: change by mscdex
+		phase_end(ms, MAGIC_PHASE_TEXT, &t);
 		if ((ms->flags & MAGIC_DEBUG) != 0)
 			(void)fprintf(stderr, "[try ascmagic %d]\n", m);
 		if (m) {
@@ -293,6 +389,8 @@ file_buffer(struct magic_set *ms, int fd, const char *inname __attribute__ ((__u
 
 simple:
 	/* give up */
+	// XXX: change by mscdex
+	file_partial_missing(ms);
 	m = 1;
 	if (ms->flags & MAGIC_MIME) {
 		if ((ms->flags & MAGIC_MIME_TYPE) &&
@@ -344,6 +442,15 @@ file_reset(struct magic_set *ms, int checkloaded)
 	}
 	ms->event_flags &= ~EVENT_HAD_ERR;
 	ms->error = -1;
+	ms->input.seg = NULL;
+	ms->input.nseg = 0;
+	memset(&ms->phase, 0, sizeof(ms->phase));
+	memset(&ms->touch, 0, sizeof(ms->touch));
+	ms->budget.evals = 0;
+	ms->budget.truncated = 0;
+	ms->budget.deadline = 0;
+	if (ms->time_max != 0 && (ms->budget.deadline = file_now_ns()) != 0)
+		ms->budget.deadline += (uint64_t)ms->time_max * 1000;
 	return 0;
 }
 
@@ -360,6 +467,8 @@ file_getbuffer(struct magic_set *ms)
 {
 	char *pbuf, *op, *np;
 	size_t psize, len;
+	// XXX: change by mscdex
+	size_t run;
 
 	if (ms->event_flags & EVENT_HAD_ERR)
 		return NULL;
@@ -397,6 +506,17 @@ file_getbuffer(struct magic_set *ms)
 		eop = op + len;
 
 		while (op < eop) {
+			// XXX: change by mscdex
+			/* Printable ASCII is copied a vector at a time */
+			if (mbsinit(&state)) {
+				run = file_simd->print_span(
+				    (const unsigned char *)op, (size_t)(eop - op));
+				(void)memcpy(np, op, run);
+				op += run;
+				np += run;
+				if (op == eop)
+					break;
+			}
 			bytesconsumed = mbrtowc(&nextchar, op,
 			    (size_t)(eop - op), &state);
 			if (bytesconsumed == (size_t)(-1) ||
@@ -423,6 +543,14 @@ file_getbuffer(struct magic_set *ms)
 #endif
 
 	for (np = ms->o.pbuf, op = ms->o.buf; *op;) {
+		// XXX: change by mscdex
+		run = file_simd->print_span((const unsigned char *)op,
+		    (size_t)(ms->o.buf + len - op));
+		(void)memcpy(np, op, run);
+		op += run;
+		np += run;
+		if (*op == '\0')
+			break;
 		if (isprint((unsigned char)*op)) {
 			*np++ = *op++;
 		} else {
@@ -72,6 +72,19 @@ file_is_tar(struct magic_set *ms, const unsigned char *buf, size_t nbytes)
 	if ((ms->flags & (MAGIC_APPLE|MAGIC_EXTENSION)) != 0)
 		return 0;
 
+	// XXX: change by mscdex
+	/* A partial header is only ruled out by an invalid checksum field */
+	if (ms->partial.active && nbytes < RECORDSIZE) {
+		const union record *header = CAST(const union record *,
+		    CAST(const void *, buf));
+		size_t end = CAST(size_t, header->header.chksum +
+		    sizeof(header->header.chksum) -
+		    CAST(const char *, header->charptr));
+		if (nbytes < end || from_oct(header->header.chksum,
+		    sizeof(header->header.chksum)) != -1)
+			file_partial_missing(ms);
+	}
+
 	tar = is_tar(buf, nbytes);
 	if (tar < 1 || tar > 3)
 		return 0;
@@ -45,9 +45,13 @@ FILE_RCSID("@(#)$File: magic.c,v 1.102 2017/08/28 13:39:18 christos Exp $")
 #include <unistd.h>
 #endif
 #include <string.h>
-#ifdef QUICK
+// XXX: change by mscdex
+#if defined(QUICK) || defined(HAVE_SYS_MMAN_H)
 #include <sys/mman.h>
 #endif
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
 #ifdef HAVE_LIMITS_H
 #include <limits.h>	/* for PIPE_BUF */
 #endif
@@ -76,11 +80,19 @@ FILE_RCSID("@(#)$File: magic.c,v 1.102 2017/08/28 13:39:18 christos Exp $")
 #endif
 
 private void close_and_restore(const struct magic_set *, const char *, int,
-    const struct stat *);
+    const struct stat *, int);
 private int unreadable_info(struct magic_set *, mode_t, const char *);
+private void input_tail(struct magic_set *, const void *, size_t,
+    const void *, size_t, size_t);
+private int input_whole(struct magic_set *, const unsigned char *, size_t);
+private int tail_range(const struct magic_set *, const struct stat *, off_t,
+    size_t, size_t *, size_t *);
+private int read_tail(struct magic_set *, int, const struct stat *,
+    off_t, const unsigned char *, size_t, unsigned char *, size_t, size_t);
+private unsigned char *read_buffer(struct magic_set *, size_t);
 private const char* get_default_magic(void);
 #ifndef COMPILE_ONLY
-private const char *file_or_fd(struct magic_set *, const char *, int);
+private const char *file_or_fd(struct magic_set *, const char *, int, off_t);
 #endif
 
 #ifndef	STDIN_FILENO
@@ -348,13 +360,14 @@ magic_list(struct magic_set *ms, const char *magicfile)
 
 private void
 close_and_restore(const struct magic_set *ms, const char *name, int fd,
-    const struct stat *sb)
+    const struct stat *sb, int noatime)
 {
 	if (fd == STDIN_FILENO || name == NULL)
 		return;
 	(void) close(fd);
 
-	if ((ms->flags & MAGIC_PRESERVE_ATIME) != 0) {
+	/* Nothing to restore if the file was opened with O_NOATIME */
+	if ((ms->flags & MAGIC_PRESERVE_ATIME) != 0 && !noatime) {
 		/*
 		 * Try to restore access, modification times if read it.
 		 * This is really *bad* because it will modify the status
@@ -381,6 +394,180 @@ close_and_restore(const struct magic_set *ms, const char *name, int fd,
 
 #ifndef COMPILE_ONLY
 
+// XXX: change by mscdex
+/*
+ * Make the input the `hlen' bytes of `head' and the `tlen' bytes of `tail'
+ * at input offset `toff'.
+ */
+private void
+input_tail(struct magic_set *ms, const void *head, size_t hlen,
+    const void *tail, size_t tlen, size_t toff)
+{
+	ms->input.two[0].buf = CAST(const unsigned char *, head);
+	ms->input.two[0].off = 0;
+	ms->input.two[0].len = hlen;
+	ms->input.two[1].buf = CAST(const unsigned char *, tail);
+	ms->input.two[1].off = toff;
+	ms->input.two[1].len = tlen;
+	ms->input.seg = ms->input.two;
+	ms->input.nseg = 2;
+	ms->input.end = toff + tlen;
+}
+
+/*
+ * Compute the window at the end of a regular file that the `nbytes' read at
+ * file offset `base' did not cover.  `off' is relative to `base'.
+ */
+private int
+tail_range(const struct magic_set *ms, const struct stat *sb, off_t base,
+    size_t nbytes, size_t *off, size_t *len)
+{
+	size_t size;
+
+	if (ms->tail_max == 0 || !S_ISREG(sb->st_mode) ||
+	    sb->st_size - base <= (off_t)nbytes ||
+	    sb->st_size - base > (off_t)UINT32_MAX)
+		return 0;
+
+	size = (size_t)(sb->st_size - base);
+	*len = MIN(ms->tail_max, size - nbytes);
+	*off = size - *len;
+	return 1;
+}
+
+/*
+ * Read the end of a regular file whose head did not cover it into `tbuf'
+ * (ms->tail_max bytes), so that magic with end-relative offsets can match
+ * without reading the rest of the file.  The head and the tail are read with
+ * one call each, whatever the file size.  `base' is the file offset the head
+ * was read from.  If the window starts at `hoff', the first `have' bytes of
+ * it are already in `tbuf' and only the rest is read.
+ */
+private int
+read_tail(struct magic_set *ms, int fd, const struct stat *sb, off_t base,
+    const unsigned char *head, size_t nbytes, unsigned char *tbuf,
+    size_t hoff, size_t have)
+{
+	size_t off, len;
+	ssize_t r;
+
+	if (!tail_range(ms, sb, base, nbytes, &off, &len))
+		return 0;
+	if (off != hoff)
+		have = 0;
+	if (have < len) {
+		if ((r = pread(fd, tbuf + have, len - have,
+		    base + (off_t)(off + have))) < 0)
+			return 0;
+		have += (size_t)r;
+	} else
+		have = len;
+	if (have == 0)
+		return 0;
+
+	input_tail(ms, head, nbytes, tbuf, have, off);
+	return 1;
+}
+
+// XXX: change by mscdex
+/*
+ * Read what the page cache holds of the `len' bytes at `off' in `fd', without
+ * waiting for I/O: `*cached' is set to the bytes up to the first page that is
+ * not cached (or to the end of the file).  Returns -1 where that cannot be
+ * told, before Linux 4.14 or on file systems without RWF_NOWAIT.
+ */
+public int
+magic_read_cached(int fd, void *buf, size_t len, off_t off, size_t *cached)
+{
+#ifdef RWF_NOWAIT
+	struct iovec iov;
+	ssize_t r;
+
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if ((r = preadv2(fd, &iov, 1, off, RWF_NOWAIT)) == -1 &&
+	    errno != EAGAIN)
+		return -1;
+	*cached = r == -1 ? 0 : (size_t)r;
+	return 0;
+#else
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)off;
+	(void)cached;
+	return -1;
+#endif
+}
+
+/*
+ * Return a buffer of at least `len' bytes for reading files into.  It is
+ * kept in `ms' and reused by later calls, so that the large allocation is
+ * not mapped and unmapped for every file.  Where mmap() is available it is
+ * page aligned and, with MAGIC_HUGEPAGES, advised as transparent huge pages.
+ */
+private unsigned char *
+read_buffer(struct magic_set *ms, size_t len)
+{
+	int huge = (ms->flags & MAGIC_HUGEPAGES) != 0;
+	size_t size = len;
+	void *p;
+
+	if (ms->rbuf.buf != NULL && ms->rbuf.size >= len &&
+	    ms->rbuf.huge == huge)
+		return ms->rbuf.buf;
+	file_rbuf_free(ms);
+
+#if defined(HAVE_MMAP) && defined(MAP_ANON)
+	{
+		size_t align = (size_t)sysconf(_SC_PAGESIZE);
+# ifdef MADV_HUGEPAGE
+		if (huge)
+			align = 2 * 1024 * 1024;
+# endif
+		size = (len + align - 1) & ~(align - 1);
+		p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANON, -1, (off_t)0);
+		if (p != MAP_FAILED) {
+# ifdef MADV_HUGEPAGE
+			if (huge)
+				(void)madvise(p, size, MADV_HUGEPAGE);
+# endif
+			ms->rbuf.mapped = 1;
+			goto out;
+		}
+		size = len;
+	}
+#endif
+	if ((p = malloc(size)) == NULL) {
+		file_oomem(ms, size);
+		return NULL;
+	}
+	ms->rbuf.mapped = 0;
+#if defined(HAVE_MMAP) && defined(MAP_ANON)
+out:
+#endif
+	ms->rbuf.buf = CAST(unsigned char *, p);
+	ms->rbuf.size = size;
+	ms->rbuf.huge = huge;
+	return ms->rbuf.buf;
+}
+
+protected void
+file_rbuf_free(struct magic_set *ms)
+{
+	if (ms->rbuf.buf == NULL)
+		return;
+#if defined(HAVE_MMAP) && defined(MAP_ANON)
+	if (ms->rbuf.mapped)
+		(void)munmap(ms->rbuf.buf, ms->rbuf.size);
+	else
+#endif
+		free(ms->rbuf.buf);
+	ms->rbuf.buf = NULL;
+	ms->rbuf.size = 0;
+}
+
 /*
  * find type of descriptor
  */
@@ -389,7 +576,24 @@ magic_descriptor(struct magic_set *ms, int fd)
 {
 	if (ms == NULL)
 		return NULL;
-	return file_or_fd(ms, NULL, fd);
+	return file_or_fd(ms, NULL, fd, (off_t)-1);
+}
+
+// XXX: change by mscdex
+/*
+ * find type of descriptor contents starting at `offset', without using or
+ * changing the file position
+ */
+public const char *
+magic_descriptor_at(struct magic_set *ms, int fd, off_t offset)
+{
+	if (ms == NULL)
+		return NULL;
+	if (offset < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return file_or_fd(ms, NULL, fd, offset);
 }
 
 /*
@@ -400,17 +604,22 @@ magic_file(struct magic_set *ms, const char *inname)
 {
 	if (ms == NULL)
 		return NULL;
-	return file_or_fd(ms, inname, STDIN_FILENO);
+	return file_or_fd(ms, inname, STDIN_FILENO, (off_t)-1);
 }
 
 private const char *
-file_or_fd(struct magic_set *ms, const char *inname, int fd)
+file_or_fd(struct magic_set *ms, const char *inname, int fd, off_t off)
 {
 	int	rv = -1;
 	unsigned char *buf;
 	struct stat	sb;
 	ssize_t nbytes = 0;	/* number of bytes read from a datafile */
+	ssize_t hcached = -1, tcached = -1;
+	size_t	toff = 0, tlen = 0;
 	int	ispipe = 0;
+	int	okstat = 0;
+	int	usepread = 0;
+	int	noatime = 0;
 	off_t	pos = (off_t)-1;
 
 	if (file_reset(ms, 1) == -1)
@@ -421,9 +630,12 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 	 * some overlapping space for matches near EOF
 	 */
 #define SLOP (1 + sizeof(union VALUETYPE))
-	if ((buf = CAST(unsigned char *, malloc(ms->bytes_max + SLOP))) == NULL)
+	// XXX: change by mscdex
+	/* the tail window, if any, is read right after the head's */
+	if ((buf = read_buffer(ms, ms->bytes_max + SLOP + ms->tail_max)) == NULL)
 		return NULL;
 
+	(void)memset(&sb, 0, sizeof(sb));
 	switch (file_fsmagic(ms, inname, &sb)) {
 	case -1:		/* error */
 		goto done;
@@ -441,14 +653,44 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 #endif
 
 	if (inname == NULL) {
-		if (fstat(fd, &sb) == 0 && S_ISFIFO(sb.st_mode))
+		okstat = fstat(fd, &sb) == 0;
+		if (okstat && S_ISFIFO(sb.st_mode)) {
+			if (off != (off_t)-1) {
+				file_error(ms, ESPIPE, "cannot read fd %d at "
+				    "offset %" INTMAX_T_FORMAT "d", fd,
+				    (intmax_t)off);
+				goto done;
+			}
 			ispipe = 1;
+		} else if (off == (off_t)-1)
+			pos = off = lseek(fd, (off_t)0, SEEK_CUR);
 		else
-			pos = lseek(fd, (off_t)0, SEEK_CUR);
+			usepread = 1;
 	} else {
 		int flags = O_RDONLY|O_BINARY;
-		int okstat = stat(inname, &sb) == 0;
+		// XXX: change by mscdex
+#ifdef WIN32
+		okstat = stat(inname, &sb) == 0;
+#else
+		/*
+		 * file_fsmagic() has already stat'ed the file if it could,
+		 * there is no need to do it again.
+		 */
+		okstat = (sb.st_mode & S_IFMT) != 0;
+#endif
+		off = 0;
 
+#ifdef O_CLOEXEC
+		flags |= O_CLOEXEC;
+#endif
+#ifdef O_NOFOLLOW
+		/*
+		 * file_fsmagic() used lstat() and found no symlink; make sure
+		 * one was not put in its place since.
+		 */
+		if ((ms->flags & MAGIC_SYMLINK) == 0)
+			flags |= O_NOFOLLOW;
+#endif
 		if (okstat && S_ISFIFO(sb.st_mode)) {
 #ifdef O_NONBLOCK
 			flags |= O_NONBLOCK;
@@ -456,8 +698,22 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 			ispipe = 1;
 		}
 
+		// XXX: change by mscdex
+#ifdef O_NOATIME
+		if (ms->flags & MAGIC_NOCACHE)
+			flags |= O_NOATIME;
+#endif
 		errno = 0;
-		if ((fd = open(inname, flags)) < 0) {
+		fd = open(inname, flags);
+#ifdef O_NOATIME
+		/* Only the owner of the file may use O_NOATIME */
+		if (fd < 0 && errno == EPERM && (flags & O_NOATIME)) {
+			flags &= ~O_NOATIME;
+			fd = open(inname, flags);
+		}
+		noatime = fd >= 0 && (flags & O_NOATIME);
+#endif
+		if (fd < 0) {
 #ifdef WIN32
 			/*
 			 * Can't stat, can't open.  It may have been opened in
@@ -477,7 +733,8 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 			goto done;
 		}
 #ifdef O_NONBLOCK
-		if ((flags = fcntl(fd, F_GETFL)) != -1) {
+		/* Only FIFOs were opened non-blocking */
+		if (ispipe && (flags = fcntl(fd, F_GETFL)) != -1) {
 			flags &= ~O_NONBLOCK;
 			(void)fcntl(fd, F_SETFL, flags);
 		}
@@ -511,7 +768,59 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 				_isatty(fd) ? 8 * 1024 :
 #endif
 				ms->bytes_max;
-		if ((nbytes = read(fd, (char *)buf, howmany)) == -1) {
+		size_t n;
+
+		// XXX: change by mscdex
+		/*
+		 * With MAGIC_NOCACHE, note how much of the tail and the head
+		 * the page cache already holds, so that only the pages read
+		 * in here are advised away afterwards, and start reading the
+		 * rest of the tail in while the head is being read.  In a
+		 * file opened here, the kernel is also kept from reading
+		 * ahead past the windows; a descriptor passed in keeps its
+		 * read-ahead setting.
+		 */
+		if ((ms->flags & MAGIC_NOCACHE) && okstat &&
+		    S_ISREG(sb.st_mode) && off != (off_t)-1) {
+#ifdef POSIX_FADV_RANDOM
+			if (inname != NULL)
+				(void)posix_fadvise(fd, 0, 0,
+				    POSIX_FADV_RANDOM);
+#endif
+			if (tail_range(ms, &sb, off,
+			    (size_t)MIN((off_t)howmany, sb.st_size - off),
+			    &toff, &tlen)) {
+				if (magic_read_cached(fd,
+				    buf + ms->bytes_max + SLOP, tlen,
+				    off + (off_t)toff, &n) == 0)
+					tcached = (ssize_t)n;
+#ifdef POSIX_FADV_WILLNEED
+				n = tcached == -1 ? 0 : (size_t)tcached;
+				if (n < tlen)
+					(void)posix_fadvise(fd,
+					    off + (off_t)(toff + n),
+					    (off_t)(tlen - n),
+					    POSIX_FADV_WILLNEED);
+#endif
+			}
+			if (magic_read_cached(fd, buf, howmany, off, &n) == 0)
+				hcached = (ssize_t)n;
+		}
+		if (hcached != -1) {
+			/* Only what was not cached is left to read */
+			nbytes = hcached;
+			if ((size_t)hcached < howmany) {
+				nbytes = pread(fd, (char *)buf + hcached,
+				    howmany - (size_t)hcached,
+				    off + (off_t)hcached);
+				if (nbytes != -1)
+					nbytes += hcached;
+			}
+		} else if (usepread)
+			nbytes = pread(fd, (char *)buf, howmany, off);
+		else
+			nbytes = read(fd, (char *)buf, howmany);
+		if (nbytes == -1) {
 			if (inname == NULL && fd != STDIN_FILENO)
 				file_error(ms, errno, "cannot read fd %d", fd);
 			else
@@ -519,24 +828,99 @@ file_or_fd(struct magic_set *ms, const char *inname, int fd)
 				    inname == NULL ? "/dev/stdin" : inname);
 			goto done;
 		}
+		if (okstat && off != (off_t)-1)
+			(void)read_tail(ms, fd, &sb, off, buf, (size_t)nbytes,
+			    buf + ms->bytes_max + SLOP, toff,
+			    tcached == -1 ? 0 : (size_t)tcached);
 	}
 
 	(void)memset(buf + nbytes, 0, SLOP); /* NUL terminate */
+	// XXX: change by mscdex
+	if (off != (off_t)-1)
+		ms->touch.base = off;
 	if (file_buffer(ms, fd, inname, buf, (size_t)nbytes) == -1)
 		goto done;
 	rv = 0;
 done:
-	free(buf);
+	ms->input.nseg = 0;
 	if (fd != -1) {
+#ifdef POSIX_FADV_DONTNEED
+		/*
+		 * Don't let the scan evict more useful pages: only those that
+		 * were not cached before it are dropped
+		 */
+		if (hcached != -1 && nbytes > hcached)
+			(void)posix_fadvise(fd, off + (off_t)hcached,
+			    (off_t)(nbytes - hcached), POSIX_FADV_DONTNEED);
+		if (tcached != -1 && (size_t)tcached < tlen)
+			(void)posix_fadvise(fd, off + (off_t)(toff + tcached),
+			    (off_t)(tlen - (size_t)tcached),
+			    POSIX_FADV_DONTNEED);
+#endif
 		if (pos != (off_t)-1)
 			(void)lseek(fd, pos, SEEK_SET);
-		close_and_restore(ms, inname, fd, &sb);
+		close_and_restore(ms, inname, fd, &sb, noatime);
 	}
 out:
 	return rv == 0 ? file_getbuffer(ms) : NULL;
 }
 
 
+// XXX: change by mscdex
+/*
+ * find type of the regular file `inname' (which may be NULL) of `size' bytes
+ * whose first `hlen' bytes and, if it is larger than that, whose last `tlen'
+ * bytes were already read by the caller.  `fd' may be -1; if not, it is the
+ * open file and only the ELF and CDF readers use it to look past the head.
+ */
+public const char *
+magic_prefetched(struct magic_set *ms, const char *inname, int fd,
+    const void *head, size_t hlen, const void *tail, size_t tlen, off_t size)
+{
+	int rv;
+
+	if (ms == NULL)
+		return NULL;
+	if (file_reset(ms, 1) == -1)
+		return NULL;
+	if (tail != NULL && tlen > 0 && size <= (off_t)UINT32_MAX &&
+	    (off_t)hlen <= size - (off_t)tlen) {
+		input_tail(ms, head, hlen, tail, tlen,
+		    (size_t)(size - (off_t)tlen));
+	}
+	rv = file_buffer(ms, fd, inname, head, hlen);
+	ms->input.nseg = 0;
+	return rv == -1 ? NULL : file_getbuffer(ms);
+}
+
+// XXX: change by mscdex
+/*
+ * find type of `buf', the first `nb' bytes of longer data still to come.
+ * `*final' is set if no more data can change the result, which is only the
+ * case when it came from a test that did not look past `nb', and never
+ * with MAGIC_CONTINUE or MAGIC_MIME_ENCODING.
+ */
+public const char *
+magic_partial(struct magic_set *ms, const void *buf, size_t nb, int *final)
+{
+	int rv;
+
+	*final = 0;
+	if (ms == NULL)
+		return NULL;
+	if (file_reset(ms, 1) == -1)
+		return NULL;
+	ms->partial.active = 1;
+	ms->partial.missing = (ms->flags &
+	    (MAGIC_CONTINUE|MAGIC_MIME_ENCODING)) != 0;
+	rv = file_buffer(ms, -1, NULL, buf, nb);
+	ms->partial.active = ms->partial.text = 0;
+	if (rv == -1)
+		return NULL;
+	*final = !ms->partial.missing;
+	return file_getbuffer(ms);
+}
+
 public const char *
 magic_buffer(struct magic_set *ms, const void *buf, size_t nb)
 {
@@ -553,7 +937,262 @@ magic_buffer(struct magic_set *ms, const void *buf, size_t nb)
 	}
 	return file_getbuffer(ms);
 }
+
+// XXX: change by mscdex
+/*
+ * Whether the tests other than soft magic need all of an input that starts
+ * with the `hlen' bytes of `head' in one piece: to decompress it, to read a
+ * CDF file, or if it may be text.
+ */
+private int
+input_whole(struct magic_set *ms, const unsigned char *head, size_t hlen)
+{
+	static const unsigned char cdf_magic[] = {
+		0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0xb1, 0x1a, 0xe1
+	};
+
+#if HAVE_FORK
+	if ((ms->flags & (MAGIC_COMPRESS|MAGIC_NO_CHECK_COMPRESS)) ==
+	    MAGIC_COMPRESS)
+		return 1;
 #endif
+	if ((ms->flags & MAGIC_NO_CHECK_CDF) == 0 &&
+	    hlen >= sizeof(cdf_magic) &&
+	    memcmp(head, cdf_magic, sizeof(cdf_magic)) == 0)
+		return 1;
+	if ((ms->flags & (MAGIC_NO_CHECK_ENCODING|MAGIC_NO_CHECK_TEXT)) !=
+	    (MAGIC_NO_CHECK_ENCODING|MAGIC_NO_CHECK_TEXT) &&
+	    file_may_be_text(ms, head, hlen))
+		return 1;
+	return 0;
+}
+
+/*
+ * find type of the data in the `nbufs' buffers `bufs' of `sizes' bytes,
+ * taken in order, as magic_buffer() would on them concatenated.  Soft magic
+ * reads them in place, and only copies ranges that span buffers.  The first
+ * HEAD_MIN bytes are copied if the first buffer holds fewer, and all of the
+ * data is if the other tests need it in one piece (see input_whole()).
+ */
+#define HEAD_MIN	4096
+public const char *
+magic_buffers(struct magic_set *ms, const void **bufs, const size_t *sizes,
+    size_t nbufs)
+{
+	unsigned char head[HEAD_MIN], *buf;
+	struct magic_seg *seg;
+	size_t i, n, size, total, hlen;
+	int rv;
+
+	if (ms == NULL)
+		return NULL;
+	for (total = n = i = 0; i < nbufs; i++) {
+		if (sizes[i] == 0)
+			continue;
+		total += sizes[i];
+		n++;
+	}
+	if (n <= 1) {
+		for (i = 0; i < nbufs && sizes[i] == 0; i++)
+			continue;
+		return magic_buffer(ms, i < nbufs ? bufs[i] : NULL,
+		    i < nbufs ? sizes[i] : 0);
+	}
+	if (file_reset(ms, 1) == -1)
+		return NULL;
+
+	if (ms->input.nsegs < n) {
+		seg = CAST(struct magic_seg *, realloc(ms->input.segs,
+		    n * sizeof(*seg)));
+		if (seg == NULL) {
+			file_oomem(ms, n * sizeof(*seg));
+			return NULL;
+		}
+		ms->input.segs = seg;
+		ms->input.nsegs = n;
+	}
+	seg = ms->input.segs;
+	for (n = i = 0; i < nbufs; i++) {
+		if (sizes[i] == 0)
+			continue;
+		seg[n].buf = CAST(const unsigned char *, bufs[i]);
+		seg[n].off = n == 0 ? 0 : seg[n - 1].off + seg[n - 1].len;
+		seg[n].len = sizes[i];
+		n++;
+	}
+
+	/* Make the head one segment; the one it ends in keeps the rest */
+	hlen = MIN(total, HEAD_MIN);
+	if (seg[0].len < hlen) {
+		for (i = 0; i < n && seg[i].off + seg[i].len <= hlen; i++)
+			(void)memcpy(head + seg[i].off, seg[i].buf,
+			    seg[i].len);
+		if (i < n) {
+			size = hlen - seg[i].off;
+			(void)memcpy(head + seg[i].off, seg[i].buf, size);
+			seg[i].buf += size;
+			seg[i].off += size;
+			seg[i].len -= size;
+		}
+		seg += i - 1;
+		n -= i - 1;
+		seg[0].buf = head;
+		seg[0].off = 0;
+		seg[0].len = hlen;
+	}
+
+	if (input_whole(ms, seg[0].buf, seg[0].len)) {
+		size = ms->bytes_max + SLOP + ms->tail_max;
+		if (total <= size)
+			buf = read_buffer(ms, size);
+		else if ((buf = CAST(unsigned char *, malloc(total))) == NULL)
+			file_oomem(ms, total);
+		if (buf == NULL)
+			return NULL;
+		for (i = 0; i < n; i++)
+			(void)memcpy(buf + seg[i].off, seg[i].buf, seg[i].len);
+		rv = file_buffer(ms, -1, NULL, buf, total);
+		if (buf != ms->rbuf.buf)
+			free(buf);
+	} else {
+		ms->input.seg = seg;
+		ms->input.nseg = n;
+		ms->input.end = total;
+		rv = file_buffer(ms, -1, NULL, seg[0].buf, seg[0].len);
+		ms->input.nseg = 0;
+	}
+	return rv == -1 ? NULL : file_getbuffer(ms);
+}
+#endif
+
+// XXX: change by mscdex
+/*
+ * Copy the time the last call spent in each test (MAGIC_PHASE_*), in ns,
+ * into the `n' entries of `ns'.  Returns a mask (1 << MAGIC_PHASE_*) of the
+ * tests that ran, which is 0 where there is no monotonic clock.
+ */
+public int
+magic_phases(struct magic_set *ms, uint64_t *ns, size_t n)
+{
+	size_t i;
+
+	if (ms == NULL)
+		return -1;
+	for (i = 0; i < n && i < MAGIC_PHASES; i++)
+		ns[i] = ms->phase.ns[i];
+	return ms->phase.ran;
+}
+
+// XXX: change by mscdex
+/*
+ * MAGIC_PROFILE: return how far into its input the last call looked for
+ * the tests that matched (with the built-in text tests, which look at all
+ * of it, left out)
+ */
+public size_t
+magic_touched(struct magic_set *ms)
+{
+	if (ms == NULL)
+		return 0;
+	return ms->touch.max;
+}
+
+// XXX: change by mscdex
+/*
+ * Make calls stop with an error at the next magic entry once `*cancel' is
+ * nonzero, which another thread may set while a call runs (it is read with
+ * relaxed atomic loads).  NULL (the default) turns it off.
+ */
+public void
+magic_setcancel(struct magic_set *ms, const int *cancel)
+{
+	if (ms == NULL)
+		return;
+	ms->cancel = cancel;
+}
+
+/*
+ * Whether the last call ran out of its budget of magic entries
+ * (MAGIC_PARAM_EVAL_MAX, MAGIC_PARAM_TIME_MAX), so that its result is what
+ * matched before then
+ */
+public int
+magic_truncated(struct magic_set *ms)
+{
+	if (ms == NULL)
+		return 0;
+	return ms->budget.truncated;
+}
+
+/*
+ * Copy the time the last magic_load() (or magic_load_buffers()) spent in
+ * each step (MAGIC_LOAD_*), in ns, into the `n' entries of `ns'.  Returns a
+ * mask (1 << MAGIC_LOAD_*) of the steps that ran, which is 0 where there is
+ * no monotonic clock.
+ */
+public int
+magic_load_steps(struct magic_set *ms, uint64_t *ns, size_t n)
+{
+	size_t i;
+
+	if (ms == NULL)
+		return -1;
+	for (i = 0; i < n && i < MAGIC_LOAD_STEPS; i++)
+		ns[i] = ms->load.ns[i];
+	return ms->load.ran;
+}
+
+/*
+ * The size of the magic entries of the loaded databases, whether they were
+ * parsed, read, mapped or given by the caller
+ */
+public size_t
+magic_load_size(struct magic_set *ms)
+{
+	if (ms == NULL)
+		return 0;
+	return ms->load.bytes;
+}
+
+/*
+ * The vector unit the byte-scanning kernels were picked for: scalar, sse2,
+ * avx2, avx512 or neon
+ */
+public const char *
+magic_simd(void)
+{
+	return file_simd->name;
+}
+
+/*
+ * MAGIC_PROFILE: move the counters of the entries evaluated since the last
+ * call into the `n' entries of `out' and return how many were moved; any
+ * left over are moved by the next call.  The strings stay valid while the
+ * database is loaded.
+ */
+public size_t
+magic_profile(struct magic_set *ms, struct magic_entry_prof *out, size_t n)
+{
+	struct prof_entry *pe;
+	uint32_t idx;
+	size_t i;
+
+	if (ms == NULL)
+		return 0;
+	for (i = 0; i < n && ms->prof.ntouched > 0; i++) {
+		idx = ms->prof.touched[--ms->prof.ntouched];
+		pe = &ms->prof.entry[idx];
+		out[i].index = idx;
+		out[i].lineno = pe->m->lineno;
+		out[i].desc = pe->m->desc;
+		out[i].mimetype = pe->m->mimetype;
+		out[i].evals = pe->evals;
+		out[i].matches = pe->matches;
+		out[i].ns = pe->ns;
+		pe->evals = pe->matches = pe->ns = 0;
+	}
+	return i;
+}
 
 public const char *
 magic_error(struct magic_set *ms)
@@ -624,6 +1263,15 @@ magic_setparam(struct magic_set *ms, int param, const void *val)
 	case MAGIC_PARAM_BYTES_MAX:
 		ms->bytes_max = *(const size_t *)val;
 		return 0;
+	case MAGIC_PARAM_TAIL_MAX:
+		ms->tail_max = *(const size_t *)val;
+		return 0;
+	case MAGIC_PARAM_EVAL_MAX:
+		ms->eval_max = *(const size_t *)val;
+		return 0;
+	case MAGIC_PARAM_TIME_MAX:
+		ms->time_max = *(const size_t *)val;
+		return 0;
 	default:
 		errno = EINVAL;
 		return -1;
@@ -655,6 +1303,15 @@ magic_getparam(struct magic_set *ms, int param, void *val)
 	case MAGIC_PARAM_BYTES_MAX:
 		*(size_t *)val = ms->bytes_max;
 		return 0;
+	case MAGIC_PARAM_TAIL_MAX:
+		*(size_t *)val = ms->tail_max;
+		return 0;
+	case MAGIC_PARAM_EVAL_MAX:
+		*(size_t *)val = ms->eval_max;
+		return 0;
+	case MAGIC_PARAM_TIME_MAX:
+		*(size_t *)val = ms->time_max;
+		return 0;
 	default:
 		errno = EINVAL;
 		return -1;
@@ -28,6 +28,7 @@
 #define _MAGIC_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 #define	MAGIC_NONE		0x0000000 /* No flags */
 #define	MAGIC_DEBUG		0x0000001 /* Turn on debugging */
@@ -47,6 +48,12 @@
 					   * extensions */
 #define MAGIC_COMPRESS_TRANSP	0x2000000 /* Check inside compressed files
 					   * but not report compression */
+#define	MAGIC_NOCACHE		0x10000000 /* Don't keep read file data in
+					   * the page cache or update atime */
+#define	MAGIC_HUGEPAGES		0x20000000 /* Back the read buffer with
+					   * huge pages where possible */
+#define	MAGIC_PROFILE		0x40000000 /* Count the evaluations of
+					   * each magic entry */
 #define MAGIC_NODESC		(MAGIC_EXTENSION|MAGIC_MIME|MAGIC_APPLE)
 
 #define	MAGIC_NO_CHECK_COMPRESS	0x0001000 /* Don't check for compressed files */
@@ -100,6 +107,9 @@ b\26no_check_reserved1\0\
 b\27no_check_reserved2\0\
 b\30extension\0\
 b\31transp_compression\0\
+b\34nocache\0\
+b\35hugepages\0\
+b\36profile\0\
 "
 
 /* Defined for backwards compatibility (renamed) */
@@ -111,6 +121,33 @@ b\31transp_compression\0\
 
 #define MAGIC_VERSION		532	/* This implementation */
 
+/* Tests timed by magic_phases() */
+#define	MAGIC_PHASE_ENCODING	0	/* Text encodings */
+#define	MAGIC_PHASE_COMPRESS	1	/* Compressed files */
+#define	MAGIC_PHASE_TAR		2	/* Tar files */
+#define	MAGIC_PHASE_CDF		3	/* CDF files */
+#define	MAGIC_PHASE_SOFT	4	/* Magic entries */
+#define	MAGIC_PHASE_ELF		5	/* ELF details */
+#define	MAGIC_PHASE_TEXT	6	/* Text files */
+#define	MAGIC_PHASES		7
+
+/* Steps of loading a database timed by magic_load_steps() */
+#define	MAGIC_LOAD_MAP		0	/* Reading or mapping a compiled file */
+#define	MAGIC_LOAD_CHECK	1	/* Checking a compiled database */
+#define	MAGIC_LOAD_BYTESWAP	2	/* Swapping one of the other byte order */
+#define	MAGIC_LOAD_PARSE	3	/* Parsing magic source files */
+#define	MAGIC_LOAD_STEPS	4
+
+/* Counters of a magic entry, see magic_profile() */
+struct magic_entry_prof {
+	uint32_t index;		/* of the entry in the loaded database */
+	uint32_t lineno;	/* of the entry in its magic file */
+	const char *desc;	/* printed when it matches */
+	const char *mimetype;
+	uint64_t evals;		/* times evaluated */
+	uint64_t matches;	/* times matched */
+	uint64_t ns;		/* time spent evaluating it, in ns */
+};
 
 #ifdef __cplusplus
 extern "C" {
@@ -123,7 +160,21 @@ void magic_close(magic_t);
 const char *magic_getpath(const char *, int);
 const char *magic_file(magic_t, const char *);
 const char *magic_descriptor(magic_t, int);
+const char *magic_descriptor_at(magic_t, int, off_t);
 const char *magic_buffer(magic_t, const void *, size_t);
+const char *magic_prefetched(magic_t, const char *, int, const void *,
+    size_t, const void *, size_t, off_t);
+const char *magic_partial(magic_t, const void *, size_t, int *);
+const char *magic_buffers(magic_t, const void **, const size_t *, size_t);
+int magic_phases(magic_t, uint64_t *, size_t);
+size_t magic_profile(magic_t, struct magic_entry_prof *, size_t);
+size_t magic_touched(magic_t);
+void magic_setcancel(magic_t, const int *);
+int magic_truncated(magic_t);
+int magic_load_steps(magic_t, uint64_t *, size_t);
+size_t magic_load_size(magic_t);
+const char *magic_simd(void);
+int magic_read_cached(int, void *, size_t, off_t, size_t *);
 
 const char *magic_error(magic_t);
 int magic_getflags(magic_t);
@@ -145,6 +196,9 @@ int magic_errno(magic_t);
 #define MAGIC_PARAM_ELF_NOTES_MAX	4
 #define MAGIC_PARAM_REGEX_MAX		5
 #define	MAGIC_PARAM_BYTES_MAX		6
+#define	MAGIC_PARAM_TAIL_MAX		7
+#define	MAGIC_PARAM_EVAL_MAX		8
+#define	MAGIC_PARAM_TIME_MAX		9
 
 int magic_setparam(magic_t, int, const void *);
 int magic_getparam(magic_t, int, void *);
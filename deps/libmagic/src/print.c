@@ -54,8 +54,9 @@ file_mdump(struct magic *m)
 	static const char optyp[] = { FILE_OPS };
 	char tbuf[26];
 
-	(void) fprintf(stderr, "%u: %.*s %u", m->lineno,
-	    (m->cont_level & 7) + 1, ">>>>>>>>", m->offset);
+	(void) fprintf(stderr, "%u: %.*s %s%u", m->lineno,
+	    (m->cont_level & 7) + 1, ">>>>>>>>",
+	    (m->flag & OFFNEGATIVE) ? "-" : "", m->offset);
 
 	if (m->flag & INDIR) {
 		(void) fprintf(stderr, "(%s,",
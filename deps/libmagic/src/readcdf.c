@@ -556,8 +556,20 @@ file_trycdf(struct magic_set *ms, int fd, const unsigned char *buf,
         info.i_fd = fd;
         info.i_buf = buf;
         info.i_len = nbytes;
+        // XXX: change by mscdex
+        info.i_touched = (ms->flags & MAGIC_PROFILE) ? &ms->touch.cur : NULL;
+        info.i_touched_fd = (ms->flags & MAGIC_PROFILE) ? &ms->touch.fd : NULL;
         if (ms->flags & (MAGIC_APPLE|MAGIC_EXTENSION))
                 return 0;
+        // XXX: change by mscdex
+        /* Anything that starts like a CDF file needs all of it */
+        if (ms->partial.active) {
+                static const unsigned char magic[] = {
+                        0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0xb1, 0x1a, 0xe1
+                };
+                if (memcmp(buf, magic, MIN(nbytes, sizeof(magic))) == 0)
+                        file_partial_missing(ms);
+        }
         if (cdf_read_header(&info, &h) == -1)
                 return 0;
 #ifdef CDF_DEBUG
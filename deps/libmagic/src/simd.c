@@ -0,0 +1,388 @@
+// XXX: change by mscdex
+/*
+ * Byte-scanning kernels in a version for each vector unit: SSE2, AVX2 and
+ * AVX-512 on x86-64, NEON on arm64, and plain C for everything else.  The
+ * baseline of the architecture is used unless the library is built with GCC
+ * or clang, which pick the best one the CPU supports when it is loaded.
+ * MAGIC_SIMD (scalar, sse2, avx2, avx512 or neon) in the environment caps
+ * the choice, to compare them.
+ */
+#include "file.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * Plain ASCII text: the bytes below 0x80 that text_chars in encoding.c calls
+ * T (BEL to CR, ESC and the printing characters)
+ */
+#define IS_TEXT(c)	((unsigned char)((c) - 0x20) < 0x5f || \
+			 (unsigned char)((c) - 0x07) < 0x07 || (c) == 0x1b)
+/* Printable ASCII, which prints the same in every locale */
+#define IS_PRINT(c)	((unsigned char)((c) - 0x20) < 0x5f)
+
+private size_t
+text_span_scalar(const unsigned char *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && IS_TEXT(buf[i]); i++)
+		continue;
+	return i;
+}
+
+private size_t
+print_span_scalar(const unsigned char *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && IS_PRINT(buf[i]); i++)
+		continue;
+	return i;
+}
+
+private size_t
+find_scalar(const unsigned char *s, size_t n, const unsigned char *p,
+    size_t plen)
+{
+	const unsigned char *c, *end;
+
+	if (plen == 0)
+		return 0;
+	if (plen > n)
+		return (size_t)-1;
+	end = s + n - plen + 1;
+	for (c = s; (c = memchr(c, p[0], (size_t)(end - c))) != NULL; c++)
+		if (memcmp(c + 1, p + 1, plen - 1) == 0)
+			return (size_t)(c - s);
+	return (size_t)-1;
+}
+
+#ifdef SIMD_X86
+/*
+ * The same steps at each width: whether bytes are in [lo, lo + len) is
+ * min(b - lo, len - 1) == b - lo, unsigned.  The patterns are found by
+ * comparing their first and last bytes at each position and then the
+ * rest where both match.
+ */
+#define SSE2_RANGE(v, lo, len)						\
+	_mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8(v, _mm_set1_epi8(lo)),	\
+	    _mm_set1_epi8((len) - 1)), _mm_sub_epi8(v, _mm_set1_epi8(lo)))
+#define AVX2_RANGE(v, lo, len)						\
+	_mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8(v,		\
+	    _mm256_set1_epi8(lo)), _mm256_set1_epi8((len) - 1)),	\
+	    _mm256_sub_epi8(v, _mm256_set1_epi8(lo)))
+#define AVX512_RANGE(v, lo, len)					\
+	_mm512_cmple_epu8_mask(_mm512_sub_epi8(v, _mm512_set1_epi8(lo)),\
+	    _mm512_set1_epi8((len) - 1))
+
+private size_t
+text_span_sse2(const unsigned char *buf, size_t n)
+{
+	size_t i;
+	unsigned m;
+	__m128i v;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)(buf + i));
+		m = (unsigned)_mm_movemask_epi8(_mm_or_si128(
+		    _mm_or_si128(SSE2_RANGE(v, 0x20, 0x5f),
+		    SSE2_RANGE(v, 0x07, 0x07)),
+		    _mm_cmpeq_epi8(v, _mm_set1_epi8(0x1b))));
+		if (m != 0xffff)
+			return i + (size_t)__builtin_ctz(~m);
+	}
+	return i + text_span_scalar(buf + i, n - i);
+}
+
+private size_t
+print_span_sse2(const unsigned char *buf, size_t n)
+{
+	size_t i;
+	unsigned m;
+	__m128i v;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)(buf + i));
+		m = (unsigned)_mm_movemask_epi8(SSE2_RANGE(v, 0x20, 0x5f));
+		if (m != 0xffff)
+			return i + (size_t)__builtin_ctz(~m);
+	}
+	return i + print_span_scalar(buf + i, n - i);
+}
+
+private size_t
+find_sse2(const unsigned char *s, size_t n, const unsigned char *p,
+    size_t plen)
+{
+	size_t i, k, last, r;
+	unsigned m;
+	__m128i first, end;
+
+	if (plen < 2 || plen > n)
+		return find_scalar(s, n, p, plen);
+	last = plen - 1;
+	first = _mm_set1_epi8((char)p[0]);
+	end = _mm_set1_epi8((char)p[last]);
+	for (i = 0; i + last + 16 <= n; i += 16) {
+		m = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(first, _mm_loadu_si128(
+		    (const __m128i *)(const void *)(s + i))),
+		    _mm_cmpeq_epi8(end, _mm_loadu_si128(
+		    (const __m128i *)(const void *)(s + i + last)))));
+		for (; m != 0; m &= m - 1) {
+			k = (size_t)__builtin_ctz(m);
+			if (memcmp(s + i + k + 1, p + 1, last - 1) == 0)
+				return i + k;
+		}
+	}
+	r = find_scalar(s + i, n - i, p, plen);
+	return r == (size_t)-1 ? r : i + r;
+}
+
+__attribute__((__target__("avx2"))) private size_t
+text_span_avx2(const unsigned char *buf, size_t n)
+{
+	size_t i;
+	uint32_t m;
+	__m256i v;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(const void *)
+		    (buf + i));
+		m = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(
+		    _mm256_or_si256(AVX2_RANGE(v, 0x20, 0x5f),
+		    AVX2_RANGE(v, 0x07, 0x07)),
+		    _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x1b))));
+		if (m != 0xffffffff)
+			return i + (size_t)__builtin_ctz(~m);
+	}
+	return i + text_span_sse2(buf + i, n - i);
+}
+
+__attribute__((__target__("avx2"))) private size_t
+print_span_avx2(const unsigned char *buf, size_t n)
+{
+	size_t i;
+	uint32_t m;
+	__m256i v;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(const void *)
+		    (buf + i));
+		m = (uint32_t)_mm256_movemask_epi8(AVX2_RANGE(v, 0x20, 0x5f));
+		if (m != 0xffffffff)
+			return i + (size_t)__builtin_ctz(~m);
+	}
+	return i + print_span_sse2(buf + i, n - i);
+}
+
+__attribute__((__target__("avx2"))) private size_t
+find_avx2(const unsigned char *s, size_t n, const unsigned char *p,
+    size_t plen)
+{
+	size_t i, k, last, r;
+	uint32_t m;
+	__m256i first, end;
+
+	if (plen < 2 || plen > n)
+		return find_scalar(s, n, p, plen);
+	last = plen - 1;
+	first = _mm256_set1_epi8((char)p[0]);
+	end = _mm256_set1_epi8((char)p[last]);
+	for (i = 0; i + last + 32 <= n; i += 32) {
+		m = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+		    _mm256_cmpeq_epi8(first, _mm256_loadu_si256(
+		    (const __m256i *)(const void *)(s + i))),
+		    _mm256_cmpeq_epi8(end, _mm256_loadu_si256(
+		    (const __m256i *)(const void *)(s + i + last)))));
+		for (; m != 0; m &= m - 1) {
+			k = (size_t)__builtin_ctz(m);
+			if (memcmp(s + i + k + 1, p + 1, last - 1) == 0)
+				return i + k;
+		}
+	}
+	r = find_sse2(s + i, n - i, p, plen);
+	return r == (size_t)-1 ? r : i + r;
+}
+
+__attribute__((__target__("avx512f,avx512bw"))) private size_t
+text_span_avx512(const unsigned char *buf, size_t n)
+{
+	size_t i;
+	uint64_t m;
+	__m512i v;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		v = _mm512_loadu_si512((const void *)(buf + i));
+		m = AVX512_RANGE(v, 0x20, 0x5f) | AVX512_RANGE(v, 0x07, 0x07) |
+		    _mm512_cmpeq_epi8_mask(v, _mm512_set1_epi8(0x1b));
+		if (m != ~(uint64_t)0)
+			return i + (size_t)__builtin_ctzll(~m);
+	}
+	return i + text_span_avx2(buf + i, n - i);
+}
+
+__attribute__((__target__("avx512f,avx512bw"))) private size_t
+print_span_avx512(const unsigned char *buf, size_t n)
+{
+	size_t i;
+	uint64_t m;
+
+	for (i = 0; i + 64 <= n; i += 64) {
+		m = AVX512_RANGE(_mm512_loadu_si512((const void *)(buf + i)),
+		    0x20, 0x5f);
+		if (m != ~(uint64_t)0)
+			return i + (size_t)__builtin_ctzll(~m);
+	}
+	return i + print_span_avx2(buf + i, n - i);
+}
+
+__attribute__((__target__("avx512f,avx512bw"))) private size_t
+find_avx512(const unsigned char *s, size_t n, const unsigned char *p,
+    size_t plen)
+{
+	size_t i, k, last, r;
+	uint64_t m;
+	__m512i first, end;
+
+	if (plen < 2 || plen > n)
+		return find_scalar(s, n, p, plen);
+	last = plen - 1;
+	first = _mm512_set1_epi8((char)p[0]);
+	end = _mm512_set1_epi8((char)p[last]);
+	for (i = 0; i + last + 64 <= n; i += 64) {
+		m = _mm512_cmpeq_epi8_mask(first,
+		    _mm512_loadu_si512((const void *)(s + i))) &
+		    _mm512_cmpeq_epi8_mask(end,
+		    _mm512_loadu_si512((const void *)(s + i + last)));
+		for (; m != 0; m &= m - 1) {
+			k = (size_t)__builtin_ctzll(m);
+			if (memcmp(s + i + k + 1, p + 1, last - 1) == 0)
+				return i + k;
+		}
+	}
+	r = find_avx2(s + i, n - i, p, plen);
+	return r == (size_t)-1 ? r : i + r;
+}
+
+private const struct file_simd kernels[] = {
+	{ "scalar", text_span_scalar, print_span_scalar, find_scalar },
+	{ "sse2", text_span_sse2, print_span_sse2, find_sse2 },
+	{ "avx2", text_span_avx2, print_span_avx2, find_avx2 },
+	{ "avx512", text_span_avx512, print_span_avx512, find_avx512 },
+};
+#define BASELINE	1
+#endif /* SIMD_X86 */
+
+#ifdef SIMD_NEON
+/*
+ * NEON has no movemask, so a block that is not all in the class (or that
+ * has candidate positions for a pattern) is gone through again in C
+ */
+#define NEON_RANGE(v, lo, len)						\
+	vcleq_u8(vsubq_u8(v, vdupq_n_u8(lo)), vdupq_n_u8((len) - 1))
+
+private size_t
+text_span_neon(const unsigned char *buf, size_t n)
+{
+	size_t i;
+	uint8x16_t v;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = vld1q_u8(buf + i);
+		if (vminvq_u8(vorrq_u8(vorrq_u8(NEON_RANGE(v, 0x20, 0x5f),
+		    NEON_RANGE(v, 0x07, 0x07)),
+		    vceqq_u8(v, vdupq_n_u8(0x1b)))) != 0xff)
+			break;
+	}
+	return i + text_span_scalar(buf + i, n - i);
+}
+
+private size_t
+print_span_neon(const unsigned char *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		if (vminvq_u8(NEON_RANGE(vld1q_u8(buf + i), 0x20, 0x5f)) !=
+		    0xff)
+			break;
+	}
+	return i + print_span_scalar(buf + i, n - i);
+}
+
+private size_t
+find_neon(const unsigned char *s, size_t n, const unsigned char *p,
+    size_t plen)
+{
+	size_t i, r, last;
+	uint8x16_t first, end;
+
+	if (plen < 2 || plen > n)
+		return find_scalar(s, n, p, plen);
+	last = plen - 1;
+	first = vdupq_n_u8(p[0]);
+	end = vdupq_n_u8(p[last]);
+	for (i = 0; i + last + 16 <= n; i += 16) {
+		if (vmaxvq_u8(vandq_u8(vceqq_u8(first, vld1q_u8(s + i)),
+		    vceqq_u8(end, vld1q_u8(s + i + last)))) == 0)
+			continue;
+		r = find_scalar(s + i, last + 16, p, plen);
+		if (r != (size_t)-1)
+			return i + r;
+	}
+	r = find_scalar(s + i, n - i, p, plen);
+	return r == (size_t)-1 ? r : i + r;
+}
+
+private const struct file_simd kernels[] = {
+	{ "scalar", text_span_scalar, print_span_scalar, find_scalar },
+	{ "neon", text_span_neon, print_span_neon, find_neon },
+};
+#define BASELINE	1
+#endif /* SIMD_NEON */
+
+#ifndef BASELINE
+private const struct file_simd kernels[] = {
+	{ "scalar", text_span_scalar, print_span_scalar, find_scalar },
+};
+#define BASELINE	0
+#endif
+
+#define NKERNELS	(sizeof(kernels) / sizeof(kernels[0]))
+
+protected const struct file_simd *file_simd = &kernels[BASELINE];
+
+#ifdef __GNUC__
+/*
+ * Picked before anything else in the library runs, so that threads never
+ * see them change
+ */
+__attribute__((__constructor__)) private void
+simd_init(void)
+{
+	const char *cap = getenv("MAGIC_SIMD");
+	size_t best = BASELINE, i;
+
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		best = 2;
+	if (__builtin_cpu_supports("avx512bw"))
+		best = 3;
+#endif
+	for (i = 0; cap != NULL && i < best; i++)
+		if (strcmp(cap, kernels[i].name) == 0)
+			best = i;
+	file_simd = &kernels[best];
+}
+#endif
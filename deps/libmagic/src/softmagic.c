@@ -44,14 +44,25 @@ FILE_RCSID("@(#)$File: softmagic.c,v 1.249 2017/06/19 18:30:25 christos Exp $")
 #include "der.h"
 
 private int match(struct magic_set *, struct magic *, uint32_t,
+    const struct magic_hot *, uint32_t, int,
     const unsigned char *, size_t, size_t, int, int, int, uint16_t *,
     uint16_t *, int *, int *, int *);
+// XXX: change by mscdex
+private int hot_miss(const struct magic_hot *, uint32_t,
+    const unsigned char *, size_t, size_t);
 private int mget(struct magic_set *, const unsigned char *,
     struct magic *, size_t, size_t, unsigned int, int, int, int, uint16_t *,
     uint16_t *, int *, int *, int *);
 private int magiccheck(struct magic_set *, struct magic *);
 private int32_t mprint(struct magic_set *, struct magic *);
 private int moffset(struct magic_set *, struct magic *, size_t, int32_t *);
+private int input_base(struct magic_set *, const unsigned char *, size_t *);
+private const unsigned char *input_window(struct magic_set *, size_t, size_t,
+    unsigned char *, size_t, size_t *);
+private const unsigned char *input_ptr(struct magic_set *,
+    const unsigned char *, size_t, uint32_t, size_t);
+private size_t input_end(struct magic_set *, const unsigned char *, size_t);
+private size_t mcopy_len(struct magic_set *, int, int, struct magic *);
 private void mdebug(uint32_t, const char *, size_t);
 private int mcopy(struct magic_set *, union VALUETYPE *, int, int,
     const unsigned char *, uint32_t, size_t, struct magic *);
@@ -62,8 +73,30 @@ private int cvt_8(union VALUETYPE *, const struct magic *);
 private int cvt_16(union VALUETYPE *, const struct magic *);
 private int cvt_32(union VALUETYPE *, const struct magic *);
 private int cvt_64(union VALUETYPE *, const struct magic *);
+private struct prof_entry *prof_entry(struct magic_set *,
+    const struct magic *);
+private uint64_t prof_start(struct magic_set *);
+private void prof_end(struct magic_set *, const struct magic *, int,
+    uint64_t);
+private void touch(struct magic_set *, const unsigned char *, size_t,
+    size_t);
+private size_t touch_len(struct magic *, int, int);
+private int budget_out(struct magic_set *);
+
+// XXX: change by mscdex
+#define MPRINT_MAX	512	/* most bytes mprint() shows of a search */
+/*
+ * The cancel flag is set by another thread, and only has to be seen
+ * eventually; MSVC makes volatile loads of an int atomic.
+ */
+#ifdef __GNUC__
+#define CANCELED(p)	__atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+#define CANCELED(p)	(*(const volatile int *)(p))
+#endif
 
 #define OFFSET_OOB(n, o, i)	((n) < (uint32_t)(o) || (i) > ((n) - (o)))
+#define INPUT_OOB(ms, s, n, o, i)	(input_ptr(ms, s, n, o, i) == NULL)
 #define BE64(p) (((uint64_t)(p)->hq[0]<<56)|((uint64_t)(p)->hq[1]<<48)| \
     ((uint64_t)(p)->hq[2]<<40)|((uint64_t)(p)->hq[3]<<32)| \
     ((uint64_t)(p)->hq[4]<<24)|((uint64_t)(p)->hq[5]<<16)| \
@@ -94,6 +127,8 @@ file_softmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes,
 	struct mlist *ml;
 	int rv, printed_something = 0, need_separator = 0;
 	uint16_t nc, ic;
+	// XXX: change by mscdex
+	int pass = -1;
 
 	if (name_count == NULL) {
 		nc = 0;
@@ -104,15 +139,283 @@ file_softmagic(struct magic_set *ms, const unsigned char *buf, size_t nbytes,
 		indir_count = &ic;
 	}
 
+	/*
+	 * Walk the entries of this pass alone, unless it is not one of those
+	 * prepared, or whether the input looks like text may still change
+	 * (every entry that depends on it is noted then).
+	 */
+	if ((mode == BINTEST || mode == TEXTTEST) && !ms->partial.text)
+		pass = HOT_PASS(mode, text);
+
 	for (ml = ms->mlist[0]->next; ml != ms->mlist[0]; ml = ml->next)
-		if ((rv = match(ms, ml->magic, ml->nmagic, buf, nbytes, 0, mode,
-		    text, 0, indir_count, name_count,
+		if ((rv = match(ms, ml->magic, ml->nmagic, ml->hot, ml->first,
+		    pass, buf, nbytes, 0, mode, text, 0, indir_count, name_count,
 		    &printed_something, &need_separator, NULL)) != 0)
 			return rv;
 
 	return 0;
 }
 
+// XXX: change by mscdex
+/*
+ * MAGIC_PROFILE: the counters of entry `m', or NULL if they cannot be
+ * allocated.  The entries of all loaded sets are numbered in order.
+ */
+private struct prof_entry *
+prof_entry(struct magic_set *ms, const struct magic *m)
+{
+	struct prof_range *r;
+	struct prof_entry *pe;
+	struct mlist *ml;
+	size_t i, n = 0, total = 0;
+	uint32_t idx;
+
+	if (ms->prof.range == NULL) {
+		for (i = 0; i < MAGIC_SETS; i++) {
+			if (ms->mlist[i] == NULL)
+				continue;
+			for (ml = ms->mlist[i]->next; ml != ms->mlist[i];
+			    ml = ml->next) {
+				n++;
+				total += ml->nmagic;
+			}
+		}
+		ms->prof.range = CAST(struct prof_range *,
+		    malloc(MAX(n, 1) * sizeof(*ms->prof.range)));
+		ms->prof.entry = CAST(struct prof_entry *,
+		    calloc(MAX(total, 1), sizeof(*ms->prof.entry)));
+		ms->prof.touched = CAST(uint32_t *,
+		    malloc(MAX(total, 1) * sizeof(*ms->prof.touched)));
+		if (ms->prof.range == NULL || ms->prof.entry == NULL ||
+		    ms->prof.touched == NULL) {
+			file_prof_free(ms);
+			return NULL;
+		}
+		n = total = 0;
+		for (i = 0; i < MAGIC_SETS; i++) {
+			if (ms->mlist[i] == NULL)
+				continue;
+			for (ml = ms->mlist[i]->next; ml != ms->mlist[i];
+			    ml = ml->next) {
+				r = &ms->prof.range[n++];
+				r->base = ml->magic;
+				r->n = ml->nmagic;
+				r->first = (uint32_t)total;
+				total += ml->nmagic;
+			}
+		}
+		ms->prof.nrange = n;
+	}
+
+	for (i = 0; i < ms->prof.nrange; i++) {
+		r = &ms->prof.range[i];
+		if (m < r->base || m >= r->base + r->n)
+			continue;
+		idx = r->first + (uint32_t)(m - r->base);
+		pe = &ms->prof.entry[idx];
+		if (pe->evals == 0) {
+			pe->m = m;
+			ms->prof.touched[ms->prof.ntouched++] = idx;
+		}
+		return pe;
+	}
+	return NULL;
+}
+
+protected void
+file_prof_free(struct magic_set *ms)
+{
+	free(ms->prof.range);
+	free(ms->prof.entry);
+	free(ms->prof.touched);
+	memset(&ms->prof, 0, sizeof(ms->prof));
+}
+
+// XXX: change by mscdex
+/*
+ * Count an entry against the budget of the call; once it runs out no more
+ * entries are evaluated, and the result is what matched so far.  The clock
+ * is only read every few entries.
+ */
+private int
+budget_out(struct magic_set *ms)
+{
+	if (ms->budget.truncated)
+		return 1;
+	ms->budget.evals++;
+	if ((ms->eval_max != 0 && ms->budget.evals > ms->eval_max) ||
+	    (ms->budget.deadline != 0 && (ms->budget.evals & 15) == 0 &&
+	    file_now_ns() >= ms->budget.deadline)) {
+		ms->budget.truncated = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Whether the quick test of hot entry `h' rules it out for the input `s'
+ * (from `o' on), without the copy and conversion mget() would make.  It can
+ * only tell when the bytes it reads are all in `s'.
+ */
+private int
+hot_miss(const struct magic_hot *hot, uint32_t h, const unsigned char *s,
+    size_t nbytes, size_t o)
+{
+	uint64_t off = CAST(uint32_t, hot->offset[h] + o), x = 0;
+	size_t len = hot->len[h], i;
+	uint16_t x16;
+	uint32_t x32;
+
+	if (hot->quick[h] == HOT_NONE || off + len > nbytes)
+		return 0;
+	s += off;
+	switch (hot->quick[h]) {
+	case HOT_HOST:
+		switch (len) {
+		case 1:
+			x = s[0];
+			break;
+		case 2:
+			memcpy(&x16, s, sizeof(x16));
+			x = x16;
+			break;
+		case 4:
+			memcpy(&x32, s, sizeof(x32));
+			x = x32;
+			break;
+		default:
+			memcpy(&x, s, sizeof(x));
+			break;
+		}
+		break;
+	case HOT_BE:
+		for (i = 0; i < len; i++)
+			x = x << 8 | s[i];
+		break;
+	case HOT_LE:
+		for (i = len; i-- > 0;)
+			x = x << 8 | s[i];
+		break;
+	default:
+		memcpy(&x, s, len);
+		break;
+	}
+	return (x & hot->mask[h]) != hot->value[h];
+}
+
+/* Start timing the evaluation of an entry */
+private uint64_t
+prof_start(struct magic_set *ms)
+{
+	if ((ms->flags & MAGIC_PROFILE) == 0)
+		return 0;
+	return file_now_ns();
+}
+
+private void
+prof_end(struct magic_set *ms, const struct magic *m, int matched,
+    uint64_t t)
+{
+	struct prof_entry *pe;
+
+	if ((ms->flags & MAGIC_PROFILE) == 0 ||
+	    (pe = prof_entry(ms, m)) == NULL)
+		return;
+	pe->evals++;
+	if (matched)
+		pe->matches++;
+	pe->ns += file_now_ns() - t;
+}
+
+/*
+ * MAGIC_PROFILE: note that the current test read the input up to `off' +
+ * `len' bytes
+ */
+protected void
+file_touch_at(struct magic_set *ms, size_t off, size_t len)
+{
+	if ((ms->flags & MAGIC_PROFILE) == 0)
+		return;
+	if (len > SIZE_MAX - off)
+		len = SIZE_MAX - off;
+	if (off + len > ms->touch.cur)
+		ms->touch.cur = off + len;
+}
+
+/*
+ * MAGIC_PROFILE: note that the current test read `len' bytes at the file
+ * offset `off' through the descriptor, which may go past the input
+ */
+protected void
+file_touch_fd(struct magic_set *ms, off_t off, size_t len)
+{
+	if ((ms->flags & MAGIC_PROFILE) == 0)
+		return;
+	if (off + (off_t)len > ms->touch.fd)
+		ms->touch.fd = off + (off_t)len;
+}
+
+/*
+ * The current test matched: keep how far it read, and start the next.
+ * Reads of the input stop at its end, but those through the descriptor
+ * (the ELF and CDF readers) are kept as they are, relative to the input.
+ */
+protected void
+file_touch_keep(struct magic_set *ms)
+{
+	size_t end = ms->input.nseg != 0 ? ms->input.end : ms->touch.len;
+
+	if (ms->touch.cur > end)
+		ms->touch.cur = end;
+	if (ms->touch.fd > ms->touch.base &&
+	    (uintmax_t)(ms->touch.fd - ms->touch.base) > ms->touch.cur)
+		ms->touch.cur = CAST(size_t, ms->touch.fd - ms->touch.base);
+	if (ms->touch.cur > ms->touch.max)
+		ms->touch.max = ms->touch.cur;
+	ms->touch.cur = 0;
+	ms->touch.fd = 0;
+}
+
+/* Like file_touch_at(), for the `len' bytes at `off' from `s' */
+private void
+touch(struct magic_set *ms, const unsigned char *s, size_t off, size_t len)
+{
+	size_t base;
+
+	if ((ms->flags & MAGIC_PROFILE) == 0 || len == 0)
+		return;
+	if (ms->touch.buf != NULL && s >= ms->touch.buf &&
+	    s < ms->touch.buf + ms->touch.len)
+		base = CAST(size_t, s - ms->touch.buf);
+	else if (ms->input.nseg == 0 || !input_base(ms, s, &base))
+		return;		/* not the input, e.g. decompressed data */
+	file_touch_at(ms, base + off, len);
+}
+
+/*
+ * How many bytes mcopy() reads for `m' that its test looks at; searches
+ * are noted by magiccheck() instead
+ */
+private size_t
+touch_len(struct magic *m, int type, int indir)
+{
+	size_t len;
+
+	if (indir)
+		type = m->in_type;
+	switch (type) {
+	case FILE_STRING:
+	case FILE_PSTRING:
+		return m->vallen;
+	case FILE_BESTRING16:
+	case FILE_LESTRING16:
+		return 2 * (size_t)m->vallen;
+	default:
+		len = file_typesize(type);
+		return len == (size_t)~0 ? 0 : len;
+	}
+}
+
 #define FILE_FMTDEBUG
 #ifdef FILE_FMTDEBUG
 #define F(a, b, c) file_fmtcheck((a), (b), (c), __FILE__, __LINE__)
@@ -161,6 +464,7 @@ file_fmtcheck(struct magic_set *ms, const struct magic *m, const char *def,
  */
 private int
 match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
+    const struct magic_hot *hot, uint32_t first, int pass,
     const unsigned char *s, size_t nbytes, size_t offset, int mode, int text,
     int flip, uint16_t *indir_count, uint16_t *name_count,
     int *printed_something, int *need_separator, int *returnval)
@@ -170,6 +474,16 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 	int returnvalv = 0, e; /* if a match is found it is set to 1*/
 	int firstline = 1; /* a flag to print X\n  X\n- X */
 	int print = (ms->flags & MAGIC_NODESC) == 0;
+	// XXX: change by mscdex
+	uint64_t t;
+	int mc;
+	uint32_t h;
+	/* Quick tests stand in for mget() where it has nothing else to do */
+	int quick = !flip && !ms->partial.active &&
+	    (ms->flags & (MAGIC_DEBUG | MAGIC_PROFILE)) == 0;
+	/* A pass over a whole set visits only the entries it tries */
+	const uint32_t *list = pass != -1 ? hot->pass[pass] : NULL;
+	uint32_t li = 0, nlist = pass != -1 ? hot->npass[pass] : 0;
 
 	if (returnval == NULL)
 		returnval = &returnvalv;
@@ -177,27 +491,56 @@ match(struct magic_set *ms, struct magic *magic, uint32_t nmagic,
 	if (file_check_mem(ms, cont_level) == -1)
 		return -1;
 
+	// XXX: change by mscdex
+	/* Entries are passed over by their hot fields alone, see file.h */
 	for (magindex = 0; magindex < nmagic; magindex++) {
 		int flush = 0;
-		struct magic *m = &magic[magindex];
+		struct magic *m;
+
+		if (list != NULL) {
+			if (li == nlist)
+				break;
+			magindex = list[li++] - first;
+		}
+		m = &magic[magindex];
+		h = first + magindex;
+		// XXX: change by mscdex
+		if (ms->cancel != NULL && CANCELED(ms->cancel)) {
+			file_error(ms, 0, "detection canceled");
+			return -1;
+		}
 
-		if (m->type != FILE_NAME)
-		if ((IS_STRING(m->type) &&
+		/* Whether the input looks like text may still change */
+		if (ms->partial.text && IS_STRING(hot->type[h]) &&
+		    (hot->sflags[h] & (STRING_BINTEST | STRING_TEXTTEST)) !=
+		    (STRING_BINTEST | STRING_TEXTTEST) &&
+		    (hot->sflags[h] & (STRING_BINTEST | STRING_TEXTTEST)) != 0)
+			file_partial_missing(ms);
+
+		if (list == NULL && hot->type[h] != FILE_NAME)
+		if ((IS_STRING(hot->type[h]) &&
 #define FLT (STRING_BINTEST | STRING_TEXTTEST)
-		     ((text && (m->str_flags & FLT) == STRING_BINTEST) ||
-		      (!text && (m->str_flags & FLT) == STRING_TEXTTEST))) ||
-		    (m->flag & mode) != mode) {
+		     ((text && (hot->sflags[h] & FLT) == STRING_BINTEST) ||
+		      (!text && (hot->sflags[h] & FLT) == STRING_TEXTTEST))) ||
+		    (hot->flag[h] & mode) != mode) {
 flush:
 			/* Skip sub-tests */
-			while (magindex < nmagic - 1 &&
-			    magic[magindex + 1].cont_level != 0)
-				magindex++;
+			magindex = MIN(hot->top[h] - first, nmagic) - 1;
 			cont_level = 0;
 			continue; /* Skip to next top-level test*/
 		}
 
+		// XXX: change by mscdex
+		if (budget_out(ms))
+			break;
+		if (quick && hot_miss(hot, h, s, nbytes, offset))
+			goto flush;
+
 		ms->offset = m->offset;
 		ms->line = m->lineno;
+		// XXX: change by mscdex
+		t = prof_start(ms);
+		ms->touch.cur = 0;
 
 		/* if main entry matches, print it... */
 		switch (mget(ms, s, m, nbytes, offset, cont_level, mode, text,
@@ -224,6 +567,10 @@ flush:
 			}
 			break;
 		}
+		// XXX: change by mscdex
+		prof_end(ms, m, !flush, t);
+		if (!flush)
+			file_touch_keep(ms);
 		if (flush) {
 			/*
 			 * main entry didn't match,
@@ -254,7 +601,8 @@ flush:
 		if (print && mprint(ms, m) == -1)
 			return -1;
 
-		switch (moffset(ms, m, nbytes, &ms->c.li[cont_level].off)) {
+		switch (moffset(ms, m, input_end(ms, s, nbytes),
+		    &ms->c.li[cont_level].off)) {
 		case -1:
 		case 0:
 			goto flush;
@@ -267,12 +615,17 @@ flush:
 			return -1;
 
 		while (magindex + 1 < nmagic &&
-		    magic[magindex + 1].cont_level != 0) {
+		    hot->cont_level[first + magindex + 1] != 0) {
 			m = &magic[++magindex];
 			ms->line = m->lineno; /* for messages */
 
-			if (cont_level < m->cont_level)
+			// XXX: change by mscdex
+			/* Skip the entries below this one along with it */
+			if (cont_level < m->cont_level) {
+				magindex = MIN(hot->next[first + magindex] - first,
+				    nmagic) - 1;
 				continue;
+			}
 			if (cont_level > m->cont_level) {
 				/*
 				 * We're at the end of the level
@@ -293,14 +646,22 @@ flush:
 					continue;
 			}
 #endif
+			// XXX: change by mscdex
+			if (budget_out(ms))
+				break;
+			t = prof_start(ms);
+			ms->touch.cur = 0;
 			switch (mget(ms, s, m, nbytes, offset, cont_level, mode,
 			    text, flip, indir_count, name_count,
 			    printed_something, need_separator, returnval)) {
 			case -1:
 				return -1;
 			case 0:
-				if (m->reln != '!')
+				if (m->reln != '!') {
+					// XXX: change by mscdex
+					prof_end(ms, m, 0, t);
 					continue;
+				}
 				flush = 1;
 				break;
 			default:
@@ -310,7 +671,13 @@ flush:
 				break;
 			}
 
-			switch (flush ? 1 : magiccheck(ms, m)) {
+			// XXX: change by mscdex
+			mc = flush ? 1 : magiccheck(ms, m);
+			if (mc != -1)
+				prof_end(ms, m, mc, t);
+			if (mc > 0)
+				file_touch_keep(ms);
+			switch (mc) {
 			case -1:
 				return -1;
 			case 0:
@@ -366,7 +733,7 @@ flush:
 				if (print && mprint(ms, m) == -1)
 					return -1;
 
-				switch (moffset(ms, m, nbytes,
+				switch (moffset(ms, m, input_end(ms, s, nbytes),
 				    &ms->c.li[cont_level].off)) {
 				case -1:
 				case 0:
@@ -449,7 +816,7 @@ mprint(struct magic_set *ms, struct magic *m)
 	float vf;
 	double vd;
 	int64_t t = 0;
- 	char buf[128], tbuf[26], sbuf[512];
+ 	char buf[128], tbuf[26], sbuf[MPRINT_MAX];
 	union VALUETYPE *p = &ms->ms_value;
 
   	switch (m->type) {
@@ -846,6 +1213,8 @@ moffset(struct magic_set *ms, struct magic *m, size_t nbytes, int32_t *op)
 		file_error(ms, 0, "Offset out of range %zu > %zu",
 		    (size_t)o, nbytes);
 #endif
+		// XXX: change by mscdex
+		file_partial_missing(ms);
 		return -1;
 	}
 	*op = o;
@@ -1172,10 +1541,193 @@ mdebug(uint32_t offset, const char *str, size_t len)
 	(void) fputc('\n', stderr);
 }
 
+// XXX: change by mscdex
+/*
+ * The input is the buffer `s' of `nbytes' bytes, unless ms->input lists the
+ * segments it is made of: the head of a file that was too big to read in
+ * full and the bytes at its end, or the buffers of a scattered input.  `s'
+ * is then (part of) one of the segments, and offsets past it are looked up
+ * in the others.
+ */
+
+/*
+ * Return whether `s' lies in a segment of the input, and its input offset
+ * in `*base' if so
+ */
+private int
+input_base(struct magic_set *ms, const unsigned char *s, size_t *base)
+{
+	const struct magic_seg *g;
+	size_t i;
+
+	for (i = 0; i < ms->input.nseg; i++) {
+		g = &ms->input.seg[i];
+		if (s >= g->buf && s < g->buf + g->len) {
+			*base = g->off + CAST(size_t, s - g->buf);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Return a pointer to the input at offset `off', with at least `len' bytes
+ * there, or fewer if the input ends (or skips ahead to a tail) first; their
+ * number goes in `*avail'.  A range within one segment is returned in place,
+ * else it is copied into `buf' (of `size' bytes, which must be at least
+ * `len', or grown if `size' is 0).  Returns NULL if `off' is not in the
+ * input, or if the copy could not be allocated (with the error set).
+ */
+private const unsigned char *
+input_window(struct magic_set *ms, size_t off, size_t len,
+    unsigned char *buf, size_t size, size_t *avail)
+{
+	const struct magic_seg *seg = ms->input.seg;
+	size_t lo = 0, hi = ms->input.nseg, i, n, c;
+
+	/* find the last segment that starts at or before `off' */
+	while (hi - lo > 1) {
+		i = lo + (hi - lo) / 2;
+		if (seg[i].off <= off)
+			lo = i;
+		else
+			hi = i;
+	}
+	if (off < seg[lo].off || off - seg[lo].off >= seg[lo].len)
+		return NULL;
+
+	n = seg[lo].off + seg[lo].len - off;
+	if (n >= len || lo + 1 == ms->input.nseg ||
+	    seg[lo + 1].off != seg[lo].off + seg[lo].len) {
+		*avail = n;
+		return seg[lo].buf + (off - seg[lo].off);
+	}
+
+	if (len > ms->input.end - off)
+		len = ms->input.end - off;
+	if (size == 0) {
+		if (ms->input.ngather < len) {
+			unsigned char *p = CAST(unsigned char *,
+			    realloc(ms->input.gather, len));
+			if (p == NULL) {
+				file_oomem(ms, len);
+				return NULL;
+			}
+			ms->input.gather = p;
+			ms->input.ngather = len;
+		}
+		buf = ms->input.gather;
+	}
+
+	for (n = 0, i = lo; n < len && i < ms->input.nseg &&
+	    (i == lo || seg[i].off == off + n); i++) {
+		c = MIN(len - n, seg[i].len - (off + n - seg[i].off));
+		(void)memcpy(buf + n, seg[i].buf + (off + n - seg[i].off), c);
+		n += c;
+	}
+	*avail = n;
+	return buf;
+}
+
+/*
+ * Return a pointer to the `len' bytes of the input at `offset', or NULL if
+ * they are not all available.
+ */
+private const unsigned char *
+input_ptr(struct magic_set *ms, const unsigned char *s, size_t nbytes,
+    uint32_t offset, size_t len)
+{
+	const unsigned char *p;
+	size_t base, avail;
+
+	if (!OFFSET_OOB(nbytes, offset, len))
+		return s + offset;
+	if (len > sizeof(ms->input.spill) || !input_base(ms, s, &base) ||
+	    (p = input_window(ms, base + offset, len, ms->input.spill,
+	    sizeof(ms->input.spill), &avail)) == NULL || avail < len) {
+		file_partial_missing(ms);
+		return NULL;
+	}
+	return p;
+}
+
+/*
+ * Return the size of the input, which end-relative offsets count back from.
+ */
+private size_t
+input_end(struct magic_set *ms, const unsigned char *s, size_t nbytes)
+{
+	size_t base;
+
+	if (ms->input.nseg != 0 && input_base(ms, s, &base))
+		return ms->input.end - base;
+	return nbytes;
+}
+
+/*
+ * Return how many bytes from its offset mcopy() may need for `m'
+ */
+private size_t
+mcopy_len(struct magic_set *ms, int type, int indir, struct magic *m)
+{
+	size_t len;
+
+	if (indir)
+		return sizeof(union VALUETYPE);
+	switch (type) {
+	case FILE_SEARCH:
+		/* and what mprint() may show from the start of the range */
+		return MAX(m->str_range + m->vallen, MPRINT_MAX);
+	case FILE_REGEX:
+		if (m->str_flags & REGEX_LINE_COUNT)
+			len = m->str_range * 80;
+		else
+			len = m->str_range;
+		if (len == 0 || len > ms->regex_max)
+			len = ms->regex_max;
+		return len;
+	case FILE_DER:
+		/* an element may be as long as the rest of the input */
+		return (size_t)~0;
+	case FILE_BESTRING16:
+	case FILE_LESTRING16:
+		return 2 * sizeof(((union VALUETYPE *)0)->s) + 1;
+	default:
+		return sizeof(union VALUETYPE);
+	}
+}
+
 private int
 mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
     const unsigned char *s, uint32_t offset, size_t nbytes, struct magic *m)
 {
+	size_t base = 0;
+
+	// XXX: change by mscdex
+	touch(ms, s, offset, touch_len(m, type, indir));
+	if (type == FILE_SEARCH || type == FILE_REGEX)
+		ms->touch.s = s;
+	if (ms->input.nseg != 0) {
+		size_t len = mcopy_len(ms, type, indir, m), sbase, avail;
+		const unsigned char *w;
+
+		if (OFFSET_OOB(nbytes, offset, len) &&
+		    input_base(ms, s, &sbase)) {
+			/* Read from a window on the input, in its own
+			 * coordinates */
+			w = input_window(ms, sbase + offset, len, NULL, 0,
+			    &avail);
+			if (w == NULL && (ms->event_flags & EVENT_HAD_ERR))
+				return -1;
+			if (w != NULL) {
+				base = offset;
+				offset = 0;
+				s = w;
+				nbytes = avail;
+			}
+		}
+	}
+
 	/*
 	 * Note: FILE_SEARCH and FILE_REGEX do not actually copy
 	 * anything, but setup pointers into the source
@@ -1184,11 +1736,14 @@ mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
 		switch (type) {
 		case FILE_DER:
 		case FILE_SEARCH:
+			// XXX: change by mscdex
+			if (type == FILE_DER)
+				file_partial_missing(ms);
 			if (offset > nbytes)
 				offset = CAST(uint32_t, nbytes);
 			ms->search.s = RCAST(const char *, s) + offset;
 			ms->search.s_len = nbytes - offset;
-			ms->search.offset = offset;
+			ms->search.offset = base + offset;
 			return 0;
 
 		case FILE_REGEX: {
@@ -1200,6 +1755,8 @@ mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
 			size_t lines, linecnt, bytecnt;
 
 			if (s == NULL || nbytes < offset) {
+				// XXX: change by mscdex
+				file_partial_missing(ms);
 				ms->search.s_len = 0;
 				ms->search.s = NULL;
 				return 0;
@@ -1213,8 +1770,12 @@ mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
 				bytecnt = m->str_range;
 			}
 
-			if (bytecnt == 0 || bytecnt > nbytes - offset)
+			if (bytecnt == 0 || bytecnt > nbytes - offset) {
 				bytecnt = nbytes - offset;
+				// XXX: change by mscdex
+				if (bytecnt < ms->regex_max)
+					file_partial_missing(ms);
+			}
 			if (bytecnt > ms->regex_max)
 				bytecnt = ms->regex_max;
 
@@ -1236,7 +1797,7 @@ mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
 
 			ms->search.s = buf;
 			ms->search.s_len = last - buf;
-			ms->search.offset = offset;
+			ms->search.offset = base + offset;
 			ms->search.rm_len = 0;
 			return 0;
 		}
@@ -1250,6 +1811,9 @@ mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
 			if (type == FILE_BESTRING16)
 				src++;
 
+			// XXX: change by mscdex
+			if (nbytes - offset < 2 * sizeof(p->s))
+				file_partial_missing(ms);
 			/* check that offset is within range */
 			if (offset >= nbytes)
 				break;
@@ -1277,12 +1841,22 @@ mcopy(struct magic_set *ms, union VALUETYPE *p, int type, int indir,
 	}
 
 	if (offset >= nbytes) {
+		// XXX: change by mscdex
+		file_partial_missing(ms);
 		(void)memset(p, '\0', sizeof(*p));
 		return 0;
 	}
-	if (nbytes - offset < sizeof(*p))
+	if (nbytes - offset < sizeof(*p)) {
 		nbytes = nbytes - offset;
-	else
+		// XXX: change by mscdex
+		/*
+		 * Strings are only compared for their length with `=' and
+		 * `!', but any other test or a printed value may look further
+		 */
+		if (!indir && IS_STRING(type) && ((m->reln != '=' &&
+		    m->reln != '!') || strchr(m->desc, '%') != NULL))
+			file_partial_missing(ms);
+	} else
 		nbytes = sizeof(*p);
 
 	(void)memcpy(p, s + offset, nbytes);
@@ -1349,6 +1923,9 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 	char *rbuf;
 	union VALUETYPE *p = &ms->ms_value;
 	struct mlist ml;
+	// XXX: change by mscdex
+	const unsigned char *sub;
+	size_t base, sublen, tcur;
 
 	if (*indir_count >= ms->indir_max) {
 		file_error(ms, 0, "indirect count (%hu) exceeded",
@@ -1362,6 +1939,23 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 		return -1;
 	}
 
+	if (m->flag & OFFNEGATIVE) {
+		size_t end = input_end(ms, s, nbytes);
+
+		// XXX: change by mscdex
+		/* The end of a partial input is still to come */
+		file_partial_missing(ms);
+
+		/*
+		 * Count back from the end of the input, also in a named
+		 * entry: the use base `o' is not subtracted.  ms->offset stays
+		 * relative to that base, so a point before it cannot match.
+		 */
+		if (m->offset > end || end - m->offset < o)
+			return 0;
+		offset = ms->offset = CAST(uint32_t, end - m->offset - o);
+	}
+
 	if (mcopy(ms, p, m->type, m->flag & INDIR, s, (uint32_t)(offset + o),
 	    (uint32_t)nbytes, m) == -1)
 		return -1;
@@ -1383,8 +1977,9 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 		const int sgn = m->in_op & FILE_OPSIGNED;
 		if (m->in_op & FILE_OPINDIRECT) {
 			const union VALUETYPE *q = CAST(const union VALUETYPE *,
-			    ((const void *)(s + offset + off)));
-			if (OFFSET_OOB(nbytes, offset + off, sizeof(*q)))
+			    ((const void *)input_ptr(ms, s, nbytes,
+			    CAST(uint32_t, offset + off), sizeof(*q))));
+			if (q == NULL)
 				return 0;
 			switch (cvt_flip(m->in_type, flip)) {
 			case FILE_BYTE:
@@ -1419,28 +2014,28 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 		}
 		switch (in_type = cvt_flip(m->in_type, flip)) {
 		case FILE_BYTE:
-			if (OFFSET_OOB(nbytes, offset, 1))
+			if (INPUT_OOB(ms, s, nbytes, offset, 1))
 				return 0;
 			offset = do_ops(m, SEXT(sgn,8,p->b), off);
 			break;
 		case FILE_BESHORT:
-			if (OFFSET_OOB(nbytes, offset, 2))
+			if (INPUT_OOB(ms, s, nbytes, offset, 2))
 				return 0;
 			offset = do_ops(m, SEXT(sgn,16,BE16(p)), off);
 			break;
 		case FILE_LESHORT:
-			if (OFFSET_OOB(nbytes, offset, 2))
+			if (INPUT_OOB(ms, s, nbytes, offset, 2))
 				return 0;
 			offset = do_ops(m, SEXT(sgn,16,LE16(p)), off);
 			break;
 		case FILE_SHORT:
-			if (OFFSET_OOB(nbytes, offset, 2))
+			if (INPUT_OOB(ms, s, nbytes, offset, 2))
 				return 0;
 			offset = do_ops(m, SEXT(sgn,16,p->h), off);
 			break;
 		case FILE_BELONG:
 		case FILE_BEID3:
-			if (OFFSET_OOB(nbytes, offset, 4))
+			if (INPUT_OOB(ms, s, nbytes, offset, 4))
 				return 0;
 			lhs = BE32(p);
 			if (in_type == FILE_BEID3)
@@ -1449,7 +2044,7 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 			break;
 		case FILE_LELONG:
 		case FILE_LEID3:
-			if (OFFSET_OOB(nbytes, offset, 4))
+			if (INPUT_OOB(ms, s, nbytes, offset, 4))
 				return 0;
 			lhs = LE32(p);
 			if (in_type == FILE_LEID3)
@@ -1457,12 +2052,12 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 			offset = do_ops(m, SEXT(sgn,32,lhs), off);
 			break;
 		case FILE_MELONG:
-			if (OFFSET_OOB(nbytes, offset, 4))
+			if (INPUT_OOB(ms, s, nbytes, offset, 4))
 				return 0;
 			offset = do_ops(m, SEXT(sgn,32,ME32(p)), off);
 			break;
 		case FILE_LONG:
-			if (OFFSET_OOB(nbytes, offset, 4))
+			if (INPUT_OOB(ms, s, nbytes, offset, 4))
 				return 0;
 			offset = do_ops(m, SEXT(sgn,32,p->l), off);
 			break;
@@ -1497,14 +2092,14 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 	/* Verify we have enough data to match magic type */
 	switch (m->type) {
 	case FILE_BYTE:
-		if (OFFSET_OOB(nbytes, offset, 1))
+		if (INPUT_OOB(ms, s, nbytes, offset, 1))
 			return 0;
 		break;
 
 	case FILE_SHORT:
 	case FILE_BESHORT:
 	case FILE_LESHORT:
-		if (OFFSET_OOB(nbytes, offset, 2))
+		if (INPUT_OOB(ms, s, nbytes, offset, 2))
 			return 0;
 		break;
 
@@ -1523,27 +2118,30 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 	case FILE_FLOAT:
 	case FILE_BEFLOAT:
 	case FILE_LEFLOAT:
-		if (OFFSET_OOB(nbytes, offset, 4))
+		if (INPUT_OOB(ms, s, nbytes, offset, 4))
 			return 0;
 		break;
 
 	case FILE_DOUBLE:
 	case FILE_BEDOUBLE:
 	case FILE_LEDOUBLE:
-		if (OFFSET_OOB(nbytes, offset, 8))
+		if (INPUT_OOB(ms, s, nbytes, offset, 8))
 			return 0;
 		break;
 
 	case FILE_STRING:
 	case FILE_PSTRING:
 	case FILE_SEARCH:
-		if (OFFSET_OOB(nbytes, offset, m->vallen))
+		if (INPUT_OOB(ms, s, nbytes, offset, m->vallen))
 			return 0;
 		break;
 
 	case FILE_REGEX:
-		if (nbytes < offset)
+		if (input_end(ms, s, nbytes) < offset) {
+			// XXX: change by mscdex
+			file_partial_missing(ms);
 			return 0;
+		}
 		break;
 
 	case FILE_INDIRECT:
@@ -1552,15 +2150,29 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 		if (offset == 0)
 			return 0;
 
-		if (nbytes < offset)
+		// XXX: change by mscdex
+		if (nbytes <= offset && ms->input.nseg != 0 &&
+		    input_base(ms, s, &base) &&
+		    (sub = input_window(ms, base + offset, 1, ms->input.spill,
+		    sizeof(ms->input.spill), &sublen)) != NULL) {
+			/* Go on in the segment of the input it is in */
+		} else if (nbytes < offset) {
+			file_partial_missing(ms);
 			return 0;
+		} else {
+			sub = s + offset;
+			sublen = nbytes - offset;
+		}
 
 		if ((pb = file_push_buffer(ms)) == NULL)
 			return -1;
 
 		(*indir_count)++;
-		rv = file_softmagic(ms, s + offset, nbytes - offset,
+		// XXX: change by mscdex
+		tcur = ms->touch.cur;
+		rv = file_softmagic(ms, sub, sublen,
 		    indir_count, name_count, BINTEST, text);
+		ms->touch.cur = tcur;
 
 		if ((ms->flags & MAGIC_DEBUG) != 0)
 			fprintf(stderr, "indirect @offs=%u[%d]\n", offset, rv);
@@ -1584,8 +2196,11 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 		return rv;
 
 	case FILE_USE:
-		if (nbytes < offset)
+		if (input_end(ms, s, nbytes) < offset) {
+			// XXX: change by mscdex
+			file_partial_missing(ms);
 			return 0;
+		}
 		rbuf = m->value.s;
 		if (*rbuf == '^') {
 			rbuf++;
@@ -1599,9 +2214,12 @@ mget(struct magic_set *ms, const unsigned char *s, struct magic *m,
 		oneed_separator = *need_separator;
 		if (m->flag & NOSPACE)
 			*need_separator = 0;
-		rv = match(ms, ml.magic, ml.nmagic, s, nbytes, offset + o,
-		    mode, text, flip, indir_count, name_count,
+		// XXX: change by mscdex
+		tcur = ms->touch.cur;
+		rv = match(ms, ml.magic, ml.nmagic, ml.hot, ml.first, -1, s,
+		    nbytes, offset + o, mode, text, flip, indir_count, name_count,
 		    printed_something, need_separator, returnval);
+		ms->touch.cur = tcur;
 		if (rv != 1)
 		    *need_separator = oneed_separator;
 		return 1;
@@ -1848,15 +2466,57 @@ magiccheck(struct magic_set *ms, struct magic *m)
 		l = 0;
 		v = 0;
 
+		// XXX: change by mscdex
+		/*
+		 * Exact patterns are looked for a vector at a time; as in the
+		 * loop below, they must start within the range and end within
+		 * the data
+		 */
+		if (slen != 0 && (m->reln == '=' || m->reln == '!') &&
+		    (m->str_flags & (STRING_IGNORE_CASE |
+		    STRING_COMPACT_WHITESPACE |
+		    STRING_COMPACT_OPTIONAL_WHITESPACE)) == 0) {
+			const unsigned char *s =
+			    (const unsigned char *)ms->search.s;
+			size_t n = ms->search.s_len;
+			int bounded = 0;
+
+			if (m->str_range != 0 && slen <= n &&
+			    m->str_range <= n - slen + 1) {
+				n = m->str_range + slen - 1;
+				bounded = 1;
+			}
+			idx = file_simd->find(s, n, (const unsigned char *)
+			    m->value.s, slen);
+			if (idx == (size_t)-1) {
+				if (!bounded) {
+					file_partial_missing(ms);
+					return 0;
+				}
+				v = 1;
+				break;
+			}
+			ms->search.offset += idx;
+			ms->search.rm_len = ms->search.s_len - idx;
+			touch(ms, ms->touch.s, ms->search.offset, slen);
+			break;
+		}
+
 		for (idx = 0; m->str_range == 0 || idx < m->str_range; idx++) {
-			if (slen + idx > ms->search.s_len)
+			if (slen + idx > ms->search.s_len) {
+				// XXX: change by mscdex
+				file_partial_missing(ms);
 				return 0;
+			}
 
 			v = file_strncmp(m->value.s, ms->search.s + idx, slen,
 			    m->str_flags);
 			if (v == 0) {	/* found match */
 				ms->search.offset += idx;
 				ms->search.rm_len = ms->search.s_len - idx;
+				// XXX: change by mscdex
+				touch(ms, ms->touch.s, ms->search.offset,
+				    slen);
 				break;
 			}
 		}
@@ -1906,6 +2566,9 @@ magiccheck(struct magic_set *ms, struct magic *m)
 				ms->search.offset += (size_t)pmatch.rm_so;
 				ms->search.rm_len =
 				    (size_t)(pmatch.rm_eo - pmatch.rm_so);
+				// XXX: change by mscdex
+				touch(ms, ms->touch.s, ms->search.offset,
+				    ms->search.rm_len);
 				v = 0;
 				break;
 
@@ -1,9 +1,205 @@
+var Transform = require('stream').Transform;
+var inherits = require('util').inherits;
+
 var Magic = require('../build/Release/magic');
 var fbpath = require('path').join(__dirname, '..', 'magic', 'magic');
 Magic.setFallback(fbpath);
 
+// Returns an async iterator over `{ path, type }` (or `{ path, error }`) for
+// every file below `root`, detected as the walk goes
+Magic.Magic.prototype.detectTree = function(root, options) {
+  var walk = this._walkTree(root, options || {});
+  var batch = [];
+  var pos = 0;
+  var done = false;
+  var reading = null;
+
+  function finish() {
+    done = true;
+    batch = [];
+    walk.close();
+  }
+
+  var iter = {
+    next: function() {
+      if (pos < batch.length)
+        return Promise.resolve({ value: batch[pos++], done: false });
+      if (done)
+        return Promise.resolve({ value: undefined, done: true });
+      // Calls made before the previous batch arrived wait for it
+      if (reading !== null)
+        return reading.then(iter.next, iter.next);
+      reading = new Promise(function(resolve, reject) {
+        walk.read(function(err, results) {
+          reading = null;
+          if (err) {
+            finish();
+            return reject(err);
+          }
+          if (results === null) {
+            finish();
+            return resolve({ value: undefined, done: true });
+          }
+          batch = results;
+          pos = 1;
+          resolve({ value: batch[0], done: false });
+        });
+      });
+      return reading;
+    },
+    return: function() {
+      if (!done)
+        finish();
+      return Promise.resolve({ value: undefined, done: true });
+    }
+  };
+  if (typeof Symbol === 'function' && Symbol.asyncIterator) {
+    iter[Symbol.asyncIterator] = function() {
+      return this;
+    };
+  }
+  return iter;
+};
+
+function abortError(signal) {
+  var err = new Error('The operation was aborted');
+  err.name = 'AbortError';
+  err.code = 'ABORT_ERR';
+  if (signal.reason !== undefined)
+    err.cause = signal.reason;
+  return err;
+}
+
+// With `options.signal', aborting drops the detection if it has not started
+// yet, or stops it at the next magic entry if it has; either way the
+// callback receives an AbortError.  Returns the instance, as the native
+// detect() always has.
+var detect = Magic.Magic.prototype.detect;
+Magic.Magic.prototype.detect = function(data, options, cb) {
+  if (typeof options === 'function')
+    return detect.call(this, data, options);
+
+  var signal = (options ? options.signal : undefined);
+  if (signal === undefined || signal === null)
+    return detect.call(this, data, cb);
+  if (typeof cb !== 'function')
+    throw new TypeError('Third argument must be a callback function');
+
+  if (signal.aborted) {
+    process.nextTick(cb, abortError(signal));
+    return this;
+  }
+
+  var done = false;
+  var handle = this._detectAbortable(data, function(err, result, truncated) {
+    done = true;
+    signal.removeEventListener('abort', onAbort);
+    if (err && err.code === 'ABORT_ERR')
+      return cb(abortError(signal));
+    cb(err, result, truncated);
+  });
+  function onAbort() {
+    handle.abort();
+  }
+  if (!done)
+    signal.addEventListener('abort', onAbort);
+  return this;
+};
+
+// Passes chunks through untouched while feeding the first `prefixLength`
+// bytes to a native detector (see Magic#createDetector()), so that the type
+// is known as soon as the data seen so far settles it
+function DetectStream(magic, options) {
+  if (!(this instanceof DetectStream))
+    return new DetectStream(magic, options);
+  Transform.call(this, options);
+
+  var prefixLength = (options ? options.prefixLength : undefined);
+  if (prefixLength === undefined)
+    prefixLength = Magic.bytesMax;
+  else if (typeof prefixLength !== 'number' || !(prefixLength > 0))
+    throw new RangeError('prefixLength must be a positive number');
+
+  this.type = undefined;
+  this._detector = magic.createDetector();
+  this._prefixLength = prefixLength;
+  this._fed = 0;
+  // Chunks (or slices of them) not yet fed to the detector
+  this._chunks = [];
+  this._feeding = false;
+  this._ending = false;
+  this._settled = false;
+  this._onSettled = null;
+}
+inherits(DetectStream, Transform);
+
+DetectStream.prototype._transform = function(chunk, encoding, cb) {
+  var need = this._prefixLength - this._fed;
+  if (!this._settled && need > 0) {
+    // slice() shares memory with the chunk
+    this._chunks.push(chunk.length > need ? chunk.slice(0, need) : chunk);
+    this._fed += Math.min(chunk.length, need);
+    this._feed();
+  }
+  cb(null, chunk);
+};
+
+DetectStream.prototype._flush = function(cb) {
+  if (this._settled)
+    return cb();
+  this._ending = true;
+  this._onSettled = cb;
+  this._feed();
+};
+
+DetectStream.prototype._feed = function() {
+  var self = this;
+
+  if (this._feeding || this._settled)
+    return;
+
+  // Chunks that arrived during the previous call are fed together
+  if (this._chunks.length > 0) {
+    var data = (this._chunks.length === 1
+                ? this._chunks[0]
+                : Buffer.concat(this._chunks));
+    this._chunks = [];
+    this._feeding = true;
+    this._detector.feed(data, onResult);
+  } else if (this._ending || this._fed >= this._prefixLength) {
+    this._feeding = true;
+    this._detector.end(onResult);
+  }
+
+  function onResult(err, result) {
+    self._feeding = false;
+    if (err || result !== null) {
+      var cb = self._onSettled;
+      self._settled = true;
+      self._chunks = [];
+      self._onSettled = null;
+      if (err) {
+        if (cb)
+          return cb(err);
+        return self.destroy(err);
+      }
+      self.type = result;
+      self.emit('type', result);
+      if (cb)
+        cb();
+      return;
+    }
+    self._feed();
+  }
+};
+
+Magic.Magic.prototype.createDetectStream = function(options) {
+  return new DetectStream(this, options);
+};
+
 module.exports = {
   Magic: Magic.Magic,
+  simd: Magic.simd, /* Vector unit libmagic's byte scanning was picked for */
   MAGIC_NONE: 0x000000, /* No flags (default for Windows) */
   MAGIC_DEBUG: 0x000001, /* Turn on debugging */
   MAGIC_SYMLINK: 0x000002, /* Follow symlinks (default for *nix) */
@@ -16,6 +212,9 @@ module.exports = {
   MAGIC_MIME_ENCODING: 0x000400, /* Return the MIME encoding */
   MAGIC_MIME: (0x000010|0x000400), /*(MAGIC_MIME_TYPE|MAGIC_MIME_ENCODING)*/
   MAGIC_APPLE: 0x000800, /* Return the Apple creator and type */
+  MAGIC_NOCACHE: 0x10000000, /* Don't pollute the page cache or update atime */
+  MAGIC_HUGEPAGES: 0x20000000, /* Back read buffers with huge pages */
+  MAGIC_PROFILE: 0x40000000, /* Count the evaluations of magic entries */
 
   MAGIC_NO_CHECK_TAR: 0x002000, /* Don't check for tar files */
   MAGIC_NO_CHECK_SOFT: 0x004000, /* Don't check magic entries */
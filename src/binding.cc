@@ -3,6 +3,13 @@
 #include <nan.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+
+#include <atomic>
+#include <deque>
+#include <limits>
+#include <string>
+#include <vector>
 
 #ifdef _WIN32
 # include <io.h>
@@ -10,11 +17,17 @@
 # include <wchar.h>
 #endif
 
+#include "limiter.h"
 #include "magic.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "walker.h"
 
 using namespace node;
 using namespace v8;
 
+class DetectHandle;
+
 class DetectRequest : public Nan::AsyncResource {
 public:
   DetectRequest(Local<Function> callback_, const char* magic_source_,
@@ -27,18 +40,26 @@ public:
     callback.Reset(callback_);
 
     request.data = this;
-    free_error = true;
+    data = nullptr;
+    data_len = 0;
+    data_is_fd = false;
     error_message = nullptr;
     result = nullptr;
+    stats = nullptr;
+    DetectTimingInit(&timing);
+    pipeline = nullptr;
+    magic_pool = nullptr;
+    limiter = nullptr;
+    error_code = nullptr;
+    canceled = 0;
+    queued = false;
+    handle = nullptr;
   }
 
   ~DetectRequest() {
     callback.Reset();
     data_buffer.Reset();
-    if (data_is_path)
-      free(data);
-    if (free_error)
-      free(error_message);
+    free(error_message);
     free((void*)result);
   }
 
@@ -47,23 +68,786 @@ public:
 
   char* data;
   size_t data_len;
-  bool data_is_path;
+  // detect() with an Array of Buffers: their contents, in order
+  std::vector<const void*> bufs;
+  std::vector<size_t> buf_lens;
+  // Keeps the input Buffer(s) (or FileHandle) alive while the request is
+  // queued
   Nan::Persistent<Object> data_buffer;
 
+  int fd;
+  int64_t fd_offset;
+  bool data_is_fd;
+
+  // detectFile() goes through the instance's Pipeline instead of DetectWork
+  FileJob file;
+  Pipeline* pipeline;
+  // detectFd() borrows a handle from the Pipeline's pool instead of loading
+  // its own
+  Pipeline* magic_pool;
+
   // libmagic info
   const char* magic_source;
   size_t source_len;
   bool source_is_path;
   int flags;
 
-  bool free_error;
   char* error_message;
+  // `code' property of the error, if any
+  const char* error_code;
 
   const char* result;
+
+  // Set once admitted by the instance's Limiter, which is told when the
+  // request is done
+  Limiter* limiter;
+  Admission admission;
+
+  // Where DetectAfter records the timing, if anywhere (detectFile() is
+  // recorded by the Pipeline)
+  Stats* stats;
+  DetectTiming timing;
+
+  // Set on the loop thread by AbortDetect(); libmagic loads it with a
+  // relaxed atomic load and stops at its next magic entry once it is set
+  // (see magic_setcancel())
+  std::atomic<int> canceled;
+  // The work is in the threadpool's queue, or done
+  bool queued;
+  // The JavaScript handle of detect() with a signal, while both are alive
+  DetectHandle* handle;
+
+  Budget budget;
 };
 
+// magic_setcancel() takes the flag as a plain int
+static_assert(sizeof(std::atomic<int>) == sizeof(int),
+              "std::atomic<int> is not laid out as an int");
+
 static Nan::Persistent<Function> constructor;
-static const char* fallbackPath;
+const char* fallbackPath;
+
+static const char* const kOverloaded = "Too many detections in progress";
+static const char* const kAborted = "The operation was aborted";
+
+// Drops a detection that has not started yet (it is called back with an
+// error from the Limiter or the threadpool), or makes one that has stop
+// early
+static void AbortDetect(DetectRequest* detect_req) {
+  if (detect_req->canceled)
+    return;
+  detect_req->canceled = 1;
+  if (detect_req->queued)
+    uv_cancel(reinterpret_cast<uv_req_t*>(&detect_req->request));
+  else if (detect_req->limiter != nullptr)
+    detect_req->limiter->Cancel(&detect_req->admission);
+}
+
+static Local<Value> ErrorValue(const char* message, const char* code) {
+  Local<Value> err = Nan::Error(message);
+  if (code != nullptr) {
+    Nan::Set(err.As<Object>(),
+             Nan::New<String>("code").ToLocalChecked(),
+             Nan::New<String>(code).ToLocalChecked());
+  }
+  return err;
+}
+
+static Local<Value> ResultValue(const char* result, int flags) {
+  int multi_result_flags = (flags & (MAGIC_CONTINUE | MAGIC_RAW));
+
+  if (multi_result_flags == (MAGIC_CONTINUE | MAGIC_RAW)) {
+    Local<Array> results = Nan::New<Array>();
+    if (result) {
+      uint32_t i = 0;
+      const char* result_end = result + strlen(result);
+      const char* last_match = result;
+      const char* cur_match;
+      while (true) {
+        if (!(cur_match = strstr(last_match, "\n- "))) {
+          // Append remainder string
+          if (last_match < result_end) {
+            Nan::Set(Local<Object>::Cast(results),
+                     i,
+                     Nan::New<String>(last_match).ToLocalChecked());
+          }
+          break;
+        }
+
+        size_t match_len = (cur_match - last_match);
+        char* match = new char[match_len + 1];
+        strncpy(match, last_match, match_len);
+        match[match_len] = '\0';
+
+        Nan::Set(Local<Object>::Cast(results),
+                 i++,
+                 Nan::New<String>(match).ToLocalChecked());
+
+        delete[] match;
+        last_match = cur_match + 3;
+      }
+    }
+    return results;
+  } else if (result) {
+    return Nan::New<String>(result).ToLocalChecked();
+  }
+  return Nan::New<String>().ToLocalChecked();
+}
+
+class BatchRequest : public Nan::AsyncResource {
+public:
+  BatchRequest(Local<Function> callback_, int flags_, size_t count)
+    : Nan::AsyncResource("mmmagic:BatchRequest"),
+      jobs(count),
+      flags(flags_),
+      remaining(count),
+      pipeline(nullptr),
+      limiter(nullptr),
+      error_message(nullptr),
+      error_code(nullptr) {
+    callback.Reset(callback_);
+
+    work.data = this;
+    admission.bytes = 0;
+    admission.start = Start;
+    admission.reject = Reject;
+    admission.data = this;
+    for (size_t i = 0; i < count; ++i) {
+      FileJobInit(&jobs[i]);
+      jobs[i].complete = FileDone;
+      jobs[i].data = this;
+    }
+  }
+
+  ~BatchRequest() {
+    callback.Reset();
+    for (size_t i = 0; i < jobs.size(); ++i)
+      FileJobFree(&jobs[i]);
+    free(error_message);
+  }
+
+  // Admitted by `limiter'
+  static void Start(Admission* admission) {
+    BatchRequest* batch_req = static_cast<BatchRequest*>(admission->data);
+
+    if (batch_req->jobs.empty()) {
+      int status = uv_queue_work(uv_default_loop(),
+                                 &batch_req->work,
+                                 EmptyWork,
+                                 EmptyAfter);
+      if (status != 0) {
+        batch_req->error_message = strdup(uv_strerror(status));
+        batch_req->Finish();
+      }
+      return;
+    }
+    for (size_t i = 0; i < batch_req->jobs.size(); ++i)
+      batch_req->pipeline->Push(&batch_req->jobs[i]);
+  }
+
+  static void Reject(Admission* admission) {
+    BatchRequest* batch_req = static_cast<BatchRequest*>(admission->data);
+
+    batch_req->limiter = nullptr;
+    batch_req->error_message = strdup(kOverloaded);
+    batch_req->error_code = "EBUSY";
+    batch_req->Finish();
+  }
+
+  static void FileDone(FileJob* job) {
+    BatchRequest* batch_req = static_cast<BatchRequest*>(job->data);
+    if (--batch_req->remaining == 0)
+      batch_req->Finish();
+  }
+
+  // An empty batch still calls back asynchronously
+  static void EmptyWork(uv_work_t* req) {
+  }
+
+  static void EmptyAfter(uv_work_t* req, int status) {
+    static_cast<BatchRequest*>(req->data)->Finish();
+  }
+
+  void Finish() {
+    Nan::HandleScope scope;
+    Local<Function> callback = Nan::New(this->callback);
+    Local<Object> target = Nan::New<Object>();
+    Local<Array> results = Nan::New<Array>(jobs.size());
+
+    if (limiter != nullptr)
+      limiter->Done(&admission);
+
+    if (error_message) {
+      Local<Value> argv[1] = { ErrorValue(error_message, error_code) };
+      runInAsyncScope(target, callback, 1, argv);
+      delete this;
+      return;
+    }
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+      Local<Value> value;
+      if (jobs[i].error_message)
+        value = Nan::Error(jobs[i].error_message);
+      else
+        value = ResultValue(jobs[i].result, flags);
+      Nan::Set(results, (uint32_t)i, value);
+    }
+
+    Local<Value> argv[2] = { Nan::Null(), results };
+    runInAsyncScope(target, callback, 2, argv);
+
+    delete this;
+  }
+
+  Nan::Persistent<Function> callback;
+  std::vector<FileJob> jobs;
+  uv_work_t work;
+  int flags;
+  size_t remaining;
+  Pipeline* pipeline;
+  // Set once admitted, as for DetectRequest
+  Limiter* limiter;
+  Admission admission;
+  char* error_message;
+  const char* error_code;
+};
+
+// State of a detectTree() walk, shared by its JS handle and the files in
+// flight.  Detected files are handed to JS in batches through read(); the
+// walker pauses while too many files are detected or waiting to be read.
+class TreeWalk : public Nan::AsyncResource {
+public:
+  TreeWalk(Pipeline* pipeline_, int flags_, size_t batch_size_)
+    : Nan::AsyncResource("mmmagic:TreeWalk"),
+      walker(nullptr),
+      pipeline(pipeline_),
+      flags(flags_),
+      batch_size(batch_size_),
+      detecting(0),
+      walk_done(false),
+      closed(false),
+      freed(false),
+      start_error(0) {
+    async.data = this;
+    uv_async_init(uv_default_loop(), &async, OnNotify);
+    // Only holds the loop open while JS waits for a batch
+    uv_unref(reinterpret_cast<uv_handle_t*>(&async));
+  }
+
+  ~TreeWalk() {
+    read_cb.Reset();
+    delete walker;
+  }
+
+  void Start(const char* root, const Walker::Options& options) {
+    walker = new Walker(root, options, Notify, this);
+    start_error = walker->Start();
+    if (start_error != 0) {
+      root_path = root;
+      walk_done = true;
+    }
+  }
+
+  void Read(Local<Function> callback) {
+    read_cb.Reset(callback);
+    uv_ref(reinterpret_cast<uv_handle_t*>(&async));
+    Deliver();
+  }
+
+  // Called when the iterator is closed early or the handle is collected
+  void Close() {
+    closed = true;
+    walker->Stop();
+    Deliver();
+  }
+
+  bool IsReading() const {
+    return !read_cb.IsEmpty();
+  }
+
+private:
+  // Runs on the walker thread
+  static void Notify(void* data) {
+    uv_async_send(&static_cast<TreeWalk*>(data)->async);
+  }
+
+  static void OnNotify(uv_async_t* handle) {
+    TreeWalk* tree = static_cast<TreeWalk*>(handle->data);
+    std::vector<Walker::Entry> entries;
+
+    if (tree->walk_done)
+      return;
+    tree->walk_done = tree->walker->Take(&entries);
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      FileJob* job = new FileJob();
+      FileJobInit(job);
+      job->path = entries[i].path;
+      job->complete = FileDone;
+      job->data = tree;
+      if (entries[i].error != 0) {
+        std::string msg = std::string("cannot read directory `") + job->path
+                          + "' (" + strerror(entries[i].error) + ")";
+        job->error_message = strdup(msg.c_str());
+        tree->results.push_back(job);
+      } else {
+        ++tree->detecting;
+        tree->pipeline->Push(job);
+      }
+    }
+
+    tree->Deliver();
+  }
+
+  static void FileDone(FileJob* job) {
+    TreeWalk* tree = static_cast<TreeWalk*>(job->data);
+    --tree->detecting;
+    tree->results.push_back(job);
+    tree->Deliver();
+  }
+
+  // Hands a batch to the pending read() once one is full, or once no more
+  // files are being detected
+  void Deliver() {
+    bool over = walk_done && detecting == 0;
+
+    if (closed) {
+      walker->Consumed(results.size());
+      for (size_t i = 0; i < results.size(); ++i) {
+        FileJobFree(results[i]);
+        delete results[i];
+      }
+      results.clear();
+      // Nothing else can refer to the walk once it is over
+      if (over && !freed) {
+        freed = true;
+        uv_close(reinterpret_cast<uv_handle_t*>(&async), OnClose);
+      }
+      return;
+    }
+
+    if (read_cb.IsEmpty())
+      return;
+    if (start_error == 0
+        && results.size() < batch_size
+        && (results.empty() || detecting > 0)
+        && !over) {
+      return;
+    }
+
+    Nan::HandleScope scope;
+    Local<Function> callback = Nan::New(read_cb);
+    Local<Object> target = Nan::New<Object>();
+    Local<Value> argv[2];
+    int argc = 2;
+
+    read_cb.Reset();
+    uv_unref(reinterpret_cast<uv_handle_t*>(&async));
+
+    if (start_error != 0) {
+      std::string msg = std::string("cannot read directory `") + root_path
+                        + "' (" + strerror(start_error) + ")";
+      argv[0] = Nan::Error(msg.c_str());
+      argc = 1;
+      start_error = 0;
+    } else if (results.empty()) {
+      argv[0] = Nan::Null();
+      argv[1] = Nan::Null();
+    } else {
+      size_t count = (results.size() < batch_size ? results.size()
+                                                   : batch_size);
+      Local<Array> batch = Nan::New<Array>(count);
+      Local<String> path_key = Nan::New<String>("path").ToLocalChecked();
+      Local<String> type_key = Nan::New<String>("type").ToLocalChecked();
+      Local<String> error_key = Nan::New<String>("error").ToLocalChecked();
+      for (size_t i = 0; i < count; ++i) {
+        FileJob* job = results.front();
+        results.pop_front();
+        Local<Object> entry = Nan::New<Object>();
+        Nan::Set(entry, path_key, Nan::New<String>(job->path).ToLocalChecked());
+        if (job->error_message) {
+          Nan::Set(entry, error_key, Nan::Error(job->error_message));
+        } else {
+          Nan::Set(entry, type_key, ResultValue(job->result, flags));
+        }
+        Nan::Set(batch, (uint32_t)i, entry);
+        FileJobFree(job);
+        delete job;
+      }
+      walker->Consumed(count);
+      argv[0] = Nan::Null();
+      argv[1] = batch;
+    }
+
+    runInAsyncScope(target, callback, argc, argv);
+  }
+
+  static void OnClose(uv_handle_t* handle) {
+    delete static_cast<TreeWalk*>(handle->data);
+  }
+
+  Walker* walker;
+  Pipeline* pipeline;
+  int flags;
+  size_t batch_size;
+
+  std::deque<FileJob*> results;
+  unsigned detecting;
+  bool walk_done;
+  bool closed;
+  bool freed;
+  int start_error;
+  std::string root_path;
+
+  Nan::Persistent<Function> read_cb;
+  uv_async_t async;
+};
+
+static Nan::Persistent<Function> tree_constructor;
+
+// The object returned by Magic#_walkTree(); closes the walk when collected
+class TreeWalkHandle : public ObjectWrap {
+public:
+  TreeWalk* tree;
+
+  TreeWalkHandle() : tree(nullptr) {
+  }
+
+  ~TreeWalkHandle() {
+    if (tree != nullptr)
+      tree->Close();
+  }
+
+  static void New(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    TreeWalkHandle* obj = new TreeWalkHandle();
+    obj->Wrap(args.This());
+    args.GetReturnValue().Set(args.This());
+  }
+
+  static void Read(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    Nan::HandleScope();
+    TreeWalkHandle* obj = ObjectWrap::Unwrap<TreeWalkHandle>(args.This());
+
+    if (!args[0]->IsFunction())
+      return Nan::ThrowTypeError("First argument must be a callback function");
+    if (obj->tree == nullptr)
+      return Nan::ThrowError("The walk is closed");
+    if (obj->tree->IsReading())
+      return Nan::ThrowError("A read is already pending");
+
+    obj->tree->Read(Local<Function>::Cast(args[0]));
+  }
+
+  static void Close(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    TreeWalkHandle* obj = ObjectWrap::Unwrap<TreeWalkHandle>(args.This());
+    if (obj->tree != nullptr) {
+      obj->tree->Close();
+      obj->tree = nullptr;
+    }
+  }
+
+  static void Initialize() {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    tpl->SetClassName(Nan::New<String>("TreeWalk").ToLocalChecked());
+    Nan::SetPrototypeMethod(tpl, "read", Read);
+    Nan::SetPrototypeMethod(tpl, "close", Close);
+
+    tree_constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
+  }
+};
+
+static Nan::Persistent<Function> detect_handle_constructor;
+
+// The object returned by Magic#_detectAbortable(); see detect() in
+// lib/index.js
+class DetectHandle : public ObjectWrap {
+public:
+  DetectRequest* detect_req;
+
+  DetectHandle() : detect_req(nullptr) {
+  }
+
+  ~DetectHandle() {
+    if (detect_req != nullptr)
+      detect_req->handle = nullptr;
+  }
+
+  static void New(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    DetectHandle* obj = new DetectHandle();
+    obj->Wrap(args.This());
+    args.GetReturnValue().Set(args.This());
+  }
+
+  static void Abort(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    DetectHandle* obj = ObjectWrap::Unwrap<DetectHandle>(args.This());
+    if (obj->detect_req != nullptr)
+      AbortDetect(obj->detect_req);
+  }
+
+  static void Initialize() {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    tpl->SetClassName(Nan::New<String>("DetectHandle").ToLocalChecked());
+    Nan::SetPrototypeMethod(tpl, "abort", Abort);
+
+    detect_handle_constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
+  }
+};
+
+static Nan::Persistent<Function> detector_constructor;
+// Number of leading bytes libmagic looks at, by default
+static size_t bytes_max;
+
+// Detects the type of data that arrives in pieces, as returned by
+// Magic#createDetector().  Each feed() copies its chunk (up to bytes_max
+// bytes in all) and evaluates everything seen so far on the threadpool,
+// reporting the type as soon as no more data can change it.  That is only
+// done again once the data has doubled since, so that many small chunks do
+// not cost quadratic time.
+class Detector : public ObjectWrap {
+public:
+  Pipeline* pipeline;
+  Stats* stats;
+  int flags;
+  Budget budget;
+
+  Detector()
+    : pipeline(nullptr),
+      stats(nullptr),
+      flags(0),
+      data(nullptr),
+      data_len(0),
+      data_size(0),
+      evaluated_len(0),
+      busy(false),
+      ending(false),
+      ended(false),
+      final(false),
+      skipped(false),
+      result(nullptr),
+      error_message(nullptr),
+      resource(nullptr) {
+    work.data = this;
+    budget.evaluations = budget.time_us = 0;
+  }
+
+  ~Detector() {
+    free(data);
+    free(result);
+    free(error_message);
+  }
+
+  static void New(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    Detector* obj = new Detector();
+    obj->Wrap(args.This());
+    args.GetReturnValue().Set(args.This());
+  }
+
+  static void Feed(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    Nan::HandleScope();
+    Detector* obj = ObjectWrap::Unwrap<Detector>(args.This());
+
+    if (args.Length() < 2)
+      return Nan::ThrowTypeError("Expecting 2 arguments");
+    if (!Buffer::HasInstance(args[0]))
+      return Nan::ThrowTypeError("First argument must be a Buffer");
+    if (!args[1]->IsFunction())
+      return Nan::ThrowTypeError("Second argument must be a callback function");
+    if (!obj->CanQueue())
+      return;
+
+    if (!obj->final && !obj->Append(args[0].As<Object>()))
+      return Nan::ThrowError("Out of memory");
+    obj->Queue(Local<Function>::Cast(args[1]), false);
+  }
+
+  static void End(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+    Nan::HandleScope();
+    Detector* obj = ObjectWrap::Unwrap<Detector>(args.This());
+
+    if (!args[0]->IsFunction())
+      return Nan::ThrowTypeError("First argument must be a callback function");
+    if (!obj->CanQueue())
+      return;
+
+    obj->Queue(Local<Function>::Cast(args[0]), true);
+  }
+
+  static void Initialize() {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    tpl->SetClassName(Nan::New<String>("Detector").ToLocalChecked());
+    Nan::SetPrototypeMethod(tpl, "feed", Feed);
+    Nan::SetPrototypeMethod(tpl, "end", End);
+
+    detector_constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
+  }
+
+private:
+  bool CanQueue() {
+    if (busy) {
+      Nan::ThrowError("A previous call has not completed yet");
+      return false;
+    }
+    if (ended) {
+      Nan::ThrowError("end() was already called");
+      return false;
+    }
+    return true;
+  }
+
+  // Data past bytes_max is not looked at, as with files
+  bool Append(Local<Object> buffer) {
+    size_t len = Buffer::Length(buffer);
+    if (len > bytes_max - data_len)
+      len = bytes_max - data_len;
+    if (len == 0)
+      return true;
+    if (data_len + len > data_size) {
+      size_t size = (data_size > 0 ? data_size : 4096);
+      while (size < data_len + len)
+        size *= 2;
+      if (size > bytes_max)
+        size = bytes_max;
+      char* p = static_cast<char*>(realloc(data, size));
+      if (p == nullptr)
+        return false;
+      data = p;
+      data_size = size;
+    }
+    memcpy(data + data_len, Buffer::Data(buffer), len);
+    data_len += len;
+    return true;
+  }
+
+  void Queue(Local<Function> cb, bool end) {
+    bool was_ended = ended;
+    callback.Reset(cb);
+    resource = new Nan::AsyncResource("mmmagic:Detector");
+    busy = true;
+    ending = end;
+    ended = end;
+    DetectTimingInit(&timing);
+    // Keeps the detector (and its data) alive while the work is queued
+    Ref();
+    int status = uv_queue_work(uv_default_loop(),
+                               &work,
+                               DetectWork,
+                               DetectAfter);
+    if (status != 0) {
+      Unref();
+      delete resource;
+      resource = nullptr;
+      callback.Reset();
+      busy = false;
+      ended = was_ended;
+      Nan::ThrowError(uv_strerror(status));
+    }
+  }
+
+  static void DetectWork(uv_work_t* req) {
+    Detector* obj = static_cast<Detector*>(req->data);
+    struct magic_set* magic;
+    const char* res;
+    int is_final = 0;
+
+    obj->skipped = !obj->final
+                   && !obj->ending
+                   && obj->data_len < bytes_max
+                   && obj->data_len < 2 * obj->evaluated_len;
+    if (obj->final || obj->skipped)
+      return;
+
+    obj->evaluated_len = obj->data_len;
+    DetectTimingDequeue(&obj->timing);
+    magic = obj->pipeline->AcquireMagic(&obj->error_message, &obj->timing);
+    if (magic == nullptr)
+      return;
+    ApplyBudget(magic, obj->budget);
+
+    if (obj->ending || obj->data_len >= bytes_max) {
+      res = magic_buffer(magic, obj->data, obj->data_len);
+      is_final = 1;
+    } else {
+      res = magic_partial(magic, obj->data, obj->data_len, &is_final);
+    }
+
+    if (res == nullptr) {
+      const char* error = magic_error(magic);
+      obj->error_message = strdup(error ? error : "Unknown error");
+    } else if (is_final) {
+      obj->result = strdup(res);
+      obj->final = true;
+    }
+    DetectTimingPhases(&obj->timing, magic);
+    obj->stats->profile.Collect(magic);
+
+    obj->pipeline->ReleaseMagic(magic);
+  }
+
+  static void DetectAfter(uv_work_t* req, int status) {
+    Nan::HandleScope scope;
+    Detector* obj = static_cast<Detector*>(req->data);
+    Local<Function> cb = Nan::New(obj->callback);
+    Local<Value> argv[2];
+    int argc = 2;
+
+    obj->busy = false;
+    obj->callback.Reset();
+    if (!obj->skipped)
+      obj->stats->Record(obj->timing, obj->final ? obj->result : nullptr);
+
+    if (obj->error_message) {
+      argv[0] = Nan::Error(obj->error_message);
+      argc = 1;
+      free(obj->error_message);
+      obj->error_message = nullptr;
+    } else {
+      argv[0] = Nan::Null();
+      if (obj->final)
+        argv[1] = ResultValue(obj->result, obj->flags);
+      else
+        argv[1] = Nan::Null();
+    }
+
+    if (obj->final && obj->data != nullptr) {
+      free(obj->data);
+      obj->data = nullptr;
+      obj->data_size = 0;
+    }
+
+    Nan::AsyncResource* resource = obj->resource;
+    obj->resource = nullptr;
+    resource->runInAsyncScope(obj->handle(), cb, argc, argv);
+    delete resource;
+    obj->Unref();
+  }
+
+  char* data;
+  size_t data_len;
+  size_t data_size;
+  // `data_len' when the data was last evaluated
+  size_t evaluated_len;
+
+  bool busy;
+  bool ending;
+  bool ended;
+  bool final;
+  // Whether the queued call left the data unevaluated
+  bool skipped;
+  char* result;
+  char* error_message;
+
+  // Only set while a call is queued
+  Nan::Persistent<Function> callback;
+  Nan::AsyncResource* resource;
+  uv_work_t work;
+  DetectTiming timing;
+};
 
 class Magic : public ObjectWrap {
 public:
@@ -71,6 +855,14 @@ public:
     size_t mgc_buffer_len;
     const char* msource;
     int mflags;
+    // Created on first use by any method but detect()
+    Pipeline* pipeline;
+    // Timings of the detections, see stats()
+    Stats stats;
+    // Bounds the detections in flight, see setLimits()
+    Limiter limiter;
+    // See setBudget()
+    Budget budget;
 
     Magic(const char* path, int flags) {
       if (path != nullptr) {
@@ -87,6 +879,8 @@ public:
         flags |= MAGIC_RAW;
 
       mflags = flags;
+      pipeline = nullptr;
+      budget.evaluations = budget.time_us = 0;
     }
 
     Magic(Local<Object> buffer, int flags) {
@@ -100,6 +894,8 @@ public:
         flags |= MAGIC_RAW;
 
       mflags = flags;
+      pipeline = nullptr;
+      budget.evaluations = budget.time_us = 0;
     }
 
     ~Magic() {
@@ -108,6 +904,20 @@ public:
       else if (msource != nullptr)
         free((void*)msource);
       msource = nullptr;
+      // The pipeline is not freed: instances are never collected (see the
+      // Ref() in New()) and its async handle belongs to the loop
+    }
+
+    Pipeline* GetPipeline() {
+      if (pipeline == nullptr) {
+        pipeline = new Pipeline(msource,
+                                mgc_buffer_len,
+                                mgc_buffer.IsEmpty(),
+                                mflags,
+                                &stats);
+        pipeline->budget = budget;
+      }
+      return pipeline;
     }
 
     static void New(const Nan::FunctionCallbackInfo<v8::Value>& args) {
@@ -175,121 +985,277 @@ public:
                                                     obj->mgc_buffer_len,
                                                     obj->mgc_buffer.IsEmpty(),
                                                     obj->mflags);
-      detect_req->data = strdup((const char*)*str);
-      detect_req->data_is_path = true;
+      FileJobInit(&detect_req->file);
+      detect_req->file.path = strdup((const char*)*str);
+      detect_req->file.complete = Magic::FileDone;
+      detect_req->file.data = detect_req;
+      detect_req->pipeline = obj->GetPipeline();
+      obj->Admit(detect_req, 0);
 
-      int status = uv_queue_work(uv_default_loop(),
-                                 &detect_req->request,
-                                 Magic::DetectWork,
-                                 (uv_after_work_cb)Magic::DetectAfter);
-      assert(status == 0);
+      args.GetReturnValue().Set(Nan::Undefined());
+    }
+
+    static void DetectFd(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+      Local<Object> handle_obj;
+      int64_t offset = 0;
+      int fd;
+      int cb_idx = 1;
+
+      if (args[0]->IsInt32()) {
+        fd = Nan::To<int32_t>(args[0]).FromJust();
+      } else if (args[0]->IsObject()) {
+        // fs.promises FileHandle
+        handle_obj = args[0].As<Object>();
+        Local<Value> fd_val =
+          Nan::Get(handle_obj,
+                   Nan::New<String>("fd").ToLocalChecked()).ToLocalChecked();
+        if (!fd_val->IsInt32())
+          return Nan::ThrowTypeError("First argument must be an open file");
+        fd = Nan::To<int32_t>(fd_val).FromJust();
+      } else {
+        return Nan::ThrowTypeError(
+          "First argument must be a file descriptor or FileHandle"
+        );
+      }
+      if (fd < 0)
+        return Nan::ThrowTypeError("First argument must be an open file");
+
+      if (args[1]->IsNumber()) {
+        double offset_val = Nan::To<double>(args[1]).FromJust();
+        if (offset_val < 0 || offset_val > 9007199254740991.0
+            || offset_val != static_cast<double>(
+                                static_cast<int64_t>(offset_val))) {
+          return Nan::ThrowRangeError(
+            "Second argument must be a non-negative integer offset"
+          );
+        }
+        offset = static_cast<int64_t>(offset_val);
+        cb_idx = 2;
+      }
+      if (!args[cb_idx]->IsFunction()) {
+        return Nan::ThrowTypeError(
+          cb_idx == 1 ? "Second argument must be a callback function"
+                      : "Third argument must be a callback function"
+        );
+      }
+
+      Local<Function> callback = Local<Function>::Cast(args[cb_idx]);
+
+      DetectRequest* detect_req = new DetectRequest(callback,
+                                                    obj->msource,
+                                                    obj->mgc_buffer_len,
+                                                    obj->mgc_buffer.IsEmpty(),
+                                                    obj->mflags);
+      detect_req->fd = fd;
+      detect_req->fd_offset = offset;
+      detect_req->data_is_fd = true;
+      detect_req->stats = &obj->stats;
+      detect_req->magic_pool = obj->GetPipeline();
+      if (!handle_obj.IsEmpty())
+        detect_req->data_buffer.Reset(handle_obj);
+      obj->Admit(detect_req, 0);
+
+      args.GetReturnValue().Set(Nan::Undefined());
+    }
+
+    static void DetectFiles(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+
+      if (!args[0]->IsArray())
+        return Nan::ThrowTypeError("First argument must be an array of paths");
+      if (!args[1]->IsFunction())
+        return Nan::ThrowTypeError("Second argument must be a callback function");
+
+      Local<Array> paths = args[0].As<Array>();
+      Local<Function> callback = Local<Function>::Cast(args[1]);
+      uint32_t count = paths->Length();
+
+      for (uint32_t i = 0; i < count; ++i) {
+        if (!Nan::Get(paths, i).ToLocalChecked()->IsString())
+          return Nan::ThrowTypeError("First argument must be an array of paths");
+      }
+
+      BatchRequest* batch_req = new BatchRequest(callback, obj->mflags, count);
+      for (uint32_t i = 0; i < count; ++i) {
+        Nan::Utf8String str(Nan::Get(paths, i).ToLocalChecked());
+        batch_req->jobs[i].path = strdup((const char*)*str);
+      }
+      batch_req->pipeline = obj->GetPipeline();
+      batch_req->limiter = &obj->limiter;
+      obj->limiter.Admit(&batch_req->admission);
 
       args.GetReturnValue().Set(Nan::Undefined());
     }
 
     static void Detect(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      QueueDetect(args, false);
+    }
+
+    // detect() that returns a handle to abort it with
+    static void DetectAbortable(
+        const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      QueueDetect(args, true);
+    }
+
+    static void QueueDetect(const Nan::FunctionCallbackInfo<v8::Value>& args,
+                            bool abortable) {
       Nan::HandleScope();
       Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
 
       if (args.Length() < 2)
         return Nan::ThrowTypeError("Expecting 2 arguments");
-      if (!Buffer::HasInstance(args[0]))
-        return Nan::ThrowTypeError("First argument must be a Buffer");
+      if (!Buffer::HasInstance(args[0]) && !args[0]->IsArray())
+        return Nan::ThrowTypeError(
+          "First argument must be a Buffer or an Array of Buffers"
+        );
       if (!args[1]->IsFunction())
         return Nan::ThrowTypeError("Second argument must be a callback function");
 
       Local<Function> callback = Local<Function>::Cast(args[1]);
       Local<Object> buffer_obj = args[0].As<Object>();
+      Local<Array> buffers;
+
+      if (args[0]->IsArray()) {
+        Local<Array> list = args[0].As<Array>();
+        buffers = Nan::New<Array>(list->Length());
+        for (uint32_t i = 0; i < list->Length(); ++i) {
+          Local<Value> buf = Nan::Get(list, i).ToLocalChecked();
+          if (!Buffer::HasInstance(buf))
+            return Nan::ThrowTypeError("Array must only contain Buffers");
+          Nan::Set(buffers, i, buf);
+        }
+        // A copy of the list, so that changes to it do not free Buffers
+        // still being read
+        buffer_obj = buffers;
+      }
 
       DetectRequest* detect_req = new DetectRequest(callback,
                                                     obj->msource,
                                                     obj->mgc_buffer_len,
                                                     obj->mgc_buffer.IsEmpty(),
                                                     obj->mflags);
-      detect_req->data = Buffer::Data(buffer_obj);
-      detect_req->data_len = Buffer::Length(buffer_obj);
+      size_t bytes = 0;
+      if (args[0]->IsArray()) {
+        for (uint32_t i = 0; i < buffers->Length(); ++i) {
+          Local<Object> buf =
+            Nan::Get(buffers, i).ToLocalChecked().As<Object>();
+          detect_req->bufs.push_back(Buffer::Data(buf));
+          detect_req->buf_lens.push_back(Buffer::Length(buf));
+          bytes += Buffer::Length(buf);
+        }
+      } else {
+        detect_req->data = Buffer::Data(buffer_obj);
+        detect_req->data_len = Buffer::Length(buffer_obj);
+        bytes = detect_req->data_len;
+      }
       detect_req->data_buffer.Reset(buffer_obj);
-      detect_req->data_is_path = false;
+      detect_req->stats = &obj->stats;
+
+      if (abortable) {
+        Local<Object> handle_obj =
+          Nan::NewInstance(Nan::New(detect_handle_constructor))
+            .ToLocalChecked();
+        DetectHandle* handle = ObjectWrap::Unwrap<DetectHandle>(handle_obj);
+        handle->detect_req = detect_req;
+        detect_req->handle = handle;
+        args.GetReturnValue().Set(handle_obj);
+      } else {
+        args.GetReturnValue().Set(args.This());
+      }
 
+      obj->Admit(detect_req, bytes);
+    }
+
+    void Admit(DetectRequest* detect_req, size_t bytes) {
+      detect_req->budget = budget;
+      detect_req->limiter = &limiter;
+      detect_req->admission.bytes = bytes;
+      detect_req->admission.start = StartDetect;
+      detect_req->admission.reject = RejectDetect;
+      detect_req->admission.data = detect_req;
+      limiter.Admit(&detect_req->admission);
+    }
+
+    static void StartDetect(Admission* admission) {
+      DetectRequest* detect_req =
+        static_cast<DetectRequest*>(admission->data);
+
+      if (detect_req->pipeline != nullptr) {
+        detect_req->pipeline->Push(&detect_req->file);
+        return;
+      }
       int status = uv_queue_work(uv_default_loop(),
                                  &detect_req->request,
                                  Magic::DetectWork,
                                  (uv_after_work_cb)Magic::DetectAfter);
-      assert(status == 0);
+      if (status != 0) {
+        detect_req->error_message = strdup(uv_strerror(status));
+        DetectAfter(&detect_req->request);
+        return;
+      }
+      detect_req->queued = true;
+    }
 
-      return args.GetReturnValue().Set(args.This());
+    static void RejectDetect(Admission* admission) {
+      DetectRequest* detect_req =
+        static_cast<DetectRequest*>(admission->data);
+
+      detect_req->limiter = nullptr;
+      detect_req->stats = nullptr;
+      if (!detect_req->canceled) {
+        detect_req->error_message = strdup(kOverloaded);
+        detect_req->error_code = "EBUSY";
+      }
+      DetectAfter(&detect_req->request);
     }
 
     static void DetectWork(uv_work_t* req) {
       DetectRequest* detect_req = static_cast<DetectRequest*>(req->data);
       const char* result;
-      struct magic_set* magic = magic_open(detect_req->flags
-                                           | MAGIC_NO_CHECK_COMPRESS
-                                           | MAGIC_ERROR);
-
-      if (magic == nullptr) {
-#if NODE_MODULE_VERSION <= 0x000B
-        detect_req->error_message =
-          strdup(uv_strerror(uv_last_error(uv_default_loop())));
-#else
-// XXX libuv 1.x currently has no public cross-platform function to convert an
-//     OS-specific error number to a libuv error number. `-errno` should work
-//     for *nix, but just passing GetLastError() on Windows will not work ...
-# ifdef _MSC_VER
-        detect_req->error_message = strdup(uv_strerror(GetLastError()));
-# else
-        detect_req->error_message = strdup(uv_strerror(-errno));
-# endif
-#endif
-      } else if (detect_req->source_is_path) {
-        if (magic_load(magic, detect_req->magic_source) == -1
-            && magic_load(magic, fallbackPath) == -1) {
-          detect_req->error_message = strdup(magic_error(magic));
-          magic_close(magic);
-          magic = nullptr;
-        }
-      } else if (magic_load_buffers(magic,
-                                    (void**)&detect_req->magic_source,
-                                    &detect_req->source_len,
-                                    1) == -1) {
-        detect_req->error_message = strdup(magic_error(magic));
-        magic_close(magic);
-        magic = nullptr;
-      }
 
-      if (magic == nullptr)
-        return;
+      struct magic_set* magic;
 
-      if (detect_req->data_is_path) {
-#ifdef _WIN32
-        // open the file manually to help cope with potential unicode characters
-        // in filename
-        const char* ofn = detect_req->data;
-        int flags = O_RDONLY | O_BINARY;
-        int fd = -1;
-        int wLen;
-        wLen = MultiByteToWideChar(CP_UTF8, 0, ofn, -1, nullptr, 0);
-        if (wLen > 0) {
-          wchar_t* wfn = (wchar_t*)malloc(wLen * sizeof(wchar_t));
-          if (wfn) {
-            int wret = MultiByteToWideChar(CP_UTF8, 0, ofn, -1, wfn, wLen);
-            if (wret != 0)
-              _wsopen_s(&fd, wfn, flags, _SH_DENYNO, _S_IREAD);
-            free(wfn);
-            wfn = nullptr;
-          }
-        }
-        if (fd == -1) {
-          detect_req->free_error = false;
-          detect_req->error_message = "Error while opening file";
-          magic_close(magic);
+      DetectTimingDequeue(&detect_req->timing);
+      if (detect_req->magic_pool != nullptr) {
+        // Keeps the handle's read buffer across calls as well
+        magic = detect_req->magic_pool->AcquireMagic(
+          &detect_req->error_message, &detect_req->timing
+        );
+        if (magic == nullptr)
           return;
-        }
-        result = magic_descriptor(magic, fd);
-        _close(fd);
-#else
-        result = magic_file(magic, detect_req->data);
-#endif
+      } else {
+        magic = OpenMagic(detect_req->magic_source,
+                          detect_req->source_len,
+                          detect_req->source_is_path,
+                          detect_req->flags,
+                          &detect_req->error_message);
+        detect_req->timing.load = uv_hrtime() - detect_req->timing.mark;
+        detect_req->timing.loaded = true;
+
+        if (magic == nullptr)
+          return;
+
+        DetectTimingLoad(&detect_req->timing, magic);
+      }
+
+      magic_setcancel(magic,
+                      reinterpret_cast<const int*>(&detect_req->canceled));
+      ApplyBudget(magic, detect_req->budget);
+      if (detect_req->data_is_fd) {
+        // pread() at an explicit offset leaves the caller's file position
+        // untouched and skips the path lookups done by magic_file()
+        result = magic_descriptor_at(magic,
+                                     detect_req->fd,
+                                     (off_t)detect_req->fd_offset);
+      } else if (!detect_req->bufs.empty()) {
+        // Magic reads the Buffers in place instead of a concatenated copy
+        result = magic_buffers(magic,
+                               detect_req->bufs.data(),
+                               detect_req->buf_lens.data(),
+                               detect_req->bufs.size());
       } else {
         result = magic_buffer(magic,
                               (const void*)detect_req->data,
@@ -303,8 +1269,29 @@ public:
       } else {
         detect_req->result = strdup(result);
       }
+      DetectTimingPhases(&detect_req->timing, magic);
+      if (detect_req->stats != nullptr)
+        detect_req->stats->profile.Collect(magic);
+
+      if (detect_req->magic_pool != nullptr) {
+        // The request, and the flag with it, is gone once it completes
+        magic_setcancel(magic, nullptr);
+        detect_req->magic_pool->ReleaseMagic(magic);
+      } else {
+        magic_close(magic);
+      }
+    }
 
-      magic_close(magic);
+    static void FileDone(FileJob* job) {
+      DetectRequest* detect_req = static_cast<DetectRequest*>(job->data);
+
+      detect_req->result = job->result;
+      detect_req->error_message = job->error_message;
+      detect_req->timing.truncated = job->timing.truncated;
+      job->result = job->error_message = nullptr;
+      FileJobFree(job);
+
+      DetectAfter(&detect_req->request);
     }
 
     static void DetectAfter(uv_work_t* req) {
@@ -313,61 +1300,333 @@ public:
       Local<Function> callback = Nan::New(detect_req->callback);
       Local<Object> target = Nan::New<Object>();
 
+      if (detect_req->handle != nullptr)
+        detect_req->handle->detect_req = nullptr;
+      if (detect_req->canceled) {
+        // Whatever got done is dropped, and left out of the stats
+        free(detect_req->error_message);
+        free((void*)detect_req->result);
+        detect_req->error_message = strdup(kAborted);
+        detect_req->error_code = "ABORT_ERR";
+        detect_req->result = nullptr;
+        detect_req->stats = nullptr;
+      }
+
+      if (detect_req->stats != nullptr)
+        detect_req->stats->Record(detect_req->timing, detect_req->result);
+      if (detect_req->limiter != nullptr)
+        detect_req->limiter->Done(&detect_req->admission);
+
       if (detect_req->error_message) {
-        Local<Value> err = Nan::Error(detect_req->error_message);
+        Local<Value> err = ErrorValue(detect_req->error_message,
+                                      detect_req->error_code);
         Local<Value> argv[1] = { err };
         detect_req->runInAsyncScope(target, callback, 1, argv);
       } else {
-        Local<Value> argv[2];
-        int multi_result_flags =
-          (detect_req->flags & (MAGIC_CONTINUE | MAGIC_RAW));
-
+        Local<Value> argv[3];
         argv[0] = Nan::Null();
+        argv[1] = ResultValue(detect_req->result, detect_req->flags);
+        argv[2] = Nan::New<Boolean>(detect_req->timing.truncated);
+        detect_req->runInAsyncScope(target, callback, 3, argv);
+      }
+
+      delete detect_req;
+    }
 
-        if (multi_result_flags == (MAGIC_CONTINUE | MAGIC_RAW)) {
-          Local<Array> results = Nan::New<Array>();
-          if (detect_req->result) {
-            uint32_t i = 0;
-            const char* result_end =
-              detect_req->result + strlen(detect_req->result);
-            const char* last_match = detect_req->result;
-            const char* cur_match;
-            while (true) {
-              if (!(cur_match = strstr(last_match, "\n- "))) {
-                // Append remainder string
-                if (last_match < result_end) {
-                  Nan::Set(Local<Object>::Cast(results),
-                           i,
-                           Nan::New<String>(last_match).ToLocalChecked());
-                }
-                break;
-              }
-
-              size_t match_len = (cur_match - last_match);
-              char* match = new char[match_len + 1];
-              strncpy(match, last_match, match_len);
-              match[match_len] = '\0';
-
-              Nan::Set(Local<Object>::Cast(results),
-                       i++,
-                       Nan::New<String>(match).ToLocalChecked());
-
-              delete[] match;
-              last_match = cur_match + 3;
-            }
+    // Returns a TreeWalk handle; see detectTree() in lib/index.js
+    static void WalkTree(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+      Walker::Options options;
+      size_t batch_size = 256;
+
+      options.max_depth = -1;
+
+      if (!args[0]->IsString())
+        return Nan::ThrowTypeError("First argument must be a string");
+      if (!args[1]->IsObject())
+        return Nan::ThrowTypeError("Second argument must be an object");
+
+      Local<Object> opts = args[1].As<Object>();
+      Local<Value> val;
+
+      val = Nan::Get(opts,
+                     Nan::New<String>("maxDepth").ToLocalChecked())
+              .ToLocalChecked();
+      if (!val->IsUndefined()) {
+        double depth = (val->IsNumber() ? Nan::To<double>(val).FromJust() : -1);
+        if (!(depth >= 0))
+          return Nan::ThrowRangeError("maxDepth must be a non-negative number");
+        if (depth < 2147483647.0)
+          options.max_depth = static_cast<int>(depth);
+      }
+
+      val = Nan::Get(opts,
+                     Nan::New<String>("batchSize").ToLocalChecked())
+              .ToLocalChecked();
+      if (!val->IsUndefined()) {
+        if (!val->IsUint32() || Nan::To<uint32_t>(val).FromJust() == 0)
+          return Nan::ThrowRangeError("batchSize must be a positive integer");
+        batch_size = Nan::To<uint32_t>(val).FromJust();
+      }
+
+      static const char* const filter_keys[] = { "include", "exclude" };
+      std::vector<std::string>* filters[] = {
+        &options.include, &options.exclude
+      };
+      for (int i = 0; i < 2; ++i) {
+        val = Nan::Get(opts,
+                       Nan::New<String>(filter_keys[i]).ToLocalChecked())
+                .ToLocalChecked();
+        if (val->IsUndefined())
+          continue;
+        if (val->IsString()) {
+          Nan::Utf8String str(val);
+          filters[i]->push_back(*str);
+          continue;
+        }
+        if (!val->IsArray()) {
+          return Nan::ThrowTypeError(
+            "include and exclude must be strings or arrays of strings"
+          );
+        }
+        Local<Array> patterns = val.As<Array>();
+        for (uint32_t j = 0; j < patterns->Length(); ++j) {
+          Local<Value> pattern = Nan::Get(patterns, j).ToLocalChecked();
+          if (!pattern->IsString()) {
+            return Nan::ThrowTypeError(
+              "include and exclude must be strings or arrays of strings"
+            );
           }
-          argv[1] = Local<Value>(results);
-        } else if (detect_req->result) {
-          argv[1] =
-            Local<Value>(Nan::New<String>(detect_req->result).ToLocalChecked());
-        } else  {
-          argv[1] = Local<Value>(Nan::New<String>().ToLocalChecked());
+          Nan::Utf8String str(pattern);
+          filters[i]->push_back(*str);
         }
+      }
+
+      // Enough files in flight to keep detecting while JS handles a batch
+      options.high_water = batch_size * 4;
+
+      Local<Object> handle =
+        Nan::NewInstance(Nan::New(tree_constructor)).ToLocalChecked();
+      TreeWalkHandle* walk = ObjectWrap::Unwrap<TreeWalkHandle>(handle);
+      Nan::Utf8String root(args[0]);
+
+      walk->tree = new TreeWalk(obj->GetPipeline(), obj->mflags, batch_size);
+      walk->tree->Start(*root, options);
+
+      args.GetReturnValue().Set(handle);
+    }
+
+    static void CreateDetector(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+
+      Local<Object> handle =
+        Nan::NewInstance(Nan::New(detector_constructor)).ToLocalChecked();
+      Detector* detector = ObjectWrap::Unwrap<Detector>(handle);
+      detector->pipeline = obj->GetPipeline();
+      detector->stats = &obj->stats;
+      detector->flags = obj->mflags;
+      detector->budget = obj->budget;
 
-        detect_req->runInAsyncScope(target, callback, 2, argv);
+      args.GetReturnValue().Set(handle);
+    }
+
+    static void SetConcurrency(
+      const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+      static const char* const keys[] = { "io", "queue", "cpu" };
+      unsigned limits[3];
+
+      if (!args[0]->IsObject())
+        return Nan::ThrowTypeError("First argument must be an object");
+
+      Local<Object> options = args[0].As<Object>();
+      Pipeline* pipeline = obj->GetPipeline();
+      limits[0] = pipeline->io_concurrency;
+      limits[1] = pipeline->read_queue;
+      limits[2] = pipeline->cpu_concurrency;
+
+      for (int i = 0; i < 3; ++i) {
+        Local<Value> val =
+          Nan::Get(options,
+                   Nan::New<String>(keys[i]).ToLocalChecked()).ToLocalChecked();
+        if (val->IsUndefined())
+          continue;
+        if (!val->IsUint32() || Nan::To<uint32_t>(val).FromJust() == 0) {
+          return Nan::ThrowRangeError(
+            "Concurrency limits must be positive integers"
+          );
+        }
+        limits[i] = Nan::To<uint32_t>(val).FromJust();
       }
 
-      delete detect_req;
+      pipeline->SetLimits(limits[0], limits[1], limits[2]);
+
+      return args.GetReturnValue().Set(args.This());
+    }
+
+    static void GetStats(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+
+      Local<Object> stats = obj->stats.ToObject();
+      Limiter* limiter = &obj->limiter;
+
+      Nan::Set(stats, Nan::New<String>("inFlight").ToLocalChecked(),
+               Nan::New<Number>((double)limiter->in_flight));
+      Nan::Set(stats, Nan::New<String>("waiting").ToLocalChecked(),
+               Nan::New<Number>((double)limiter->waiting()));
+      Nan::Set(stats, Nan::New<String>("pinnedBytes").ToLocalChecked(),
+               Nan::New<Number>((double)limiter->bytes));
+      Nan::Set(stats, Nan::New<String>("rejected").ToLocalChecked(),
+               Nan::New<Number>((double)limiter->rejected));
+      Nan::Set(stats, Nan::New<String>("admission").ToLocalChecked(),
+               limiter->wait.ToObject());
+
+      Local<Object> stages = Nan::New<Object>();
+      Pipeline* pipeline = obj->pipeline;
+      double depths[4] = { 0, 0, 0, 0 };
+      static const char* const stage_keys[] = {
+        "waiting", "reading", "ready", "detecting"
+      };
+      if (pipeline != nullptr) {
+        depths[0] = (double)pipeline->waiting_count();
+        depths[1] = (double)pipeline->reading_count();
+        depths[2] = (double)pipeline->ready_count();
+        depths[3] = (double)pipeline->detecting_count();
+      }
+      for (int i = 0; i < 4; ++i) {
+        Nan::Set(stages, Nan::New<String>(stage_keys[i]).ToLocalChecked(),
+                 Nan::New<Number>(depths[i]));
+      }
+      Nan::Set(stats, Nan::New<String>("files").ToLocalChecked(), stages);
+      Nan::Set(stats, Nan::New<String>("handles").ToLocalChecked(),
+               Nan::New<Number>(pipeline != nullptr
+                                ? (double)pipeline->handle_count()
+                                : 0));
+
+      args.GetReturnValue().Set(stats);
+    }
+
+    static void SetBudget(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+      Budget budget = obj->budget;
+
+      if (!args[0]->IsObject())
+        return Nan::ThrowTypeError("First argument must be an object");
+
+      Local<Object> options = args[0].As<Object>();
+      Local<Value> val;
+      double num;
+
+      val = Nan::Get(options,
+                     Nan::New<String>("evaluations").ToLocalChecked())
+              .ToLocalChecked();
+      if (!val->IsUndefined()) {
+        num = (val->IsNumber() ? Nan::To<double>(val).FromJust() : 0);
+        if (num == std::numeric_limits<double>::infinity()) {
+          budget.evaluations = 0;
+        } else if (num >= 1 && num <= 9007199254740991.0
+                   && num == (double)(int64_t)num) {
+          budget.evaluations = (size_t)num;
+        } else {
+          return Nan::ThrowRangeError(
+            "evaluations must be a positive integer or Infinity"
+          );
+        }
+      }
+
+      val = Nan::Get(options,
+                     Nan::New<String>("time").ToLocalChecked())
+              .ToLocalChecked();
+      if (!val->IsUndefined()) {
+        num = (val->IsNumber() ? Nan::To<double>(val).FromJust() : 0);
+        if (num == std::numeric_limits<double>::infinity()) {
+          budget.time_us = 0;
+        } else if (num > 0 && num <= 9007199254.0) {
+          // In ms, rounded up to us
+          budget.time_us = (size_t)ceil(num * 1000);
+        } else {
+          return Nan::ThrowRangeError(
+            "time must be a positive number or Infinity"
+          );
+        }
+      }
+
+      obj->budget = budget;
+      if (obj->pipeline != nullptr)
+        obj->pipeline->budget = budget;
+
+      return args.GetReturnValue().Set(args.This());
+    }
+
+    static void SetLimits(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+      static const char* const keys[] = {
+        "maxRequests", "maxBytes", "maxWaiting"
+      };
+      size_t* limits[] = {
+        &obj->limiter.max_requests,
+        &obj->limiter.max_bytes,
+        &obj->limiter.max_waiting
+      };
+      size_t values[3];
+      Limiter::Policy policy = obj->limiter.policy;
+
+      if (!args[0]->IsObject())
+        return Nan::ThrowTypeError("First argument must be an object");
+
+      Local<Object> options = args[0].As<Object>();
+
+      for (int i = 0; i < 3; ++i) {
+        values[i] = *limits[i];
+        Local<Value> val =
+          Nan::Get(options,
+                   Nan::New<String>(keys[i]).ToLocalChecked()).ToLocalChecked();
+        if (val->IsUndefined())
+          continue;
+        double num = (val->IsNumber() ? Nan::To<double>(val).FromJust() : 0);
+        if (num == std::numeric_limits<double>::infinity()) {
+          values[i] = 0;
+          continue;
+        }
+        if (!(num >= 1) || num > 9007199254740991.0 || num != (double)(int64_t)num) {
+          return Nan::ThrowRangeError(
+            "Limits must be positive integers or Infinity"
+          );
+        }
+        values[i] = (size_t)num;
+      }
+
+      Local<Value> val =
+        Nan::Get(options,
+                 Nan::New<String>("policy").ToLocalChecked()).ToLocalChecked();
+      if (!val->IsUndefined()) {
+        Nan::Utf8String str(val);
+        if (val->IsString() && strcmp(*str, "wait") == 0)
+          policy = Limiter::kWait;
+        else if (val->IsString() && strcmp(*str, "reject") == 0)
+          policy = Limiter::kReject;
+        else
+          return Nan::ThrowTypeError("policy must be 'wait' or 'reject'");
+      }
+
+      for (int i = 0; i < 3; ++i)
+        *limits[i] = values[i];
+      obj->limiter.policy = policy;
+
+      return args.GetReturnValue().Set(args.This());
+    }
+
+    static void GetProfile(const Nan::FunctionCallbackInfo<v8::Value>& args) {
+      Nan::HandleScope();
+      Magic* obj = ObjectWrap::Unwrap<Magic>(args.This());
+
+      args.GetReturnValue().Set(obj->stats.profile.ToArray());
     }
 
     static void SetFallback(const Nan::FunctionCallbackInfo<v8::Value>& args) {
@@ -391,7 +1650,17 @@ public:
       tpl->InstanceTemplate()->SetInternalFieldCount(1);
       tpl->SetClassName(Nan::New<String>("Magic").ToLocalChecked());
       Nan::SetPrototypeMethod(tpl, "detectFile", DetectFile);
+      Nan::SetPrototypeMethod(tpl, "detectFd", DetectFd);
+      Nan::SetPrototypeMethod(tpl, "detectFiles", DetectFiles);
       Nan::SetPrototypeMethod(tpl, "detect", Detect);
+      Nan::SetPrototypeMethod(tpl, "_detectAbortable", DetectAbortable);
+      Nan::SetPrototypeMethod(tpl, "setConcurrency", SetConcurrency);
+      Nan::SetPrototypeMethod(tpl, "setLimits", SetLimits);
+      Nan::SetPrototypeMethod(tpl, "setBudget", SetBudget);
+      Nan::SetPrototypeMethod(tpl, "_walkTree", WalkTree);
+      Nan::SetPrototypeMethod(tpl, "createDetector", CreateDetector);
+      Nan::SetPrototypeMethod(tpl, "stats", GetStats);
+      Nan::SetPrototypeMethod(tpl, "profile", GetProfile);
 
       constructor.Reset(Nan::GetFunction(tpl).ToLocalChecked());
       Nan::Set(target,
@@ -403,6 +1672,18 @@ public:
       Nan::Set(target,
                Nan::New<String>("Magic").ToLocalChecked(),
                Nan::GetFunction(tpl).ToLocalChecked()).FromJust();
+
+      struct magic_set* magic = magic_open(MAGIC_NONE);
+      if (magic != nullptr) {
+        magic_getparam(magic, MAGIC_PARAM_BYTES_MAX, &bytes_max);
+        magic_close(magic);
+      }
+      Nan::Set(target,
+               Nan::New<String>("bytesMax").ToLocalChecked(),
+               Nan::New<Number>((double)bytes_max)).FromJust();
+      Nan::Set(target,
+               Nan::New<String>("simd").ToLocalChecked(),
+               Nan::New<String>(magic_simd()).ToLocalChecked()).FromJust();
     }
 };
 
@@ -410,6 +1691,9 @@ extern "C" {
   void init(Local<Object> target) {
     Nan::HandleScope();
     Magic::Initialize(target);
+    TreeWalkHandle::Initialize();
+    DetectHandle::Initialize();
+    Detector::Initialize();
   }
 
   NODE_MODULE(magic, init);
@@ -0,0 +1,100 @@
+#include <algorithm>
+
+#include "limiter.h"
+
+Limiter::Limiter()
+  : max_requests(0),
+    max_bytes(0),
+    max_waiting(0),
+    policy(kWait),
+    in_flight(0),
+    bytes(0),
+    rejected(0),
+    async(nullptr) {
+}
+
+bool Limiter::Fits(const Admission* admission) const {
+  if (in_flight == 0)
+    return true;
+  if (max_requests != 0 && in_flight >= max_requests)
+    return false;
+  // `bytes' may be past `max_bytes', after an oversized call or a lower
+  // limit.  Calls that pin no bytes (detectFd(), detectFile()) are left out.
+  if (max_bytes != 0 && admission->bytes != 0
+      && (bytes >= max_bytes || admission->bytes > max_bytes - bytes))
+    return false;
+  return true;
+}
+
+void Limiter::Admit(Admission* admission) {
+  admission->queued_at = uv_hrtime();
+
+  // Detections that waited go first
+  if (queue.empty() && Fits(admission)) {
+    Start(admission);
+  } else if (policy == kReject
+             || (max_waiting != 0 && queue.size() >= max_waiting)) {
+    Reject(admission);
+  } else {
+    queue.push_back(admission);
+  }
+}
+
+void Limiter::Done(Admission* admission) {
+  --in_flight;
+  bytes -= admission->bytes;
+
+  while (!queue.empty() && Fits(queue.front())) {
+    Admission* next = queue.front();
+    queue.pop_front();
+    Start(next);
+  }
+}
+
+bool Limiter::Cancel(Admission* admission) {
+  std::deque<Admission*>::iterator it =
+    std::find(queue.begin(), queue.end(), admission);
+
+  if (it == queue.end())
+    return false;
+  queue.erase(it);
+  Report(admission);
+  return true;
+}
+
+void Limiter::Start(Admission* admission) {
+  ++in_flight;
+  bytes += admission->bytes;
+  wait.Add(uv_hrtime() - admission->queued_at);
+  admission->start(admission);
+}
+
+void Limiter::Reject(Admission* admission) {
+  ++rejected;
+  Report(admission);
+}
+
+// Rejections are reported from a callback of their own, as callers are not
+// expecting to be called back from within the call that asked
+void Limiter::Report(Admission* admission) {
+  if (async == nullptr) {
+    async = new uv_async_t;
+    async->data = this;
+    uv_async_init(uv_default_loop(), async, OnReject);
+  }
+  if (rejects.empty()) {
+    uv_ref(reinterpret_cast<uv_handle_t*>(async));
+    uv_async_send(async);
+  }
+  rejects.push_back(admission);
+}
+
+void Limiter::OnReject(uv_async_t* handle) {
+  Limiter* limiter = static_cast<Limiter*>(handle->data);
+  std::vector<Admission*> list;
+
+  list.swap(limiter->rejects);
+  uv_unref(reinterpret_cast<uv_handle_t*>(handle));
+  for (size_t i = 0; i < list.size(); ++i)
+    list[i]->reject(list[i]);
+}
@@ -0,0 +1,79 @@
+#ifndef MMMAGIC_LIMITER_H
+#define MMMAGIC_LIMITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+#include <uv.h>
+
+#include "stats.h"
+
+// A detection waiting to be started by a Limiter
+struct Admission {
+  // Bytes of input the detection keeps alive until it is finished
+  size_t bytes;
+
+  // Called on the loop thread when the detection may start, which can be
+  // from within Admit()
+  void (*start)(Admission*);
+  // Called on the loop thread, never from within Admit(), when the
+  // detection is turned away
+  void (*reject)(Admission*);
+  void* data;
+
+  // Private to the limiter
+  uint64_t queued_at;
+};
+
+// Bounds the detections of a Magic instance that are started but not yet
+// finished, by their number and by the bytes of input they hold.  Past the
+// limits new detections either wait for others to finish or are rejected,
+// depending on the policy.  A detection is always started when nothing else
+// is in flight, so that one larger than the byte limit does not wait forever.
+//
+// All methods must be called on the loop thread.
+class Limiter {
+public:
+  enum Policy { kWait, kReject };
+
+  Limiter();
+
+  void Admit(Admission* admission);
+  // Must be called once a started detection is finished
+  void Done(Admission* admission);
+  // Takes a detection out of the queue, if it is still waiting, and turns
+  // it away (without counting it as rejected)
+  bool Cancel(Admission* admission);
+
+  // Limits, 0 for none
+  size_t max_requests;
+  size_t max_bytes;
+  // Detections waiting to start; past this they are rejected
+  size_t max_waiting;
+  Policy policy;
+
+  // Gauges
+  size_t in_flight;
+  size_t bytes;
+  uint64_t rejected;
+  size_t waiting() const { return queue.size(); }
+  // How long the started detections waited
+  Histogram wait;
+
+private:
+  bool Fits(const Admission* admission) const;
+  void Start(Admission* admission);
+  void Reject(Admission* admission);
+  void Report(Admission* admission);
+
+  static void OnReject(uv_async_t* handle);
+
+  std::deque<Admission*> queue;
+  std::vector<Admission*> rejects;
+  uv_async_t* async;
+};
+
+#endif
@@ -0,0 +1,332 @@
+#include <node_version.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+# include <io.h>
+# include <fcntl.h>
+# include <wchar.h>
+#endif
+
+#include "magic.h"
+#include "pipeline.h"
+
+struct magic_set* OpenMagic(const char* magic_source,
+                            size_t source_len,
+                            bool source_is_path,
+                            int flags,
+                            char** error_message) {
+  struct magic_set* magic = magic_open(flags
+                                       | MAGIC_NO_CHECK_COMPRESS
+                                       | MAGIC_ERROR);
+
+  if (magic == nullptr) {
+#if NODE_MODULE_VERSION <= 0x000B
+    *error_message = strdup(uv_strerror(uv_last_error(uv_default_loop())));
+#else
+// XXX libuv 1.x currently has no public cross-platform function to convert an
+//     OS-specific error number to a libuv error number. `-errno` should work
+//     for *nix, but just passing GetLastError() on Windows will not work ...
+# ifdef _MSC_VER
+    *error_message = strdup(uv_strerror(GetLastError()));
+# else
+    *error_message = strdup(uv_strerror(-errno));
+# endif
+#endif
+  } else if (source_is_path) {
+    if (magic_load(magic, magic_source) == -1
+        && magic_load(magic, fallbackPath) == -1) {
+      *error_message = strdup(magic_error(magic));
+      magic_close(magic);
+      magic = nullptr;
+    }
+  } else if (magic_load_buffers(magic,
+                                (void**)&magic_source,
+                                &source_len,
+                                1) == -1) {
+    *error_message = strdup(magic_error(magic));
+    magic_close(magic);
+    magic = nullptr;
+  }
+
+  return magic;
+}
+
+void ApplyBudget(struct magic_set* magic, const Budget& budget) {
+  magic_setparam(magic, MAGIC_PARAM_EVAL_MAX, &budget.evaluations);
+  magic_setparam(magic, MAGIC_PARAM_TIME_MAX, &budget.time_us);
+}
+
+// Sets `open_failed' instead of returning an error from libmagic when the
+// file cannot be opened on Windows
+static const char* DetectPath(struct magic_set* magic,
+                              const char* path,
+                              bool* open_failed) {
+  *open_failed = false;
+#ifdef _WIN32
+  // open the file manually to help cope with potential unicode characters
+  // in filename
+  const char* result;
+  int flags = O_RDONLY | O_BINARY;
+  int fd = -1;
+  int wLen;
+  wLen = MultiByteToWideChar(CP_UTF8, 0, path, -1, nullptr, 0);
+  if (wLen > 0) {
+    wchar_t* wfn = (wchar_t*)malloc(wLen * sizeof(wchar_t));
+    if (wfn) {
+      int wret = MultiByteToWideChar(CP_UTF8, 0, path, -1, wfn, wLen);
+      if (wret != 0)
+        _wsopen_s(&fd, wfn, flags, _SH_DENYNO, _S_IREAD);
+      free(wfn);
+      wfn = nullptr;
+    }
+  }
+  if (fd == -1) {
+    *open_failed = true;
+    return nullptr;
+  }
+  result = magic_descriptor(magic, fd);
+  _close(fd);
+  return result;
+#else
+  return magic_file(magic, path);
+#endif
+}
+
+void FileJobInit(FileJob* job) {
+  job->path = nullptr;
+  job->result = nullptr;
+  job->error_message = nullptr;
+  job->complete = nullptr;
+  job->data = nullptr;
+  job->pipeline = nullptr;
+  ReadJobInit(&job->read);
+}
+
+void FileJobFree(FileJob* job) {
+  free(job->path);
+  free(job->result);
+  free(job->error_message);
+  job->path = job->result = job->error_message = nullptr;
+}
+
+static unsigned ThreadpoolSize() {
+  const char* val = getenv("UV_THREADPOOL_SIZE");
+  int size = (val != nullptr ? atoi(val) : 0);
+  return (size > 0 ? (unsigned)size : 4);
+}
+
+Pipeline::Pipeline(const char* magic_source_, size_t source_len_,
+                   bool source_is_path_, int flags_, Stats* stats_)
+  : io_concurrency(kIoConcurrency),
+    read_queue(kReadQueue),
+    cpu_concurrency(ThreadpoolSize()),
+    magic_source(magic_source_),
+    source_len(source_len_),
+    source_is_path(source_is_path_),
+    flags(flags_),
+    bytes_max(0),
+    tail_max(0),
+    stats(stats_),
+    reading(0),
+    detecting(0),
+    handles(0) {
+  budget.evaluations = budget.time_us = 0;
+  uv_mutex_init(&lock);
+  async.data = this;
+  uv_async_init(uv_default_loop(), &async, OnReadDone);
+  // Only holds the loop open while files are being read
+  uv_unref(reinterpret_cast<uv_handle_t*>(&async));
+
+  // Read as much of each file as libmagic would
+  struct magic_set* magic = magic_open(MAGIC_NONE);
+  if (magic != nullptr) {
+    magic_getparam(magic, MAGIC_PARAM_BYTES_MAX, &bytes_max);
+    magic_getparam(magic, MAGIC_PARAM_TAIL_MAX, &tail_max);
+    magic_close(magic);
+  }
+}
+
+void Pipeline::Push(FileJob* job) {
+  job->pipeline = this;
+  ReadJobInit(&job->read);
+  job->read.path = job->path;
+  job->read.flags = flags;
+  job->read.bytes_max = bytes_max;
+  job->read.tail_max = tail_max;
+  job->read.done = ReadDone;
+  job->read.data = job;
+  job->work.data = job;
+  DetectTimingInit(&job->timing);
+  job->budget = budget;
+  waiting.push_back(job);
+  Pump();
+}
+
+void Pipeline::SetLimits(unsigned io, unsigned queue, unsigned cpu) {
+  io_concurrency = io;
+  read_queue = queue;
+  cpu_concurrency = cpu;
+  Pump();
+}
+
+void Pipeline::Pump() {
+  while (detecting < cpu_concurrency && !ready.empty()) {
+    FileJob* job = ready.front();
+    ready.pop_front();
+    ++detecting;
+    int status = uv_queue_work(uv_default_loop(),
+                               &job->work,
+                               DetectWork,
+                               DetectAfter);
+    if (status != 0) {
+      --detecting;
+      ReadJobRelease(&job->read);
+      job->error_message = strdup(uv_strerror(status));
+      job->complete(job);
+    }
+  }
+
+  // Files being read count against the queue too, so that their buffers
+  // always have room in it
+  while (reading < io_concurrency
+         && reading + ready.size() < read_queue
+         && !waiting.empty()) {
+    FileJob* job = waiting.front();
+    waiting.pop_front();
+    if (reading++ == 0)
+      uv_ref(reinterpret_cast<uv_handle_t*>(&async));
+    DetectTimingDequeue(&job->timing);
+    Reader::Get()->Submit(&job->read);
+  }
+}
+
+// Runs on an I/O thread
+void Pipeline::ReadDone(ReadJob* read) {
+  FileJob* job = static_cast<FileJob*>(read->data);
+  Pipeline* pipeline = job->pipeline;
+  uint64_t now = uv_hrtime();
+  job->timing.read = now - job->timing.mark;
+  job->timing.mark = now;
+  job->timing.read_done = true;
+  uv_mutex_lock(&pipeline->lock);
+  pipeline->read_done.push_back(job);
+  uv_mutex_unlock(&pipeline->lock);
+  uv_async_send(&pipeline->async);
+}
+
+void Pipeline::OnReadDone(uv_async_t* handle) {
+  Pipeline* pipeline = static_cast<Pipeline*>(handle->data);
+  std::vector<FileJob*> jobs;
+
+  uv_mutex_lock(&pipeline->lock);
+  jobs.swap(pipeline->read_done);
+  uv_mutex_unlock(&pipeline->lock);
+
+  for (size_t i = 0; i < jobs.size(); ++i)
+    pipeline->ready.push_back(jobs[i]);
+  pipeline->reading -= (unsigned)jobs.size();
+  if (pipeline->reading == 0)
+    uv_unref(reinterpret_cast<uv_handle_t*>(&pipeline->async));
+
+  pipeline->Pump();
+}
+
+// Handles are loaded on first use and shared by later detections
+struct magic_set* Pipeline::AcquireMagic(char** error_message,
+                                         DetectTiming* timing) {
+  struct magic_set* magic = nullptr;
+  uv_mutex_lock(&lock);
+  if (!free_magic.empty()) {
+    magic = free_magic.back();
+    free_magic.pop_back();
+  }
+  uv_mutex_unlock(&lock);
+  if (magic == nullptr) {
+    uint64_t start = uv_hrtime();
+    magic = OpenMagic(magic_source, source_len, source_is_path, flags,
+                      error_message);
+    if (timing != nullptr) {
+      timing->load += uv_hrtime() - start;
+      timing->loaded = true;
+    }
+    if (magic != nullptr) {
+      if (timing != nullptr)
+        DetectTimingLoad(timing, magic);
+      uv_mutex_lock(&lock);
+      ++handles;
+      uv_mutex_unlock(&lock);
+    }
+  }
+  return magic;
+}
+
+size_t Pipeline::handle_count() {
+  uv_mutex_lock(&lock);
+  size_t count = handles;
+  uv_mutex_unlock(&lock);
+  return count;
+}
+
+void Pipeline::ReleaseMagic(struct magic_set* magic) {
+  uv_mutex_lock(&lock);
+  free_magic.push_back(magic);
+  uv_mutex_unlock(&lock);
+}
+
+void Pipeline::DetectWork(uv_work_t* req) {
+  FileJob* job = static_cast<FileJob*>(req->data);
+  Pipeline* pipeline = job->pipeline;
+  DetectTimingDequeue(&job->timing);
+  struct magic_set* magic = pipeline->AcquireMagic(&job->error_message,
+                                                   &job->timing);
+  const char* result;
+  bool open_failed = false;
+
+  if (magic == nullptr) {
+    ReadJobRelease(&job->read);
+    return;
+  }
+
+  ApplyBudget(magic, job->budget);
+  if (job->read.prefetched) {
+    result = magic_prefetched(magic,
+                              job->path,
+                              job->read.fd,
+                              job->read.head,
+                              job->read.head_len,
+                              job->read.tail,
+                              job->read.tail_len,
+                              (off_t)job->read.size);
+  } else {
+    result = DetectPath(magic, job->path, &open_failed);
+  }
+
+  if (open_failed) {
+    job->error_message = strdup("Error while opening file");
+  } else if (result == nullptr) {
+    const char* error = magic_error(magic);
+    if (error)
+      job->error_message = strdup(error);
+  } else {
+    job->result = strdup(result);
+  }
+  DetectTimingPhases(&job->timing, magic);
+  if (pipeline->stats != nullptr)
+    pipeline->stats->profile.Collect(magic);
+
+  ReadJobRelease(&job->read);
+  pipeline->ReleaseMagic(magic);
+}
+
+void Pipeline::DetectAfter(uv_work_t* req, int status) {
+  FileJob* job = static_cast<FileJob*>(req->data);
+  Pipeline* pipeline = job->pipeline;
+
+  --pipeline->detecting;
+  if (pipeline->stats != nullptr)
+    pipeline->stats->Record(job->timing, job->result);
+  job->complete(job);
+  pipeline->Pump();
+}
@@ -0,0 +1,136 @@
+#ifndef MMMAGIC_PIPELINE_H
+#define MMMAGIC_PIPELINE_H
+
+#include <stddef.h>
+
+#include <deque>
+#include <vector>
+
+#include <uv.h>
+
+#include "reader.h"
+#include "stats.h"
+
+struct magic_set;
+
+extern const char* fallbackPath;
+
+struct magic_set* OpenMagic(const char* magic_source,
+                            size_t source_len,
+                            bool source_is_path,
+                            int flags,
+                            char** error_message);
+
+// Bounds the magic entries evaluated by one detection, 0 for none (see
+// MAGIC_PARAM_EVAL_MAX and MAGIC_PARAM_TIME_MAX)
+struct Budget {
+  size_t evaluations;
+  size_t time_us;
+};
+
+// Handles are shared by detections with different budgets, so each sets its
+// own
+void ApplyBudget(struct magic_set* magic, const Budget& budget);
+
+class Pipeline;
+
+// A file on its way through a Pipeline
+struct FileJob {
+  char* path;
+
+  // Output, owned by the job once `complete' is called
+  char* result;
+  char* error_message;
+
+  // Called on the loop thread once the file is detected
+  void (*complete)(FileJob*);
+  void* data;
+
+  // Private to the pipeline
+  Pipeline* pipeline;
+  ReadJob read;
+  DetectTiming timing;
+  Budget budget;
+  uv_work_t work;
+};
+
+void FileJobInit(FileJob* job);
+// Frees the path, result and error message
+void FileJobFree(FileJob* job);
+
+// Detects files in two stages: the files are read by the I/O stage (see
+// reader.h) and the buffers are then detected on the threadpool.  Each stage
+// has its own concurrency limit and the queue between them is bounded, so a
+// slow filesystem cannot hold threadpool threads and detection cannot fall
+// arbitrarily far behind the reads.  Loaded libmagic handles are kept and
+// reused by later detections.
+//
+// All methods must be called on the loop thread.
+class Pipeline {
+public:
+  // Defaults for the limits
+  static const unsigned kIoConcurrency = 32;
+  static const unsigned kReadQueue = 64;
+
+  // Detections are recorded in `stats', if given
+  Pipeline(const char* magic_source, size_t source_len, bool source_is_path,
+           int flags, Stats* stats = nullptr);
+
+  void Push(FileJob* job);
+  void SetLimits(unsigned io, unsigned queue, unsigned cpu);
+
+  // A loaded handle for detections run outside of the pipeline; may be
+  // called from any thread.  Adds the time spent loading a new handle, if
+  // one was loaded, to `timing'.
+  struct magic_set* AcquireMagic(char** error_message,
+                                 DetectTiming* timing = nullptr);
+  void ReleaseMagic(struct magic_set* magic);
+
+  // Number of files being read at once
+  unsigned io_concurrency;
+  // Number of files read (or being read) but not yet being detected
+  unsigned read_queue;
+  // Number of threadpool threads used for detection at once
+  unsigned cpu_concurrency;
+  // Taken by the files pushed from then on
+  Budget budget;
+
+  // Gauges
+  size_t waiting_count() const { return waiting.size(); }
+  unsigned reading_count() const { return reading; }
+  size_t ready_count() const { return ready.size(); }
+  unsigned detecting_count() const { return detecting; }
+  // Number of handles loaded, each holding a copy of the database
+  size_t handle_count();
+
+private:
+  void Pump();
+
+  static void ReadDone(ReadJob* read);
+  static void OnReadDone(uv_async_t* handle);
+  static void DetectWork(uv_work_t* req);
+  static void DetectAfter(uv_work_t* req, int status);
+
+  // libmagic info
+  const char* magic_source;
+  size_t source_len;
+  bool source_is_path;
+  int flags;
+  size_t bytes_max;
+  size_t tail_max;
+
+  Stats* stats;
+
+  std::deque<FileJob*> waiting;
+  std::deque<FileJob*> ready;
+  unsigned reading;
+  unsigned detecting;
+
+  uv_async_t async;
+  uv_mutex_t lock;
+  std::vector<FileJob*> read_done;
+  std::vector<struct magic_set*> free_magic;
+  size_t handles;
+};
+
+#endif
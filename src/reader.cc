@@ -0,0 +1,799 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <deque>
+#include <vector>
+
+#include <uv.h>
+
+#ifndef _WIN32
+# include <unistd.h>
+# include <poll.h>
+# include <sys/mman.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <sys/eventfd.h>
+// IO_URING_OP_SUPPORTED comes with the opcode probe and the statx, openat
+// and read opcodes (5.6 headers); IORING_REGISTER_PROBE itself is an enum
+// constant in newer headers
+#  if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) \
+      && defined(__NR_io_uring_register) && defined(STATX_TYPE) \
+      && defined(IORING_FEAT_NODROP) && defined(IO_URING_OP_SUPPORTED)
+#   define HAVE_IO_URING 1
+#  endif
+# endif
+#endif
+
+#include "magic.h"
+#include "reader.h"
+
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+#ifndef O_NONBLOCK
+# define O_NONBLOCK 0
+#endif
+
+void ReadJobInit(ReadJob* job) {
+  memset(job, 0, sizeof(*job));
+  job->fd = -1;
+  job->head_cached = job->tail_cached = -1;
+}
+
+#if !defined(_WIN32) && defined(MAP_ANON)
+
+// Read buffers for large files come from blocks shared by all readers and
+// kept for reuse, so that each file does not map and unmap its own (malloc()
+// serves these sizes with mmap()).  Blocks are page aligned and, with
+// MAGIC_HUGEPAGES, advised as transparent huge pages.
+class BufferPool {
+public:
+  // Buffers smaller than this come from malloc()'s arenas instead
+  static const size_t kMinSize = 128 * 1024;
+  // Free blocks kept at most; beyond that they are unmapped
+  static const size_t kMaxFree = 16;
+
+  BufferPool() {
+    uv_mutex_init(&lock);
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+  }
+
+  // Returns a block of at least `*size' bytes and sets `*size' to its size
+  void* Get(size_t* size, bool huge) {
+    size_t align = page_size;
+# ifdef MADV_HUGEPAGE
+    if (huge)
+      align = 2 * 1024 * 1024;
+# endif
+    size_t want = (*size + align - 1) & ~(align - 1);
+
+    uv_mutex_lock(&lock);
+    for (size_t i = 0; i < free_blocks.size(); ++i) {
+      if (free_blocks[i].size == want && free_blocks[i].huge == huge) {
+        void* p = free_blocks[i].p;
+        free_blocks.erase(free_blocks.begin() + i);
+        uv_mutex_unlock(&lock);
+        *size = want;
+        return p;
+      }
+    }
+    uv_mutex_unlock(&lock);
+
+    void* p = mmap(nullptr, want, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (p == MAP_FAILED)
+      return nullptr;
+# ifdef MADV_HUGEPAGE
+    if (huge)
+      (void)madvise(p, want, MADV_HUGEPAGE);
+# endif
+    *size = want;
+    return p;
+  }
+
+  void Put(void* p, size_t size, bool huge) {
+    uv_mutex_lock(&lock);
+    if (free_blocks.size() < kMaxFree) {
+      Block block = { p, size, huge };
+      free_blocks.push_back(block);
+      p = nullptr;
+    }
+    uv_mutex_unlock(&lock);
+    if (p != nullptr)
+      (void)munmap(p, size);
+  }
+
+private:
+  struct Block {
+    void* p;
+    size_t size;
+    bool huge;
+  };
+
+  uv_mutex_t lock;
+  size_t page_size;
+  std::vector<Block> free_blocks;
+};
+
+static uv_once_t pool_once = UV_ONCE_INIT;
+static BufferPool* pool;
+
+static void CreatePool() {
+  pool = new BufferPool();
+}
+
+static BufferPool* GetPool() {
+  uv_once(&pool_once, CreatePool);
+  return pool;
+}
+
+#endif
+
+void ReadJobRelease(ReadJob* job) {
+#ifndef _WIN32
+  if (job->fd != -1) {
+# ifdef POSIX_FADV_DONTNEED
+    // Don't let the scan evict more useful pages: only those that were not
+    // cached before it are dropped
+    if (job->head_cached != -1 && (size_t)job->head_cached < job->head_len) {
+      (void)posix_fadvise(job->fd, (off_t)job->head_cached,
+                          (off_t)(job->head_len - job->head_cached),
+                          POSIX_FADV_DONTNEED);
+    }
+    if (job->tail_cached != -1 && (size_t)job->tail_cached < job->tail_len) {
+      (void)posix_fadvise(job->fd,
+                          (off_t)(job->size - (int64_t)job->tail_len
+                                  + job->tail_cached),
+                          (off_t)(job->tail_len - job->tail_cached),
+                          POSIX_FADV_DONTNEED);
+    }
+# endif
+    close(job->fd);
+  }
+#endif
+#if !defined(_WIN32) && defined(MAP_ANON)
+  if (job->block != nullptr) {
+    GetPool()->Put(job->block, job->block_size,
+                   (job->flags & MAGIC_HUGEPAGES) != 0);
+    job->head = job->tail = nullptr;
+    job->block = nullptr;
+  }
+#endif
+  free(job->head);
+  free(job->tail);
+  job->fd = -1;
+  job->head = job->tail = nullptr;
+  job->head_len = job->tail_len = 0;
+  job->head_cached = job->tail_cached = -1;
+  job->prefetched = false;
+}
+
+#ifndef _WIN32
+
+// Whether file_fsmagic() would print nothing for the file, so that only its
+// contents matter.  Also the only files it is safe to open without knowing
+// what they are.
+static bool PlainFile(mode_t mode, int64_t size) {
+  return S_ISREG(mode)
+         && (mode & (S_ISUID | S_ISGID | S_ISVTX)) == 0
+         && size > 0;
+}
+
+static int OpenFlags(int flags) {
+  // O_NONBLOCK in case the file was replaced by a FIFO since it was stat'ed
+  int oflags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+#ifdef O_NOFOLLOW
+  if ((flags & MAGIC_SYMLINK) == 0)
+    oflags |= O_NOFOLLOW;
+#endif
+#ifdef O_NOATIME
+  if (flags & MAGIC_NOCACHE)
+    oflags |= O_NOATIME;
+#endif
+  return oflags;
+}
+
+// Sizes and allocates the head and tail windows the same way file_or_fd()
+// does for a file of `size' bytes
+static bool AllocBuffers(ReadJob* job, int64_t size) {
+  job->size = size;
+  job->head_len = (size_t)(size < (int64_t)job->bytes_max ? size
+                                                           : job->bytes_max);
+  if (job->tail_max > 0
+      && size > (int64_t)job->head_len
+      && size <= (int64_t)UINT32_MAX) {
+    job->tail_len = (size_t)(size - job->head_len);
+    if (job->tail_len > job->tail_max)
+      job->tail_len = job->tail_max;
+  }
+
+#ifdef MAP_ANON
+  // Both windows share one pooled block, the tail right after the head.
+  // Blocks are sized for the largest windows so that any of them fits.
+  if (job->head_len + 1 + job->tail_len >= BufferPool::kMinSize) {
+    job->block_size = job->bytes_max + 1 + job->tail_max;
+    job->block = GetPool()->Get(&job->block_size,
+                                (job->flags & MAGIC_HUGEPAGES) != 0);
+    if (job->block != nullptr) {
+      job->head = static_cast<unsigned char*>(job->block);
+      if (job->tail_len > 0)
+        job->tail = job->head + job->head_len + 1;
+      return true;
+    }
+  }
+#endif
+
+  job->head = static_cast<unsigned char*>(malloc(job->head_len + 1));
+  if (job->head == nullptr)
+    return false;
+  if (job->tail_len > 0) {
+    job->tail = static_cast<unsigned char*>(malloc(job->tail_len));
+    if (job->tail == nullptr)
+      return false;
+  }
+  return true;
+}
+
+// With MAGIC_NOCACHE, notes how much of the head and tail windows the page
+// cache already holds, as file_or_fd() does, and keeps the kernel from
+// reading ahead past them.  The cached starts of both windows are read into
+// place, so that only the rest of them is left to read; returns where that
+// is for the head (see TailCached() for the tail).  Never waits for I/O.
+static size_t ProbeCache(ReadJob* job) {
+  size_t n;
+  if ((job->flags & MAGIC_NOCACHE) == 0)
+    return 0;
+# ifdef POSIX_FADV_RANDOM
+  (void)posix_fadvise(job->fd, 0, 0, POSIX_FADV_RANDOM);
+# endif
+  if (job->tail != nullptr
+      && magic_read_cached(job->fd, job->tail, job->tail_len,
+                           (off_t)(job->size - (int64_t)job->tail_len),
+                           &n) == 0) {
+    job->tail_cached = (int64_t)n;
+  }
+  if (magic_read_cached(job->fd, job->head, job->head_len, 0, &n) != 0)
+    return 0;
+  job->head_cached = (int64_t)n;
+  return n;
+}
+
+// Bytes at the start of the tail window that ProbeCache() read
+static size_t TailCached(const ReadJob* job) {
+  return job->tail_cached > 0 ? (size_t)job->tail_cached : 0;
+}
+
+// Records the result of the head or tail read; a short tail no longer lines
+// up with the end of the file and is dropped
+static bool ReadDone(ReadJob* job, bool is_tail, ssize_t r) {
+  if (!is_tail) {
+    if (r < 0)
+      return false;
+    job->head_len = (size_t)r;
+    job->head[r] = '\0';
+  } else if (r != (ssize_t)job->tail_len) {
+    if (job->block == nullptr)
+      free(job->tail);
+    job->tail = nullptr;
+    job->tail_len = 0;
+  }
+  return true;
+}
+
+// Threads are started as needed, up to kMaxThreads, so that slow storage
+// gets as many reads in flight as the pipelines ask for
+class PreadReader : public Reader {
+public:
+  PreadReader() : nthreads(0), idle(0) {
+    uv_mutex_init(&lock);
+    uv_cond_init(&cond);
+  }
+
+  void Submit(ReadJob* job) {
+    uv_mutex_lock(&lock);
+    queue.push_back(job);
+    if (idle < queue.size() && nthreads < kMaxThreads) {
+      uv_thread_t thread;
+      if (uv_thread_create(&thread, Run, this) == 0)
+        ++nthreads;
+    }
+    uv_cond_signal(&cond);
+    uv_mutex_unlock(&lock);
+  }
+
+  const char* Name() const {
+    return "pread";
+  }
+
+private:
+  static const unsigned kMaxThreads = 64;
+
+  static void Run(void* arg) {
+    PreadReader* reader = static_cast<PreadReader*>(arg);
+    while (true) {
+      uv_mutex_lock(&reader->lock);
+      ++reader->idle;
+      while (reader->queue.empty())
+        uv_cond_wait(&reader->cond, &reader->lock);
+      --reader->idle;
+      ReadJob* job = reader->queue.front();
+      reader->queue.pop_front();
+      uv_mutex_unlock(&reader->lock);
+
+      if (!Read(job))
+        ReadJobRelease(job);
+      job->done(job);
+    }
+  }
+
+  static bool Read(ReadJob* job) {
+    struct stat sb;
+    int oflags = OpenFlags(job->flags);
+    int r = (job->flags & MAGIC_SYMLINK) ? stat(job->path, &sb)
+                                         : lstat(job->path, &sb);
+
+    if (r != 0 || !PlainFile(sb.st_mode, sb.st_size))
+      return false;
+
+    job->fd = open(job->path, oflags);
+#ifdef O_NOATIME
+    // Only the owner of the file may use O_NOATIME
+    if (job->fd < 0 && errno == EPERM && (oflags & O_NOATIME))
+      job->fd = open(job->path, oflags & ~O_NOATIME);
+#endif
+    if (job->fd < 0 || !AllocBuffers(job, sb.st_size))
+      return false;
+    size_t have = ProbeCache(job);
+    ssize_t n = (ssize_t)have;
+    if (have < job->head_len) {
+      n = pread(job->fd, job->head + have, job->head_len - have,
+                (off_t)have);
+      if (n >= 0)
+        n += (ssize_t)have;
+    }
+    if (!ReadDone(job, false, n))
+      return false;
+    if (job->tail != nullptr) {
+      have = TailCached(job);
+      n = (ssize_t)have;
+      if (have < job->tail_len) {
+        n = pread(job->fd, job->tail + have, job->tail_len - have,
+                  (off_t)(job->size - (int64_t)(job->tail_len - have)));
+        if (n >= 0)
+          n += (ssize_t)have;
+      }
+      ReadDone(job, true, n);
+    }
+    job->prefetched = true;
+    return true;
+  }
+
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  std::deque<ReadJob*> queue;
+  unsigned nthreads;
+  size_t idle;
+};
+
+#ifdef HAVE_IO_URING
+// Drives one ring from its own thread: each file is a statx, an openat and
+// then the head and tail reads submitted together, and up to kDepth files
+// are in flight at once.  If the ring fails, files are read by a
+// PreadReader from then on.
+class UringReader : public Reader {
+public:
+  static UringReader* Create() {
+    UringReader* reader = new UringReader();
+    if (!reader->Setup()
+        || uv_thread_create(&reader->thread, Run, reader) != 0) {
+      delete reader;
+      return nullptr;
+    }
+    return reader;
+  }
+
+  ~UringReader() {
+    if (sq_ptr != MAP_FAILED)
+      munmap(sq_ptr, sq_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+      munmap(cq_ptr, cq_size);
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_size);
+    if (ring_fd != -1)
+      close(ring_fd);
+    if (event_fd != -1)
+      close(event_fd);
+    uv_mutex_destroy(&lock);
+  }
+
+  void Submit(ReadJob* job) {
+    uint64_t one = 1;
+    uv_mutex_lock(&lock);
+    if (fallback != nullptr) {
+      uv_mutex_unlock(&lock);
+      return fallback->Submit(job);
+    }
+    incoming.push_back(job);
+    uv_mutex_unlock(&lock);
+    ssize_t r;
+    do {
+      r = write(event_fd, &one, sizeof(one));
+    } while (r == -1 && errno == EINTR);
+  }
+
+  const char* Name() const {
+    Reader* pread = __atomic_load_n(&fallback, __ATOMIC_ACQUIRE);
+    return pread != nullptr ? pread->Name() : "io_uring";
+  }
+
+private:
+  static const unsigned kDepth = 128;
+
+  enum OpKind { OP_STATX = 1, OP_OPEN, OP_READ_HEAD, OP_READ_TAIL };
+
+  struct Op {
+    ReadJob* job;
+    struct statx stx;
+    int open_flags;
+    // Bytes of the head and of the tail already read from the page cache
+    size_t have;
+    size_t tail_have;
+    int pending;
+    bool failed;
+    // Index in `inflight'
+    size_t slot;
+  };
+
+  UringReader()
+    : ring_fd(-1), event_fd(-1),
+      sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(
+        static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+      to_submit(0), active(0), fallback(nullptr) {
+    uv_mutex_init(&lock);
+  }
+
+  bool Setup() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    // Two reads per file plus the eventfd poll
+    ring_fd = (int)syscall(__NR_io_uring_setup, kDepth * 2 + 1, &p);
+    if (ring_fd < 0)
+      return false;
+    if (!(p.features & IORING_FEAT_NODROP) || !Supported())
+      return false;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (cq_size > sq_size)
+        sq_size = cq_size;
+      cq_size = sq_size;
+    }
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+      return false;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ptr = sq_ptr;
+    } else {
+      cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+      if (cq_ptr == MAP_FAILED)
+        return false;
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = static_cast<struct io_uring_sqe*>(
+      mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES)
+    );
+    if (sqes == MAP_FAILED)
+      return false;
+
+    char* sq = static_cast<char*>(sq_ptr);
+    char* cq = static_cast<char*>(cq_ptr);
+    sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return event_fd != -1;
+  }
+
+  // Older kernels have io_uring but not all of the opcodes used here
+  bool Supported() {
+    const unsigned nops = 256;
+    bool ok = false;
+    size_t len = sizeof(struct io_uring_probe)
+                 + nops * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe =
+      static_cast<struct io_uring_probe*>(calloc(1, len));
+    if (probe == nullptr)
+      return false;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                probe, nops) == 0) {
+      static const int needed[] = {
+        IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_POLL_ADD
+      };
+      ok = true;
+      for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); ++i) {
+        if (needed[i] > probe->last_op
+            || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+          ok = false;
+        }
+      }
+    }
+    free(probe);
+    return ok;
+  }
+
+  // The SQ never fills up: there are at most two SQEs per file in flight
+  struct io_uring_sqe* GetSqe(Op* op, OpKind kind) {
+    unsigned tail = *sq_tail;
+    unsigned idx = tail & sq_mask;
+    struct io_uring_sqe* sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = reinterpret_cast<uintptr_t>(op) | kind;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++to_submit;
+    return sqe;
+  }
+
+  void ArmEvent() {
+    struct io_uring_sqe* sqe = GetSqe(nullptr, static_cast<OpKind>(0));
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = event_fd;
+    sqe->poll_events = POLLIN;
+  }
+
+  void Statx(Op* op) {
+    struct io_uring_sqe* sqe = GetSqe(op, OP_STATX);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uintptr_t>(op->job->path);
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE;
+    sqe->off = reinterpret_cast<uintptr_t>(&op->stx);
+    if ((op->job->flags & MAGIC_SYMLINK) == 0)
+      sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+  }
+
+  void Open(Op* op) {
+    struct io_uring_sqe* sqe = GetSqe(op, OP_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = reinterpret_cast<uintptr_t>(op->job->path);
+    sqe->open_flags = op->open_flags;
+  }
+
+  void Read(Op* op, OpKind kind, void* buf, size_t len, int64_t off) {
+    struct io_uring_sqe* sqe = GetSqe(op, kind);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = op->job->fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = (unsigned)len;
+    sqe->off = (uint64_t)off;
+    ++op->pending;
+  }
+
+  void Finish(Op* op) {
+    ReadJob* job = op->job;
+    if (op->failed)
+      ReadJobRelease(job);
+    else
+      job->prefetched = true;
+    inflight[op->slot] = inflight.back();
+    inflight[op->slot]->slot = op->slot;
+    inflight.pop_back();
+    delete op;
+    --active;
+    job->done(job);
+  }
+
+  // The ring can no longer be used.  Files in flight are handed back unread,
+  // as on any read error, so that the detection stage reads them itself;
+  // their buffers and Ops are left to the kernel, which may still write to
+  // them.  Queued and later files go to a PreadReader.
+  void Fail() {
+    PreadReader* pread = new PreadReader();
+    for (size_t i = 0; i < inflight.size(); ++i) {
+      ReadJob* job = inflight[i]->job;
+      job->head = job->tail = nullptr;
+      job->block = nullptr;
+      job->head_cached = job->tail_cached = -1;
+      ReadJobRelease(job);
+      job->done(job);
+    }
+    inflight.clear();
+
+    uv_mutex_lock(&lock);
+    __atomic_store_n(&fallback, pread, __ATOMIC_RELEASE);
+    while (!incoming.empty()) {
+      pread->Submit(incoming.front());
+      incoming.pop_front();
+    }
+    uv_mutex_unlock(&lock);
+  }
+
+  void Complete(uint64_t user_data, int res) {
+    Op* op = reinterpret_cast<Op*>(user_data & ~(uint64_t)7);
+    OpKind kind = static_cast<OpKind>(user_data & 7);
+    ReadJob* job;
+
+    if (op == nullptr) {
+      uint64_t val;
+      while (read(event_fd, &val, sizeof(val)) == -1 && errno == EINTR);
+      ArmEvent();
+      return;
+    }
+    job = op->job;
+
+    switch (kind) {
+      case OP_STATX:
+        if (res < 0 || !PlainFile(op->stx.stx_mode,
+                                  (int64_t)op->stx.stx_size)) {
+          op->failed = true;
+          return Finish(op);
+        }
+        if (!AllocBuffers(job, (int64_t)op->stx.stx_size)) {
+          op->failed = true;
+          return Finish(op);
+        }
+        op->open_flags = OpenFlags(job->flags);
+        return Open(op);
+      case OP_OPEN:
+#ifdef O_NOATIME
+        // Only the owner of the file may use O_NOATIME
+        if (res == -EPERM && (op->open_flags & O_NOATIME)) {
+          op->open_flags &= ~O_NOATIME;
+          return Open(op);
+        }
+#endif
+        if (res < 0) {
+          op->failed = true;
+          return Finish(op);
+        }
+        job->fd = res;
+        // The probe only copies from the page cache, it is fine to run it
+        // on the ring's thread
+        op->have = ProbeCache(job);
+        if (op->have < job->head_len) {
+          Read(op, OP_READ_HEAD, job->head + op->have,
+               job->head_len - op->have, (int64_t)op->have);
+        } else {
+          ReadDone(job, false, (ssize_t)op->have);
+        }
+        op->tail_have = TailCached(job);
+        if (job->tail != nullptr && op->tail_have < job->tail_len) {
+          Read(op, OP_READ_TAIL, job->tail + op->tail_have,
+               job->tail_len - op->tail_have,
+               job->size - (int64_t)(job->tail_len - op->tail_have));
+        }
+        if (op->pending == 0)
+          Finish(op);
+        return;
+      case OP_READ_HEAD:
+      case OP_READ_TAIL:
+        if (res >= 0)
+          res += (int)(kind == OP_READ_HEAD ? op->have : op->tail_have);
+        if (!ReadDone(job, kind == OP_READ_TAIL, res))
+          op->failed = true;
+        if (--op->pending == 0)
+          Finish(op);
+        return;
+    }
+  }
+
+  static void Run(void* arg) {
+    UringReader* reader = static_cast<UringReader*>(arg);
+    reader->ArmEvent();
+    while (true) {
+      if (reader->active < kDepth) {
+        uv_mutex_lock(&reader->lock);
+        while (!reader->incoming.empty() && reader->active < kDepth) {
+          Op* op = new Op();
+          op->job = reader->incoming.front();
+          reader->incoming.pop_front();
+          op->slot = reader->inflight.size();
+          reader->inflight.push_back(op);
+          ++reader->active;
+          reader->Statx(op);
+        }
+        uv_mutex_unlock(&reader->lock);
+      }
+
+      int r = (int)syscall(__NR_io_uring_enter, reader->ring_fd,
+                           reader->to_submit, 1, IORING_ENTER_GETEVENTS,
+                           nullptr, 0);
+      if (r > 0) {
+        reader->to_submit -= (unsigned)r;
+      } else if (r < 0 && errno != EINTR && errno != EAGAIN
+                 && errno != EBUSY) {
+        return reader->Fail();
+      }
+
+      unsigned head = *reader->cq_head;
+      while (head != __atomic_load_n(reader->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &reader->cqes[head & reader->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(reader->cq_head, ++head, __ATOMIC_RELEASE);
+        reader->Complete(user_data, res);
+      }
+    }
+  }
+
+  int ring_fd;
+  int event_fd;
+  void* sq_ptr;
+  size_t sq_size;
+  void* cq_ptr;
+  size_t cq_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  unsigned to_submit;
+  unsigned active;
+  std::vector<Op*> inflight;
+
+  uv_thread_t thread;
+  uv_mutex_t lock;
+  std::deque<ReadJob*> incoming;
+  // Set once the ring has failed
+  PreadReader* fallback;
+};
+#endif  // HAVE_IO_URING
+
+#else  // _WIN32
+
+// Nothing is read ahead on Windows, files are opened by the detection
+// stage with their UTF-16 names
+class PreadReader : public Reader {
+public:
+  void Submit(ReadJob* job) {
+    job->done(job);
+  }
+
+  const char* Name() const {
+    return "none";
+  }
+};
+
+#endif
+
+static uv_once_t reader_once = UV_ONCE_INIT;
+static Reader* reader;
+
+static void CreateReader() {
+#ifdef HAVE_IO_URING
+  // Same switch as libuv's own io_uring support
+  const char* use = getenv("UV_USE_IO_URING");
+  if (use == nullptr || atoi(use) != 0)
+    reader = UringReader::Create();
+#endif
+  if (reader == nullptr)
+    reader = new PreadReader();
+}
+
+Reader* Reader::Get() {
+  uv_once(&reader_once, CreateReader);
+  return reader;
+}
@@ -0,0 +1,62 @@
+#ifndef MMMAGIC_READER_H
+#define MMMAGIC_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One file to be read ahead of detection.
+//
+// Only plain regular files are read: anything else (directories, devices,
+// FIFOs, symlinks when they are not followed, empty or setuid/setgid/sticky
+// files) and any I/O error leave `prefetched' unset so that the caller runs
+// magic_file() on the path instead, which produces exactly the output and
+// error messages it always has.
+struct ReadJob {
+  // Input
+  const char* path;
+  int flags;          // MAGIC_* flags, used for MAGIC_SYMLINK/MAGIC_NOCACHE
+  size_t bytes_max;   // MAGIC_PARAM_BYTES_MAX
+  size_t tail_max;    // MAGIC_PARAM_TAIL_MAX
+
+  // Output, valid once `done' is called
+  bool prefetched;
+  int fd;             // kept open for the ELF/CDF readers
+  int64_t size;
+  unsigned char* head;
+  size_t head_len;
+  unsigned char* tail;
+  size_t tail_len;
+  // With MAGIC_NOCACHE, how much of the head and of the tail the page cache
+  // held before they were read, or -1 where that is not known
+  int64_t head_cached;
+  int64_t tail_cached;
+
+  // Called on an I/O thread once the job is finished
+  void (*done)(ReadJob*);
+  void* data;
+
+  // Private to the reader: the pooled block holding `head' and `tail', if
+  // they were not allocated separately
+  void* block;
+  size_t block_size;
+};
+
+void ReadJobInit(ReadJob* job);
+// Closes the file and frees the buffers of a finished job
+void ReadJobRelease(ReadJob* job);
+
+// The I/O stage shared by all batches: opens and reads files on its own
+// threads so that the threadpool only runs detection
+class Reader {
+public:
+  virtual ~Reader() {}
+  virtual void Submit(ReadJob* job) = 0;
+  virtual const char* Name() const = 0;
+
+  // Returns the process-wide reader, backed by io_uring when the kernel
+  // allows it (and UV_USE_IO_URING is not set to 0) and by a few pread()
+  // threads otherwise
+  static Reader* Get();
+};
+
+#endif
@@ -0,0 +1,247 @@
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+
+#include "stats.h"
+
+using namespace v8;
+
+void DetectTimingInit(DetectTiming* timing) {
+  memset(timing, 0, sizeof(*timing));
+  timing->start = timing->mark = uv_hrtime();
+}
+
+void DetectTimingDequeue(DetectTiming* timing) {
+  uint64_t now = uv_hrtime();
+  timing->queue += now - timing->mark;
+  timing->mark = now;
+}
+
+void DetectTimingLoad(DetectTiming* timing, struct magic_set* magic) {
+  int ran = magic_load_steps(magic, timing->load_steps, MAGIC_LOAD_STEPS);
+  timing->load_ran = (ran > 0 ? ran : 0);
+  timing->database = magic_load_size(magic);
+}
+
+void DetectTimingPhases(DetectTiming* timing, struct magic_set* magic) {
+  int ran = magic_phases(magic, timing->phases, MAGIC_PHASES);
+  timing->ran = (ran > 0 ? ran : 0);
+  timing->truncated = (magic_truncated(magic) != 0);
+  if (magic_getflags(magic) & MAGIC_PROFILE) {
+    timing->touched = magic_touched(magic);
+    timing->profiled = true;
+  }
+}
+
+Histogram::Histogram(uint64_t unit_, double scale_)
+  : unit(unit_), scale(scale_), count(0), sum(0), min(0), max(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void Histogram::Add(uint64_t value) {
+  uint64_t units = (value + unit - 1) / unit;
+  int i = 0;
+  while (i < kBuckets - 1 && units > (uint64_t(1) << i))
+    ++i;
+  ++buckets[i];
+  if (count == 0 || value < min)
+    min = value;
+  if (value > max)
+    max = value;
+  sum += value;
+  ++count;
+}
+
+static double ToMs(uint64_t ns) {
+  return (double)ns / 1e6;
+}
+
+Local<Object> Histogram::ToObject() const {
+  Local<Object> obj = Nan::New<Object>();
+  Local<Array> list = Nan::New<Array>(kBuckets);
+  uint64_t below = 0;
+
+  for (int i = 0; i < kBuckets; ++i) {
+    Local<Object> bucket = Nan::New<Object>();
+    double le = (i < kBuckets - 1
+                 ? (double)(unit << i) / scale
+                 : std::numeric_limits<double>::infinity());
+    below += buckets[i];
+    Nan::Set(bucket, Nan::New<String>("le").ToLocalChecked(),
+             Nan::New<Number>(le));
+    Nan::Set(bucket, Nan::New<String>("count").ToLocalChecked(),
+             Nan::New<Number>((double)below));
+    Nan::Set(list, i, bucket);
+  }
+
+  Nan::Set(obj, Nan::New<String>("count").ToLocalChecked(),
+           Nan::New<Number>((double)count));
+  Nan::Set(obj, Nan::New<String>("sum").ToLocalChecked(),
+           Nan::New<Number>((double)sum / scale));
+  Nan::Set(obj, Nan::New<String>("min").ToLocalChecked(),
+           Nan::New<Number>((double)min / scale));
+  Nan::Set(obj, Nan::New<String>("max").ToLocalChecked(),
+           Nan::New<Number>((double)max / scale));
+  Nan::Set(obj, Nan::New<String>("buckets").ToLocalChecked(), list);
+  return obj;
+}
+
+// Indexed by MAGIC_PHASE_*
+static const char* const phase_names[MAGIC_PHASES] = {
+  "encoding", "compress", "tar", "cdf", "soft", "elf", "text"
+};
+
+// Indexed by MAGIC_LOAD_*
+static const char* const load_step_names[MAGIC_LOAD_STEPS] = {
+  "map", "check", "byteswap", "parse"
+};
+
+Stats::Stats() : database(0), truncated(0) {
+}
+
+void Stats::Record(const DetectTiming& timing, const char* result) {
+  total.Add(uv_hrtime() - timing.start);
+  queue.Add(timing.queue);
+  if (timing.read_done)
+    read.Add(timing.read);
+  if (timing.loaded) {
+    load.Add(timing.load);
+    for (int i = 0; i < MAGIC_LOAD_STEPS; ++i) {
+      if (timing.load_ran & (1 << i))
+        load_steps[i].Add(timing.load_steps[i]);
+    }
+    if (timing.database != 0)
+      database = timing.database;
+  }
+  for (int i = 0; i < MAGIC_PHASES; ++i) {
+    if (timing.ran & (1 << i))
+      phases[i].Add(timing.phases[i]);
+  }
+  if (timing.truncated)
+    ++truncated;
+  if (timing.profiled && result != nullptr) {
+    std::map<std::string, Histogram>::iterator it = touched.find(result);
+    if (it == touched.end())
+      it = touched.insert(std::make_pair(result, Histogram(1, 1))).first;
+    it->second.Add(timing.touched);
+  }
+}
+
+Local<Object> Stats::ToObject() const {
+  Local<Object> obj = Nan::New<Object>();
+  Local<Object> phases_obj = Nan::New<Object>();
+  Local<Object> touched_obj = Nan::New<Object>();
+  Local<Object> load_steps_obj = Nan::New<Object>();
+
+  for (int i = 0; i < MAGIC_PHASES; ++i) {
+    Nan::Set(phases_obj, Nan::New<String>(phase_names[i]).ToLocalChecked(),
+             phases[i].ToObject());
+  }
+  for (int i = 0; i < MAGIC_LOAD_STEPS; ++i) {
+    Nan::Set(load_steps_obj,
+             Nan::New<String>(load_step_names[i]).ToLocalChecked(),
+             load_steps[i].ToObject());
+  }
+  std::map<std::string, Histogram>::const_iterator it;
+  for (it = touched.begin(); it != touched.end(); ++it) {
+    Nan::Set(touched_obj,
+             Nan::New<String>(it->first.c_str()).ToLocalChecked(),
+             it->second.ToObject());
+  }
+
+  Nan::Set(obj, Nan::New<String>("total").ToLocalChecked(), total.ToObject());
+  Nan::Set(obj, Nan::New<String>("queue").ToLocalChecked(), queue.ToObject());
+  Nan::Set(obj, Nan::New<String>("read").ToLocalChecked(), read.ToObject());
+  Nan::Set(obj, Nan::New<String>("load").ToLocalChecked(), load.ToObject());
+  Nan::Set(obj, Nan::New<String>("loadSteps").ToLocalChecked(),
+           load_steps_obj);
+  Nan::Set(obj, Nan::New<String>("database").ToLocalChecked(),
+           Nan::New<Number>((double)database));
+  Nan::Set(obj, Nan::New<String>("phases").ToLocalChecked(), phases_obj);
+  Nan::Set(obj, Nan::New<String>("touched").ToLocalChecked(), touched_obj);
+  Nan::Set(obj, Nan::New<String>("truncated").ToLocalChecked(),
+           Nan::New<Number>((double)truncated));
+  return obj;
+}
+
+Profile::Profile() {
+  uv_mutex_init(&lock);
+}
+
+Profile::~Profile() {
+  uv_mutex_destroy(&lock);
+}
+
+void Profile::Collect(struct magic_set* magic) {
+  struct magic_entry_prof buf[64];
+  size_t n;
+
+  if ((magic_getflags(magic) & MAGIC_PROFILE) == 0)
+    return;
+
+  while ((n = magic_profile(magic, buf, 64)) > 0) {
+    uv_mutex_lock(&lock);
+    for (size_t i = 0; i < n; ++i) {
+      if (buf[i].index >= entries.size()) {
+        size_t size = entries.size();
+        entries.resize(buf[i].index + 1);
+        for (; size < entries.size(); ++size) {
+          entries[size].index = (uint32_t)size;
+          entries[size].evals = 0;
+        }
+      }
+      Entry& entry = entries[buf[i].index];
+      if (entry.evals == 0) {
+        entry.lineno = buf[i].lineno;
+        entry.desc = buf[i].desc;
+        entry.mimetype = buf[i].mimetype;
+        entry.matches = entry.ns = 0;
+      }
+      entry.evals += buf[i].evals;
+      entry.matches += buf[i].matches;
+      entry.ns += buf[i].ns;
+    }
+    uv_mutex_unlock(&lock);
+  }
+}
+
+bool Profile::MoreTime(const Entry* a, const Entry* b) {
+  return a->ns > b->ns || (a->ns == b->ns && a->index < b->index);
+}
+
+Local<Array> Profile::ToArray() {
+  std::vector<const Entry*> used;
+  Local<Array> list;
+
+  uv_mutex_lock(&lock);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (entries[i].evals > 0)
+      used.push_back(&entries[i]);
+  }
+  std::sort(used.begin(), used.end(), MoreTime);
+
+  list = Nan::New<Array>((uint32_t)used.size());
+  for (size_t i = 0; i < used.size(); ++i) {
+    const Entry* entry = used[i];
+    Local<Object> obj = Nan::New<Object>();
+    Nan::Set(obj, Nan::New<String>("index").ToLocalChecked(),
+             Nan::New<Number>(entry->index));
+    Nan::Set(obj, Nan::New<String>("line").ToLocalChecked(),
+             Nan::New<Number>(entry->lineno));
+    Nan::Set(obj, Nan::New<String>("description").ToLocalChecked(),
+             Nan::New<String>(entry->desc.c_str()).ToLocalChecked());
+    Nan::Set(obj, Nan::New<String>("mimeType").ToLocalChecked(),
+             Nan::New<String>(entry->mimetype.c_str()).ToLocalChecked());
+    Nan::Set(obj, Nan::New<String>("evaluations").ToLocalChecked(),
+             Nan::New<Number>((double)entry->evals));
+    Nan::Set(obj, Nan::New<String>("matches").ToLocalChecked(),
+             Nan::New<Number>((double)entry->matches));
+    Nan::Set(obj, Nan::New<String>("time").ToLocalChecked(),
+             Nan::New<Number>(ToMs(entry->ns)));
+    Nan::Set(list, (uint32_t)i, obj);
+  }
+  uv_mutex_unlock(&lock);
+
+  return list;
+}
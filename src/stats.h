@@ -0,0 +1,130 @@
+#ifndef MMMAGIC_STATS_H
+#define MMMAGIC_STATS_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+#include <nan.h>
+
+#include "magic.h"
+
+// Where the time of one detection went, in ns.  Each part is filled in by
+// the thread doing it; the timing is recorded on the loop thread once the
+// detection is over.
+struct DetectTiming {
+  uint64_t start;     // when the detection was requested
+  uint64_t mark;      // start of the current wait or read
+  uint64_t queue;     // waiting for the I/O stage and the threadpool
+  uint64_t read;      // reading the file (files only)
+  uint64_t load;      // loading the database, if it was not already loaded
+  uint64_t load_steps[MAGIC_LOAD_STEPS];
+  int load_ran;       // mask (1 << MAGIC_LOAD_*) of the steps that ran
+  size_t database;    // bytes of magic entries of the loaded database
+  uint64_t phases[MAGIC_PHASES];
+  int ran;            // mask (1 << MAGIC_PHASE_*) of the tests that ran
+  bool read_done;     // the file was read by the I/O stage
+  bool loaded;        // a database was loaded for the detection
+  // With MAGIC_PROFILE, how far into the input the tests that matched read
+  size_t touched;
+  bool profiled;
+  // The magic entries were cut short by the budget of the detection
+  bool truncated;
+};
+
+void DetectTimingInit(DetectTiming* timing);
+// Ends a wait that started at `mark', adding it to `queue'
+void DetectTimingDequeue(DetectTiming* timing);
+// Takes the times of the steps of loading `magic' and the size of its
+// database, for a detection that loaded it
+void DetectTimingLoad(DetectTiming* timing, struct magic_set* magic);
+// Takes the times of the tests (and with MAGIC_PROFILE, how far they read)
+// from the detection `magic' just ran
+void DetectTimingPhases(DetectTiming* timing, struct magic_set* magic);
+
+// Values in power-of-two buckets of `unit', from 1 unit up to 2^26 units,
+// and one for larger values.  By default the values are durations in ns,
+// with buckets from 1 us up to about 67 seconds, reported in ms.
+class Histogram {
+public:
+  static const int kBuckets = 28;
+
+  Histogram(uint64_t unit = 1000, double scale = 1e6);
+
+  void Add(uint64_t value);
+  // { count, sum, min, max, buckets: [{ le, count }, ...] }, with values
+  // divided by `scale' and cumulative bucket counts
+  v8::Local<v8::Object> ToObject() const;
+
+private:
+  uint64_t unit;
+  double scale;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t buckets[kBuckets];
+};
+
+// The counters of the magic entries evaluated by handles opened with
+// MAGIC_PROFILE, summed over all of them
+class Profile {
+public:
+  Profile();
+  ~Profile();
+
+  // Moves the counters of `magic' into the profile; may be called from any
+  // thread
+  void Collect(struct magic_set* magic);
+  // An array of { index, line, description, mimeType, evaluations,
+  // matches, time } objects, most time first
+  v8::Local<v8::Array> ToArray();
+
+private:
+  struct Entry {
+    uint32_t index;
+    uint32_t lineno;
+    std::string desc;
+    std::string mimetype;
+    uint64_t evals;
+    uint64_t matches;
+    uint64_t ns;
+  };
+
+  static bool MoreTime(const Entry* a, const Entry* b);
+
+  uv_mutex_t lock;
+  // Indexed by the index of the entry in the database
+  std::vector<Entry> entries;
+};
+
+// The timings of all detections of a Magic instance.  Only used on the loop
+// thread, except for `profile'.
+class Stats {
+public:
+  Stats();
+
+  // `result' is that of the detection, or nullptr
+  void Record(const DetectTiming& timing, const char* result);
+  v8::Local<v8::Object> ToObject() const;
+
+  Profile profile;
+
+private:
+  Histogram total;
+  Histogram queue;
+  Histogram read;
+  Histogram load;
+  Histogram phases[MAGIC_PHASES];
+  Histogram load_steps[MAGIC_LOAD_STEPS];
+  // Bytes of magic entries of the last database loaded
+  size_t database;
+  uint64_t truncated;
+  // Bytes read by the tests that matched, by result (MAGIC_PROFILE only)
+  std::map<std::string, Histogram> touched;
+};
+
+#endif
@@ -0,0 +1,328 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <fnmatch.h>
+# include <unistd.h>
+# include <sys/stat.h>
+# ifdef __linux__
+#  include <sys/syscall.h>
+# endif
+# include <dirent.h>
+#endif
+
+#include "walker.h"
+
+#ifndef O_CLOEXEC
+# define O_CLOEXEC 0
+#endif
+
+Walker::Walker(const char* root_, const Options& options_,
+               void (*notify_)(void*), void* data_)
+  : root(root_),
+    options(options_),
+    notify(notify_),
+    data(data_),
+    root_fd(-1),
+    started(false),
+    outstanding(0),
+    finished(false),
+    stopped(false) {
+  // Paths are built as root + "/" + relative path
+  while (root.size() > 1 && root[root.size() - 1] == '/')
+    root.erase(root.size() - 1);
+  if (options.high_water == 0)
+    options.high_water = 1;
+  uv_mutex_init(&lock);
+  uv_cond_init(&cond);
+}
+
+Walker::~Walker() {
+  if (started) {
+    Stop();
+    uv_thread_join(&thread);
+  }
+  for (size_t i = 0; i < found.size(); ++i)
+    free(found[i].path);
+  uv_cond_destroy(&cond);
+  uv_mutex_destroy(&lock);
+}
+
+int Walker::Start() {
+#ifdef _WIN32
+  return ENOSYS;
+#else
+  root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0)
+    return errno;
+  if (uv_thread_create(&thread, Run, this) != 0) {
+    close(root_fd);
+    return EAGAIN;
+  }
+  started = true;
+  return 0;
+#endif
+}
+
+bool Walker::Take(std::vector<Entry>* out) {
+  bool done;
+  uv_mutex_lock(&lock);
+  out->insert(out->end(), found.begin(), found.end());
+  found.clear();
+  done = finished;
+  uv_mutex_unlock(&lock);
+  return done;
+}
+
+void Walker::Consumed(size_t count) {
+  uv_mutex_lock(&lock);
+  outstanding -= count;
+  uv_cond_signal(&cond);
+  uv_mutex_unlock(&lock);
+}
+
+void Walker::Stop() {
+  uv_mutex_lock(&lock);
+  stopped = true;
+  uv_cond_signal(&cond);
+  uv_mutex_unlock(&lock);
+}
+
+#ifndef _WIN32
+
+void Walker::Run(void* arg) {
+  Walker* walker = static_cast<Walker*>(arg);
+  std::string rel;
+
+  walker->Walk(walker->root_fd, rel, 0);
+  close(walker->root_fd);
+
+  uv_mutex_lock(&walker->lock);
+  walker->finished = true;
+  uv_mutex_unlock(&walker->lock);
+  walker->notify(walker->data);
+}
+
+// Blocks while too many entries are out; returns false if the walk was
+// stopped meanwhile
+bool Walker::Emit(const std::string& rel, int error) {
+  std::string path = (root == "/" ? root + rel : root + "/" + rel);
+
+  uv_mutex_lock(&lock);
+  while (outstanding >= options.high_water && !stopped)
+    uv_cond_wait(&cond, &lock);
+  if (stopped) {
+    uv_mutex_unlock(&lock);
+    return false;
+  }
+  Entry entry = { strdup(path.c_str()), error };
+  found.push_back(entry);
+  ++outstanding;
+  uv_mutex_unlock(&lock);
+
+  notify(data);
+  return true;
+}
+
+static bool Matches(const std::vector<std::string>& patterns,
+                    const std::string& rel, const char* name) {
+  for (size_t i = 0; i < patterns.size(); ++i) {
+    const std::string& pattern = patterns[i];
+    if (pattern.find('/') == std::string::npos) {
+      if (fnmatch(pattern.c_str(), name, 0) == 0)
+        return true;
+    } else if (fnmatch(pattern.c_str(), rel.c_str(), FNM_PATHNAME) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Walker::Excluded(const std::string& rel, const char* name) const {
+  return Matches(options.exclude, rel, name);
+}
+
+bool Walker::Included(const std::string& rel, const char* name) const {
+  return options.include.empty() || Matches(options.include, rel, name);
+}
+
+// Reads the names in a directory: with getdents64() where available, which
+// returns d_type with each name, and with readdir() elsewhere
+class DirReader {
+public:
+  explicit DirReader(int dirfd) : error(0) {
+#if defined(__linux__) && defined(SYS_getdents64)
+    fd = dirfd;
+    len = pos = 0;
+    buf = static_cast<char*>(malloc(kBufferSize));
+    if (buf == nullptr)
+      error = ENOMEM;
+#else
+    int fd = dup(dirfd);
+    dir = (fd < 0 ? nullptr : fdopendir(fd));
+    if (dir == nullptr) {
+      error = errno;
+      if (fd >= 0)
+        close(fd);
+    }
+#endif
+  }
+
+  ~DirReader() {
+#if defined(__linux__) && defined(SYS_getdents64)
+    free(buf);
+#else
+    if (dir != nullptr)
+      closedir(dir);
+#endif
+  }
+
+  // Returns false at the end of the directory or on error (see `error')
+  bool Next(const char** name, unsigned char* type) {
+    if (error != 0)
+      return false;
+#if defined(__linux__) && defined(SYS_getdents64)
+    struct linux_dirent64 {
+      uint64_t d_ino;
+      int64_t d_off;
+      unsigned short d_reclen;
+      unsigned char d_type;
+      char d_name[1];
+    };
+
+    if (pos >= len) {
+      do {
+        len = syscall(SYS_getdents64, fd, buf, kBufferSize);
+      } while (len < 0 && errno == EINTR);
+      pos = 0;
+      if (len <= 0) {
+        if (len < 0)
+          error = errno;
+        return false;
+      }
+    }
+    struct linux_dirent64* d =
+      reinterpret_cast<struct linux_dirent64*>(buf + pos);
+    pos += d->d_reclen;
+    *name = d->d_name;
+    *type = d->d_type;
+    return true;
+#else
+    struct dirent* d;
+    errno = 0;
+    if ((d = readdir(dir)) == nullptr) {
+      error = errno;
+      return false;
+    }
+    *name = d->d_name;
+# ifdef DT_UNKNOWN
+    *type = d->d_type;
+# else
+    *type = 0;
+# endif
+    return true;
+#endif
+  }
+
+  int error;
+
+private:
+#if defined(__linux__) && defined(SYS_getdents64)
+  static const size_t kBufferSize = 32 * 1024;
+  int fd;
+  char* buf;
+  long len;
+  long pos;
+#else
+  DIR* dir;
+#endif
+};
+
+#ifndef DT_UNKNOWN
+# define DT_UNKNOWN 0
+# define DT_DIR 4
+# define DT_REG 8
+#endif
+
+// Reads the whole directory `dirfd' (`rel' relative to the root), entering
+// subdirectories as they come.  `rel' is used as scratch space and restored.
+void Walker::Walk(int dirfd, std::string& rel, int depth) {
+  DirReader reader(dirfd);
+  size_t rel_len = rel.size();
+  const char* name;
+  unsigned char type;
+
+  while (reader.Next(&name, &type)) {
+    if (name[0] == '.'
+        && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
+    }
+
+    if (rel_len > 0)
+      rel += '/';
+    rel += name;
+
+    if (type == DT_UNKNOWN) {
+      struct stat sb;
+      if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0
+          && S_ISDIR(sb.st_mode)) {
+        type = DT_DIR;
+      } else {
+        type = DT_REG;
+      }
+    }
+
+    bool go_on = true;
+    if (type == DT_DIR) {
+      if (!Excluded(rel, name)
+          && (options.max_depth < 0 || depth < options.max_depth)) {
+        int fd = openat(dirfd, name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+          go_on = Emit(rel, errno);
+        } else {
+          Walk(fd, rel, depth + 1);
+          close(fd);
+        }
+      }
+    } else if (!Excluded(rel, name) && Included(rel, name)) {
+      go_on = Emit(rel, 0);
+    }
+
+    rel.resize(rel_len);
+
+    uv_mutex_lock(&lock);
+    go_on = go_on && !stopped;
+    uv_mutex_unlock(&lock);
+    if (!go_on)
+      return;
+  }
+
+  if (reader.error != 0 && rel_len > 0)
+    Emit(rel, reader.error);
+}
+
+#else  // _WIN32
+
+void Walker::Run(void* arg) {
+}
+
+bool Walker::Emit(const std::string& rel, int error) {
+  return false;
+}
+
+bool Walker::Excluded(const std::string& rel, const char* name) const {
+  return false;
+}
+
+bool Walker::Included(const std::string& rel, const char* name) const {
+  return false;
+}
+
+void Walker::Walk(int dirfd, std::string& rel, int depth) {
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MMMAGIC_WALKER_H
+#define MMMAGIC_WALKER_H
+
+#include <stddef.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+
+// Walks a directory tree on its own thread and hands out the paths of the
+// non-directory entries it finds.  At most `high_water' entries are handed
+// out and not yet released with Consumed(); past that the walk pauses until
+// the consumer catches up.
+class Walker {
+public:
+  struct Entry {
+    char* path;
+    // errno when `path' is a directory that could not be read
+    int error;
+  };
+
+  struct Options {
+    // Levels of directories to enter below the root, -1 for no limit
+    int max_depth;
+    // Glob patterns (see fnmatch(3)); patterns without a '/' are matched
+    // against the entry's name and the others against its path relative to
+    // the root.  Excluded directories are not entered; `include' only applies
+    // to files.
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    size_t high_water;
+  };
+
+  Walker(const char* root, const Options& options,
+         void (*notify)(void*), void* data);
+  ~Walker();
+
+  // Returns an errno value if the root cannot be read
+  int Start();
+  // Moves the entries found so far to `out'; returns true once the walk is
+  // over and every entry has been taken
+  bool Take(std::vector<Entry>* out);
+  void Consumed(size_t count);
+  void Stop();
+
+private:
+  static void Run(void* arg);
+  void Walk(int dirfd, std::string& rel, int depth);
+  bool Emit(const std::string& rel, int error);
+  bool Excluded(const std::string& rel, const char* name) const;
+  bool Included(const std::string& rel, const char* name) const;
+
+  std::string root;
+  Options options;
+  void (*notify)(void*);
+  void* data;
+
+  int root_fd;
+  uv_thread_t thread;
+  bool started;
+
+  uv_mutex_t lock;
+  uv_cond_t cond;
+  std::vector<Entry> found;
+  size_t outstanding;
+  bool finished;
+  bool stopped;
+};
+
+#endif
@@ -87,6 +87,244 @@ var tests = [
     },
     what: 'detectFile - UTF-8 filename'
   },
+  { run: function() {
+      var magicpath = path.join(__dirname, 'fixtures', 'budget.magic');
+      var base = path.join(require('os').tmpdir(), 'mmmagic-stat-' + process.pid);
+      var file = base + '.txt';
+      var link = base + '.lnk';
+      var nolink = process.platform === 'win32';
+      var cases = [
+        [ mmm.MAGIC_MIME_TYPE, file, 'application/x-second' ],
+        [ mmm.MAGIC_MIME_TYPE, base + '.missing', null ]
+      ];
+      fs.writeFileSync(file, 'TWO\n');
+      if (!nolink) {
+        fs.symlinkSync(file, link);
+        cases.push([ mmm.MAGIC_MIME_TYPE, link, 'inode/symlink' ],
+                   [ mmm.MAGIC_MIME_TYPE | mmm.MAGIC_SYMLINK, link,
+                     'application/x-second' ]);
+      }
+      (function check(i) {
+        if (i === cases.length) {
+          fs.unlinkSync(file);
+          if (!nolink)
+            fs.unlinkSync(link);
+          return next();
+        }
+        var magic = new mmm.Magic(magicpath, cases[i][0]);
+        magic.detectFile(cases[i][1], function(err, result) {
+          if (cases[i][2] === null) {
+            assert(err);
+            assert.strictEqual(result, undefined);
+          } else {
+            assert.strictEqual(err, null);
+            assert.strictEqual(result, cases[i][2]);
+          }
+          check(i + 1);
+        });
+      })(0);
+    },
+    what: 'detectFile - Regular file, symlink and missing path'
+  },
+  { run: function() {
+      var fd = fs.openSync(path.join(__dirname, '..', 'src', 'binding.cc'), 'r');
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      magic.detectFd(fd, 0, function(err, result) {
+        fs.closeSync(fd);
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'text/x-c++');
+        next();
+      });
+    },
+    what: 'detectFd - Normal operation, mime type'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'budget.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var filepath = path.join(require('os').tmpdir(),
+                               'mmmagic-fh-' + process.pid);
+      fs.writeFileSync(filepath, 'TWO\n');
+      fs.promises.open(filepath, 'r').then(function(fh) {
+        magic.detectFd(fh, function(err, result) {
+          fh.close().then(function() {
+            fs.unlinkSync(filepath);
+            assert.strictEqual(err, null);
+            assert.strictEqual(result, 'application/x-second');
+            next();
+          });
+        });
+      });
+    },
+    what: 'detectFd - FileHandle'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'budget.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var filepath = path.join(require('os').tmpdir(),
+                               'mmmagic-pos-' + process.pid);
+      fs.writeFileSync(filepath, 'xxTWO\nrest');
+      var fd = fs.openSync(filepath, 'r');
+      var buf = Buffer.alloc(4);
+      // Leaves the file position at 2
+      assert.strictEqual(fs.readSync(fd, buf, 0, 2, null), 2);
+      magic.detectFd(fd, 2, function(err, result) {
+        var n = fs.readSync(fd, buf, 0, 4, null);
+        fs.closeSync(fd);
+        fs.unlinkSync(filepath);
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'application/x-second');
+        assert.strictEqual(buf.toString('latin1', 0, n), 'TWO\n');
+        next();
+      });
+    },
+    what: 'detectFd - File position left untouched'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'budget.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var fd = fs.openSync(path.join(__dirname, 'fixtures', 'tree', 'a.two'),
+                           'r');
+      magic.detectFd(fd, function(err, result) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'application/x-second');
+        magic.detectFd(fd, function(err, result) {
+          fs.closeSync(fd);
+          assert.strictEqual(err, null);
+          assert.strictEqual(result, 'application/x-second');
+          // The second call reuses the handle the first one loaded
+          var stats = magic.stats();
+          assert.strictEqual(stats.handles, 1);
+          assert.strictEqual(stats.load.count, 1);
+          next();
+        });
+      });
+    },
+    what: 'detectFd - Handle reused across calls'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      magic.detectFiles([
+        path.join(__dirname, '..', 'src', 'binding.cc'),
+        '/no/such/path1234567',
+        path.join(__dirname, 'fixtures', 'tést.txt'),
+      ], function(err, results) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(results.length, 3);
+        assert.strictEqual(results[0], 'text/x-c++');
+        assert(results[1] instanceof Error);
+        assert.strictEqual(results[2], 'text/x-c++');
+        next();
+      });
+    },
+    what: 'detectFiles - Normal operation, mime type'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      var filepath = path.join(__dirname, '..', 'src', 'binding.cc');
+      magic.setConcurrency({ io: 1, queue: 1, cpu: 1 });
+      magic.detectFiles([ filepath, filepath, filepath ],
+                        function(err, results) {
+        assert.strictEqual(err, null);
+        assert.deepStrictEqual(results,
+                               [ 'text/x-c++', 'text/x-c++', 'text/x-c++' ]);
+        next();
+      });
+    },
+    what: 'detectFiles - Limited concurrency'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'tree.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var iter = magic.detectTree(path.join(__dirname, 'fixtures', 'tree'),
+                                  { include: '*.two', batchSize: 1 });
+      var found = [];
+      (function read() {
+        iter.next().then(function(res) {
+          if (res.done) {
+            found.sort();
+            assert.deepStrictEqual(found, [ 'a.two', 'b.two' ]);
+            return next();
+          }
+          assert.strictEqual(res.value.type, 'application/x-second');
+          found.push(path.basename(res.value.path));
+          read();
+        }, function(err) {
+          assert(false, err);
+        });
+      })();
+    },
+    what: 'detectTree - Normal operation, mime type'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      var filepath = path.join(__dirname, '..', 'src', 'binding.cc');
+      var stream = magic.createDetectStream();
+      var chunks = [];
+      var type;
+      stream.on('type', function(result) {
+        type = result;
+      });
+      stream.on('data', function(chunk) {
+        chunks.push(chunk);
+      });
+      stream.on('end', function() {
+        assert.strictEqual(type, 'text/x-c++');
+        assert.strictEqual(stream.type, 'text/x-c++');
+        assert(Buffer.concat(chunks).equals(fs.readFileSync(filepath)));
+        next();
+      });
+      fs.createReadStream(filepath, { highWaterMark: 1024 }).pipe(stream);
+    },
+    what: 'createDetectStream - Normal operation, mime type'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      var data = fs.readFileSync(path.join(__dirname, '..', 'src', 'binding.cc'));
+      var detector = magic.createDetector();
+      detector.feed(data.slice(0, 100), function(err, result) {
+        assert.strictEqual(err, null);
+        // Text is only settled at the end
+        assert.strictEqual(result, null);
+        detector.feed(data.slice(100), function(err, result) {
+          assert.strictEqual(err, null);
+          assert.strictEqual(result, null);
+          detector.end(function(err, result) {
+            assert.strictEqual(err, null);
+            assert.strictEqual(result, 'text/x-c++');
+            next();
+          });
+        });
+      });
+    },
+    what: 'createDetector - Normal operation, mime type'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'budget.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var buf = Buffer.alloc(1000, 'plain text ');
+      var detector = magic.createDetector();
+      (function feed(i) {
+        if (i < buf.length) {
+          return detector.feed(buf.slice(i, i + 1), function(err, result) {
+            assert.strictEqual(err, null);
+            assert.strictEqual(result, null);
+            feed(i + 1);
+          });
+        }
+        detector.end(function(err, result) {
+          assert.strictEqual(err, null);
+          // Evaluated at 1, 2, 4, ... 512 bytes and at end() only
+          assert.strictEqual(magic.stats().total.count, 11);
+          magic.detect(buf, function(err, whole) {
+            assert.strictEqual(err, null);
+            assert.strictEqual(result, whole);
+            next();
+          });
+        });
+      })(0);
+    },
+    what: 'createDetector - Byte by byte, same result'
+  },
   { run: function() {
       var buf = fs.readFileSync(path.join(__dirname, '..', 'src', 'binding.cc'));
       var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
@@ -98,6 +336,427 @@ var tests = [
     },
     what: 'detect - Normal operation, mime type'
   },
+  { run: function() {
+      var buf = fs.readFileSync(path.join(__dirname, '..', 'src', 'binding.cc'));
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      var bufs = [];
+      for (var i = 0; i < buf.length; i += 1000)
+        bufs.push(buf.slice(i, i + 1000));
+      magic.detect(bufs, function(err, result) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'text/x-c++');
+        next();
+      });
+    },
+    what: 'detect - Array of Buffers, mime type'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'tail.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var buf = Buffer.alloc(256 * 1024, 1);
+      buf.write('TAIL', buf.length - 4);
+      // The magic reads across the last two Buffers
+      magic.detect([ buf.slice(0, 1000),
+                     buf.slice(1000, buf.length - 2),
+                     buf.slice(buf.length - 2) ], function(err, result) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'application/x-trailer');
+        next();
+      });
+    },
+    what: 'detect - Array of Buffers, magic spanning Buffers'
+  },
+  { run: function() {
+      // Entries are rejected from their value before they are evaluated,
+      // except under `use ^name' and with MAGIC_DEBUG or MAGIC_PROFILE,
+      // which must all give the same results
+      var magicpath = path.join(__dirname, 'fixtures', 'hot.magic');
+      var flags = mmm.MAGIC_CONTINUE
+                  | mmm.MAGIC_NO_CHECK_TEXT
+                  | mmm.MAGIC_NO_CHECK_ENCODING;
+      var cases = [
+        [ 'ABCDEFGHIJKLEND!',
+          'string-long|bequad|belong|belong-at-end|string-at-end'
+          + '|beshort-masked|string-short|data' ],
+        [ '\x00ABA', 'leshort-masked|uleshort-not|byte-not|data' ],
+        [ 'DCBAxxxx', 'lelong|uleshort-not|byte-not|data' ],
+        [ 'HGFEDCBA', 'lequad|uleshort-not|byte-not|data' ],
+        [ '\x80\x00\x00\x01',
+          'ubelong-above|belong-negative|string-above|uleshort-not'
+          + '|byte-not|data' ],
+        [ '\x00\x80', 'leshort-negative|uleshort-not|byte-not|data' ],
+        [ 'Zebra', 'string-above|uleshort-not|byte-not|data' ],
+        [ 'ABCDEFG', 'belong|beshort-masked|string-short|data' ],
+        [ 'ABCDEFGHI', 'bequad|belong|beshort-masked|string-short|data' ],
+        [ 'ABCDEFGHIX', 'bequad|belong|beshort-masked|string-short|data' ],
+        [ 'ABCDEFGHIJ',
+          'string-long|bequad|belong|beshort-masked|string-short|data' ],
+        [ 'FLIP\x02\x01', 'flip pair-le|uleshort-not|byte-not|data' ],
+        [ 'NOFL\x02\x01', 'noflip pair-le|uleshort-not|byte-not|data' ],
+        [ 'NOFL\x01\x02', 'noflip pair-be|uleshort-not|byte-not|data' ],
+      ];
+      var data = cases.map(function(c) { return c[0]; });
+      var expected = cases.map(function(c) { return c[1]; });
+      detectAll(magicpath, flags, data, function(results) {
+        assert.deepStrictEqual(results, expected);
+        detectAll(magicpath, flags | mmm.MAGIC_PROFILE, data,
+                  function(results) {
+          assert.deepStrictEqual(results, expected);
+          assert.deepStrictEqual(detectAllDebug(magicpath, flags, data),
+                                 expected);
+          next();
+        });
+      });
+    },
+    what: 'detect - Quick rejection of magic entries'
+  },
+  { run: function() {
+      // Entries that do not match are skipped past their continuations,
+      // and top-level entries past the whole of theirs
+      var magicpath = path.join(__dirname, 'fixtures', 'nested.magic');
+      var flags = mmm.MAGIC_NO_CHECK_TEXT | mmm.MAGIC_NO_CHECK_ENCODING;
+      var cases = [
+        [ 'NEST\x01\x02\x03', 'nest one two three, byte4=1, byte5=2, part=3' ],
+        [ 'NEST\x01\x02\x04\x07\x04\x05',
+          'nest one two, byte4=1, byte5=2 four, next=7, part=4 seven four'
+          + ' five, next=5, part=4' ],
+        [ 'NEST\x02\x09\x04\x05\x00',
+          'nest, byte4=2 nine never four five, next=5, part=4, byte5=9 four'
+          + ' five, next=5, part=4' ],
+        [ 'NEST\x02\x03\x04\x07\x07\x04\x06',
+          'nest, byte4=2, byte5=3 four, next=7, part=4 seven, part=7' ],
+        [ 'NEST\x01\x03', 'nest one, byte4=1, byte5=3, part=0' ],
+        [ 'NEST\x01\x02\x03\x07\x04\x05\x09',
+          'nest one two three, byte4=1, byte5=2, part=3 seven four five'
+          + ' never, next=5, part=4' ],
+        [ 'OTHER\x06\x06', 'other, byte5=6 six' ],
+        [ 'OTHER\x05', 'other, byte5=5' ],
+        [ 'NESX\x01', 'data' ],
+      ];
+      var data = cases.map(function(c) { return c[0]; });
+      var expected = cases.map(function(c) { return c[1]; });
+      detectAll(magicpath, flags, data, function(results) {
+        assert.deepStrictEqual(results, expected);
+        assert.deepStrictEqual(detectAllDebug(magicpath, flags, data),
+                               expected);
+        next();
+      });
+    },
+    what: 'detect - Nested continuations and named entries'
+  },
+  { run: function() {
+      // Each soft magic pass walks only the top-level entries that apply to
+      // it; a named entry is reached from either
+      var magicpath = path.join(__dirname, 'fixtures', 'pass.magic');
+      var cases = [
+        [ 'TXT+ hello\n', 'text-only, plus, ASCII text' ],
+        [ 'TXT+\x00\x01\x02', 'data' ],
+        [ 'BIN+\x00\x01\x02', 'binary-only, plus' ],
+        [ 'BIN+ hello\n', 'ASCII text' ],
+        [ 'ANY+ hello\n', 'either, plus' ],
+        [ 'ANY+\x00\x01\x02', 'either, plus' ],
+        [ 'ANY?\x00\x01', 'either' ],
+      ];
+      var data = cases.map(function(c) { return c[0]; });
+      var expected = cases.map(function(c) { return c[1]; });
+      detectAll(magicpath, 0, data, function(results) {
+        assert.deepStrictEqual(results, expected);
+        assert.deepStrictEqual(detectAllDebug(magicpath, 0, data), expected);
+        partial(0);
+      });
+
+      // A detector walks all of the entries (its input may turn out to be
+      // text or not), and settles on the same results.  Without the checks
+      // that need all of the input, a match is settled on the first feed().
+      var flags = 0x001000 /* MAGIC_NO_CHECK_COMPRESS */
+                  | mmm.MAGIC_NO_CHECK_TAR
+                  | mmm.MAGIC_NO_CHECK_CDF
+                  | mmm.MAGIC_NO_CHECK_ELF
+                  | mmm.MAGIC_NO_CHECK_TEXT
+                  | mmm.MAGIC_NO_CHECK_ENCODING;
+      var magic = new mmm.Magic(magicpath, flags);
+      function partial(i) {
+        if (i === data.length)
+          return next();
+        var buf = Buffer.from(data[i], 'latin1');
+        magic.detect(buf, function(err, whole) {
+          assert.strictEqual(err, null);
+          var detector = magic.createDetector();
+          detector.feed(buf, function(err, result) {
+            assert.strictEqual(err, null);
+            if (whole === 'data') {
+              assert.strictEqual(result, null);
+              return detector.end(function(err, result) {
+                assert.strictEqual(err, null);
+                assert.strictEqual(result, whole);
+                partial(i + 1);
+              });
+            }
+            assert.strictEqual(result, whole);
+            partial(i + 1);
+          });
+        });
+      }
+    },
+    what: 'detect - Soft magic passes'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'tail.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var filepath = path.join(require('os').tmpdir(),
+                               'mmmagic-tail-' + process.pid);
+      var buf = Buffer.alloc(4 * 1024 * 1024, 'x');
+      buf.write('TAIL', buf.length - 4);
+      fs.writeFileSync(filepath, buf);
+      magic.detectFile(filepath, function(err, result) {
+        fs.unlinkSync(filepath);
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'application/x-trailer');
+        next();
+      });
+    },
+    what: 'detectFile - End-relative offset past the read limit'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'tailuse.magic'));
+      var buf = Buffer.alloc(64, 'x');
+      buf.write('HEAD', 0);
+      buf.write('TAIL', buf.length - 4);
+      magic.detect(buf, function(err, result) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'header, trailer');
+        // The end of the data is before the base the entry is used at
+        magic.detect(Buffer.from('HEADTAIL'), function(err, result) {
+          assert.strictEqual(err, null);
+          assert.strictEqual(result, 'header');
+          next();
+        });
+      });
+    },
+    what: 'detect - End-relative offset in a named entry'
+  },
+  { run: function() {
+      var magicpath = path.join(__dirname, 'fixtures', 'tail.magic');
+      var filepath = path.join(require('os').tmpdir(),
+                               'mmmagic-nocache-' + process.pid);
+      var buf = Buffer.alloc(4 * 1024 * 1024, 'x');
+      buf.write('TAIL', buf.length - 4);
+      fs.writeFileSync(filepath, buf);
+      // The read-ahead stage (detectFile()) and libmagic's own reads
+      // (detectFd()), each with and without MAGIC_NOCACHE
+      var cases = [];
+      [ 0, mmm.MAGIC_NOCACHE ].forEach(function(flag) {
+        var magic = new mmm.Magic(magicpath, mmm.MAGIC_MIME_TYPE | flag);
+        cases.push(function(cb) {
+          magic.detectFile(filepath, cb);
+        }, function(cb) {
+          var fd = fs.openSync(filepath, 'r');
+          magic.detectFd(fd, 0, function(err, result) {
+            fs.closeSync(fd);
+            cb(err, result);
+          });
+        });
+      });
+      (function check(i) {
+        if (i === cases.length) {
+          fs.unlinkSync(filepath);
+          return next();
+        }
+        cases[i](function(err, result) {
+          assert.strictEqual(err, null);
+          assert.strictEqual(result, 'application/x-trailer');
+          check(i + 1);
+        });
+      })(0);
+    },
+    what: 'detectFile - MAGIC_NOCACHE reads the same'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      assert.strictEqual(magic.stats().total.count, 0);
+      magic.detect(fs.readFileSync(__filename), function(err, result) {
+        assert.strictEqual(err, null);
+        var stats = magic.stats();
+        assert.strictEqual(stats.total.count, 1);
+        assert.strictEqual(stats.load.count, 1);
+        assert.strictEqual(stats.read.count, 0);
+        assert(stats.total.max >= stats.total.min);
+        assert.strictEqual(stats.total.buckets[stats.total.buckets.length - 1]
+                             .le,
+                           Infinity);
+        assert.strictEqual(stats.total.buckets[stats.total.buckets.length - 1]
+                             .count,
+                           1);
+        assert.deepStrictEqual(Object.keys(stats.phases),
+                               ['encoding', 'compress', 'tar', 'cdf', 'soft',
+                                'elf', 'text']);
+        next();
+      });
+    },
+    what: 'stats - Detection timings'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'tail.magic'),
+                                mmm.MAGIC_MIME_TYPE | mmm.MAGIC_PROFILE);
+      var buf = Buffer.alloc(1024, 1);
+      buf.write('TAIL', buf.length - 4);
+      magic.detect(buf, function(err, result) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'application/x-trailer');
+        var profile = magic.profile();
+        assert.strictEqual(profile.length, 1);
+        assert.strictEqual(profile[0].line, 2);
+        assert.strictEqual(profile[0].mimeType, 'application/x-trailer');
+        assert.strictEqual(profile[0].evaluations, 1);
+        assert.strictEqual(profile[0].matches, 1);
+        var touched = magic.stats().touched['application/x-trailer'];
+        assert.strictEqual(touched.count, 1);
+        assert.strictEqual(touched.max, buf.length);
+        next();
+      });
+    },
+    what: 'profile - Magic entry counters'
+  },
+  { run: function() {
+      var fd = fs.openSync(process.execPath, 'r');
+      var head = Buffer.alloc(4);
+      fs.readSync(fd, head, 0, 4, 0);
+      // Needs a large ELF file: node itself, where it is one
+      if (head.toString('latin1') !== '\x7fELF'
+          || fs.fstatSync(fd).size <= 2 * 1024 * 1024) {
+        fs.closeSync(fd);
+        return next();
+      }
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'elf.magic'),
+                                mmm.MAGIC_PROFILE);
+      magic.detectFd(fd, function(err, result) {
+        fs.closeSync(fd);
+        assert.strictEqual(err, null);
+        var touched = magic.stats().touched[result];
+        assert.strictEqual(touched.count, 1);
+        // The section headers are read through the descriptor, usually
+        // from the end of the file, past the 1 MB read window
+        assert(touched.max > 1024 * 1024);
+        next();
+      });
+    },
+    what: 'stats - Extents read by the ELF reader'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      var buf = Buffer.from('hello world\n');
+      var results = [];
+      magic.setLimits({ maxRequests: 1, policy: 'reject' });
+      function done(err, result) {
+        results.push([err, result]);
+        if (results.length < 2)
+          return;
+        results.sort(function(a, b) { return (a[0] ? 0 : 1) - (b[0] ? 0 : 1); });
+        assert.strictEqual(results[0][0].code, 'EBUSY');
+        assert.strictEqual(results[1][0], null);
+        assert.strictEqual(results[1][1], 'text/plain');
+        var stats = magic.stats();
+        assert.strictEqual(stats.rejected, 1);
+        assert.strictEqual(stats.inFlight, 0);
+        assert.strictEqual(stats.pinnedBytes, 0);
+        next();
+      }
+      magic.detect(buf, done);
+      magic.detect(buf, done);
+    },
+    what: 'setLimits - Reject past maxRequests'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'budget.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var results = [];
+      magic.setLimits({ maxBytes: 4, policy: 'reject' });
+      function done(err, result) {
+        results.push([err, result]);
+        if (results.length < 2)
+          return;
+        results.sort(function(a, b) { return (a[0] ? 0 : 1) - (b[0] ? 0 : 1); });
+        assert.strictEqual(results[0][0].code, 'EBUSY');
+        assert.strictEqual(results[1][0], null);
+        assert.strictEqual(results[1][1], 'application/x-second');
+        assert.strictEqual(magic.stats().pinnedBytes, 0);
+        next();
+      }
+      // Started as nothing else is in flight, and then over the limit
+      magic.detect(Buffer.from('TWO\n\n\n\n\n'), done);
+      magic.detect(Buffer.from('T'), done);
+    },
+    what: 'setLimits - Reject past maxBytes after an oversized call'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(mmm.MAGIC_MIME_TYPE);
+      var buf = Buffer.from('hello world\n');
+      var ac = new AbortController();
+      var results = [];
+      magic.setLimits({ maxRequests: 1 });
+      function done(err, result) {
+        results.push([err, result]);
+        if (results.length < 2)
+          return;
+        results.sort(function(a, b) { return (a[0] ? 0 : 1) - (b[0] ? 0 : 1); });
+        assert.strictEqual(results[0][0].name, 'AbortError');
+        assert.strictEqual(results[1][0], null);
+        assert.strictEqual(results[1][1], 'text/plain');
+        assert.strictEqual(magic.stats().total.count, 1);
+        next();
+      }
+      // Both return the instance, as the native detect() does
+      assert.strictEqual(magic.detect(buf, done), magic);
+      assert.strictEqual(magic.detect(buf, { signal: ac.signal }, done),
+                         magic);
+      ac.abort();
+    },
+    what: 'detect - Abort a waiting detection'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'budget.magic'),
+                                mmm.MAGIC_MIME_TYPE);
+      var buf = Buffer.from('TWO\n');
+      magic.setBudget({ evaluations: 1 });
+      magic.detect(buf, function(err, result, truncated) {
+        assert.strictEqual(err, null);
+        assert.strictEqual(result, 'text/plain');
+        assert.strictEqual(truncated, true);
+        magic.setBudget({ evaluations: Infinity });
+        magic.detect(buf, function(err, result, truncated) {
+          assert.strictEqual(err, null);
+          assert.strictEqual(result, 'application/x-second');
+          assert.strictEqual(truncated, false);
+          assert.strictEqual(magic.stats().truncated, 1);
+          next();
+        });
+      });
+    },
+    what: 'setBudget - Evaluation budget'
+  },
+  { run: function() {
+      var magic = new mmm.Magic(path.join(__dirname, 'fixtures', 'budget.magic'));
+      magic.detectFile(__filename, function(err) {
+        assert.strictEqual(err, null);
+        var stats = magic.stats();
+        assert.deepStrictEqual(Object.keys(stats.loadSteps),
+                               ['map', 'check', 'byteswap', 'parse']);
+        assert.strictEqual(stats.loadSteps.map.count, 0);
+        assert.strictEqual(stats.handles, 1);
+        assert(stats.database > 0);
+        next();
+      });
+    },
+    what: 'stats - Database load steps'
+  },
+  { run: function() {
+      assert.notStrictEqual(['scalar', 'sse2', 'avx2', 'avx512', 'neon']
+                              .indexOf(mmm.simd),
+                            -1);
+      next();
+    },
+    what: 'simd - Vector unit picked for byte scanning'
+  },
 ];
 
 function next() {
@@ -114,6 +773,39 @@ function next() {
   v.run.call(v);
 }
 
+// Calls back with the results of detect() on each of the latin1 strings in
+// `data', MAGIC_CONTINUE's lists joined with '|'
+function detectAll(magicpath, flags, data, cb) {
+  var magic = new mmm.Magic(magicpath, flags);
+  var results = [];
+  (function detect(i) {
+    if (i === data.length)
+      return cb(results);
+    magic.detect(Buffer.from(data[i], 'latin1'), function(err, result) {
+      results.push(err ? err.message : [].concat(result).join('|'));
+      detect(i + 1);
+    });
+  })(0);
+}
+
+// detectAll() with MAGIC_DEBUG, in a child process so that the trace it
+// prints goes nowhere
+function detectAllDebug(magicpath, flags, data) {
+  var script = 'var mmm = require(process.argv[1]);\n'
+               + detectAll + '\n'
+               + 'detectAll(process.argv[2], +process.argv[3], '
+               + 'JSON.parse(process.argv[4]), function(results) {\n'
+               + '  process.stdout.write(JSON.stringify(results));\n'
+               + '});\n';
+  var out = require('child_process').execFileSync(
+    process.execPath,
+    [ '-e', script, path.join(__dirname, '..', 'lib', 'index'), magicpath,
+      String(flags | mmm.MAGIC_DEBUG), JSON.stringify(data) ],
+    { stdio: [ 'ignore', 'pipe', 'ignore' ] }
+  );
+  return JSON.parse(out);
+}
+
 function makeMsg(msg) {
   var fmtargs = ['[%s]: ' + msg, tests[t].what];
   for (var i = 1; i < arguments.length; ++i)